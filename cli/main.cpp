@@ -18,18 +18,25 @@
  */
 
 #include <iostream>
+#include <climits>
 #include <cstring>
 #include <vector>
 #include <map>
+#include <fcntl.h>
+#include <sys/wait.h>
+#include <unistd.h>
 #include <kafe/version.hpp>
 #include <kafe/project.hpp>
 #include <kafe/context.hpp>
+#include <kafe/remote/ssh_broker.hpp>
+#include <kafe/runtime/cancellation.hpp>
 
 #include "main.hpp"
 #include "logger.hpp"
 
 using namespace std;
 using namespace kafe;
+using namespace kafe::remote;
 
 #if __APPLE__
 extern char** environ;
@@ -57,6 +64,7 @@ void print_usage() {
     cout << "Usage: kafe <command> [arguments, ...]" << endl;
     cout << "       kafe do <environment> <task,task,task,...>" << endl;
     cout << "       kafe local <task,task,task,...>" << endl;
+    cout << "       kafe broker" << endl;
     cout << "       kafe <help|--help>" << endl;
     cout << "       kafe <version|--version> [--lib]" << endl;
     cout << "       kafe <about|--about>" << endl;
@@ -65,6 +73,7 @@ void print_usage() {
 
     cout << " kafe do: execute tasks from project file with given environment." << endl;
     cout << " kafe local: execute tasks from project file on localhost." << endl;
+    cout << " kafe broker: keep SSH connections open for other kafe invocations, if KAFE_SSH_BROKER is set." << endl;
     cout << " kafe help: display this help." << endl;
     cout << " kafe version: display KAFE program version and exit. Optionally,"
             " show libkafe version used if argument --lib is set." << endl;
@@ -123,6 +132,54 @@ vector<string> split_csv_arguments(const string &arguments, char delimiter) {
     return result;
 }
 
+void start_broker(const map<const string, const string> &envVals, const char *argv0) {
+    auto socket_path = SshBroker::get_socket_path(&envVals);
+
+    if (SshBroker::is_running(socket_path)) {
+        return;
+    }
+
+    char self[PATH_MAX];
+    auto length = readlink("/proc/self/exe", self, sizeof(self) - 1);
+    if (length > 0) {
+        self[length] = '\0';
+    } else {
+        strncpy(self, argv0, sizeof(self) - 1);
+        self[sizeof(self) - 1] = '\0';
+    }
+
+    auto pid = fork();
+    if (pid < 0) {
+        // Commands are executed over direct connections instead
+        return;
+    }
+
+    if (0 == pid) {
+        // Detach twice, so that broker is not a child of this process and outlives it
+        setsid();
+        if (0 != fork()) {
+            _exit(0);
+        }
+
+        auto null_fd = open("/dev/null", O_RDWR);
+        if (null_fd >= 0) {
+            dup2(null_fd, STDIN_FILENO);
+            dup2(null_fd, STDOUT_FILENO);
+            dup2(null_fd, STDERR_FILENO);
+        }
+
+        execlp(self, "kafe", "broker", nullptr);
+        _exit(127);
+    }
+
+    waitpid(pid, nullptr, 0);
+
+    // Give broker a moment to start listening
+    for (int attempt = 0; attempt < 50 && !SshBroker::is_running(socket_path); attempt++) {
+        usleep(20000);
+    }
+}
+
 int main(int argc, char *argv[]) {
     if (argc < 2) {
         cerr << "Missing command to execute";
@@ -153,6 +210,13 @@ int main(int argc, char *argv[]) {
         }
 
         try {
+            if (SshBroker::is_enabled(&envVals)) {
+                start_broker(envVals, argv[0]);
+            }
+
+            // First interrupt lets commands in progress stop cleanly and skips the rest
+            Cancellation::install_interrupt_handler();
+
             auto project = Project("kafe.lua");
             auto logger = Logger();
             auto context = Context(envVals, environment, task_list_v, &logger);
@@ -199,6 +263,21 @@ int main(int argc, char *argv[]) {
         return 0;
     }
 
+    if (0 == strcmp("broker", argv[1])) {
+        map<const string, const string> envVals;
+        loadEnvMap(envVals);
+
+        try {
+            auto logger = Logger();
+            auto broker = SshBroker(&envVals, &logger);
+            broker.run();
+        } catch (RuntimeException &e) {
+            cerr << e.what() << endl;
+            return 1;
+        }
+        return 0;
+    }
+
     if (0 == strcmp("about", argv[1]) || 0 == strcmp("--about", argv[1])) {
         print_about();
         return 0;
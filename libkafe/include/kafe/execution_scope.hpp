@@ -47,6 +47,7 @@ namespace kafe {
         const vector<string> &extra_args;
         const string& project_file;
         bool is_strict_exec_mode = false;
+        ExecutionScope *parent = nullptr;
     public:
         explicit ExecutionScope(
                 const Context &context,
@@ -55,6 +56,17 @@ namespace kafe {
                 const string& project_file
         );
 
+        /**
+         * Create a node scope sharing pool and tasks with the parent scope, but with its own copy of
+         * runtime variables, strict mode, local API and current remote API - nodes running in parallel
+         * change local directory without affecting each other.
+         */
+        explicit ExecutionScope(const ExecutionScope *parent);
+
+        ExecutionScope(const ExecutionScope &) = delete;
+
+        ExecutionScope &operator=(const ExecutionScope &) = delete;
+
         [[nodiscard]] const Context *get_context() const;
 
         [[nodiscard]] const Inventory *get_inventory() const;
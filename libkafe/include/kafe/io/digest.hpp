@@ -0,0 +1,94 @@
+/**
+ * This file is part of Kafe.
+ * https://github.com/libkafe/kafe/
+ *
+ * Copyright 2020 Matiss Treinis
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef LIBKAFE_IO_DIGEST_HPP
+#define LIBKAFE_IO_DIGEST_HPP
+
+#include <cstdint>
+#include <string>
+
+using namespace std;
+
+namespace kafe::io {
+    /**
+     * SHA-256 message digest, compatible with output of sha256sum.
+     */
+    class Sha256 {
+        uint32_t state[8]{};
+        uint8_t block[64]{};
+        size_t block_size = 0;
+        uint64_t length = 0;
+
+        void transform(const uint8_t *data);
+
+    public:
+        static const size_t DIGEST_SIZE = 32;
+
+        Sha256();
+
+        void update(const void *data, size_t size);
+
+        /**
+         * Finish digest and get it as lowercase hex string. Digest is reset afterwards.
+         */
+        string hex_digest();
+
+        static string hex_digest(const void *data, size_t size);
+
+        /**
+         * Digest given range of a file, whole file if size is 0.
+         */
+        static string file_hex_digest(const string &path, uint64_t offset, uint64_t size);
+
+        static string file_hex_digest(const string &path);
+    };
+
+    /**
+     * SHA-1 message digest, only for HMAC-SHA1 of hashed host names in known hosts files - not for anything where
+     * collision resistance matters.
+     */
+    class Sha1 {
+        uint32_t state[5]{};
+        uint8_t block[64]{};
+        size_t block_size = 0;
+        uint64_t length = 0;
+
+        void transform(const uint8_t *data);
+
+    public:
+        static const size_t DIGEST_SIZE = 20;
+        static const size_t BLOCK_SIZE = 64;
+
+        Sha1();
+
+        void update(const void *data, size_t size);
+
+        /**
+         * Finish digest and get it as raw bytes. Digest is reset afterwards.
+         */
+        string digest();
+
+        /**
+         * Get HMAC-SHA1 of given data as raw bytes.
+         */
+        static string hmac(const string &key, const string &data);
+    };
+}
+
+#endif
@@ -0,0 +1,119 @@
+/**
+ * This file is part of Kafe.
+ * https://github.com/libkafe/kafe/
+ *
+ * Copyright 2020 Matiss Treinis
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef LIBKAFE_IO_OUTPUT_CAPTURE_HPP
+#define LIBKAFE_IO_OUTPUT_CAPTURE_HPP
+
+#include <deque>
+#include <functional>
+#include <string>
+#include <string_view>
+
+using namespace std;
+
+namespace kafe::io {
+    typedef function<void(string_view line)> OutputLineListener;
+
+    /**
+     * Receives output lines of a running command as they arrive. Returning false requests the command to be stopped.
+     */
+    typedef function<bool(bool is_stderr, string_view line)> OutputLineCallback;
+
+    /**
+     * Limits what part of command output is kept in memory. Default policy keeps everything.
+     */
+    struct OutputCapturePolicy {
+        // Keep at most given number of bytes from the start of output, 0 - unlimited
+        size_t head_bytes = 0;
+        // Keep only given number of last lines, 0 - unlimited. Takes precedence over head_bytes
+        size_t tail_lines = 0;
+        // Keep only lines matching given shell wildcard pattern, empty - all lines
+        string filter;
+
+        [[nodiscard]] bool is_bounded() const;
+    };
+
+    /**
+     * Captures command output read in large chunks, splitting it into lines for the listener (if any) as it arrives.
+     * Lines handed to the listener include the trailing newline and are only valid for the duration of the call.
+     */
+    class OutputCapture {
+        OutputLineListener listener;
+        bool retain;
+        OutputCapturePolicy policy;
+        char *buffer = nullptr;
+        size_t size = 0;
+        size_t capacity = 0;
+        size_t line_start = 0;
+        string kept;
+        deque<string> kept_tail;
+        bool truncated = false;
+
+        void emit_line(string_view line);
+
+        void keep_line(string_view line);
+
+    public:
+        static const size_t CHUNK_SIZE = 65536;
+        static const size_t MAX_LINE_SIZE = 1048576;
+
+        explicit OutputCapture(OutputLineListener listener);
+
+        /**
+         * With retain disabled, lines are discarded once handed to the listener and captured output is always empty.
+         */
+        OutputCapture(OutputLineListener listener, bool retain);
+
+        /**
+         * With bounded policy, only output selected by the policy is kept and memory use does not depend on output
+         * size. Lines exceeding MAX_LINE_SIZE are split in this mode.
+         */
+        OutputCapture(OutputLineListener listener, bool retain, OutputCapturePolicy policy);
+
+        OutputCapture(const OutputCapture &) = delete;
+
+        OutputCapture &operator=(const OutputCapture &) = delete;
+
+        virtual ~OutputCapture();
+
+        /**
+         * Get writable space for at least given number of bytes at the end of captured output.
+         */
+        [[nodiscard]] char *reserve(size_t length);
+
+        /**
+         * Mark given number of bytes previously written to reserved space as captured.
+         */
+        void commit(size_t length);
+
+        void append(const char *data, size_t length);
+
+        /**
+         * Emit last incomplete line, if any, and get captured output with last line break stripped.
+         */
+        string finish();
+
+        /**
+         * Check if any output was dropped by capture policy.
+         */
+        [[nodiscard]] bool is_truncated() const;
+    };
+}
+
+#endif
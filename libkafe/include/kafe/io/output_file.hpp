@@ -0,0 +1,81 @@
+/**
+ * This file is part of Kafe.
+ * https://github.com/libkafe/kafe/
+ *
+ * Copyright 2020 Matiss Treinis
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef LIBKAFE_IO_OUTPUT_FILE_HPP
+#define LIBKAFE_IO_OUTPUT_FILE_HPP
+
+extern "C" {
+#include <archive.h>
+}
+
+#include <cstdint>
+#include <string>
+
+using namespace std;
+
+namespace kafe::io {
+    /**
+     * Writes command output to a local file in large blocks, optionally gzip compressed on the fly.
+     */
+    class OutputFile {
+        string path;
+        int fd = -1;
+        struct archive *archive = nullptr;
+        char *buffer = nullptr;
+        size_t buffered = 0;
+        uint64_t size = 0;
+
+        void flush();
+
+    public:
+        static const size_t BLOCK_SIZE = 1048576;
+
+        OutputFile(const string &path, bool compress);
+
+        OutputFile(const OutputFile &) = delete;
+
+        OutputFile &operator=(const OutputFile &) = delete;
+
+        virtual ~OutputFile();
+
+        /**
+         * Get writable space for at least given number of bytes, at most BLOCK_SIZE.
+         */
+        [[nodiscard]] char *reserve(size_t length);
+
+        /**
+         * Mark given number of bytes previously written to reserved space as output.
+         */
+        void commit(size_t length);
+
+        void append(const char *data, size_t length);
+
+        /**
+         * Write out buffered output and close the file.
+         */
+        void close();
+
+        /**
+         * Get number of output bytes written, before compression.
+         */
+        [[nodiscard]] uint64_t get_size() const;
+    };
+}
+
+#endif
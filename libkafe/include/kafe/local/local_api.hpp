@@ -20,8 +20,11 @@
 #ifndef LIBKAFE_LOCAL_LOCAL_API_HPP
 #define LIBKAFE_LOCAL_LOCAL_API_HPP
 
+#include <cstdint>
 #include <string>
+#include <sys/types.h>
 #include "kafe/logging.hpp"
+#include "kafe/io/output_capture.hpp"
 
 using namespace std;
 using namespace kafe;
@@ -39,17 +42,84 @@ namespace kafe::local {
         [[nodiscard]] int get_code() const;
     };
 
+    class LocalFileResult {
+        const int code;
+        const uint64_t size;
+
+    public:
+        LocalFileResult(int code, uint64_t size);
+
+        [[nodiscard]] int get_code() const;
+
+        [[nodiscard]] uint64_t get_size() const;
+    };
+
+    /**
+     * Local command started with stdout piped back.
+     */
+    struct LocalProcess {
+        pid_t pid;
+        int out;
+        // Command runs in a process group of its own, so that all of it can be terminated
+        bool own_group;
+    };
+
     class LocalApi {
         const ILogEventListener *log_listener;
         string current_chdir;
     private:
-        string read_out(FILE *pFile, bool print_output);
+        /**
+         * Start command with /bin/sh, in own process group if asked to - stdin of such command is /dev/null, as it
+         * can not read the terminal. Stderr is inherited unless discarded. Returns process with pid -1 if command
+         * could not be started.
+         */
+        static LocalProcess spawn(const string &cmd, bool own_group, bool discard_stderr);
+
+        /**
+         * Log and start command in current directory, timer measures it from now on.
+         */
+        LocalProcess start(const string &command, bool own_group, bool discard_stderr, LoggingTimer &timer) const;
+
+        /**
+         * Close stdout pipe and wait for command to exit, terminating it first if asked to. Returns wait status, same
+         * as pclose.
+         */
+        static int reap(const LocalProcess &process, bool terminate);
+
+        string read_out(
+                int fd,
+                bool print_output,
+                const kafe::io::OutputLineCallback &line_callback,
+                const kafe::io::OutputCapturePolicy &policy,
+                bool &stopped
+        );
 
     public:
         explicit LocalApi(const ILogEventListener *log_listener);
 
         LocalShellResult local_popen(const string &command, bool print_output);
 
+        /**
+         * Execute command, handing each line of output to callback (if any) as it arrives. With callback set, only
+         * output selected by bounded capture policy is retained.
+         */
+        LocalShellResult local_popen(
+                const string &command,
+                bool print_output,
+                const kafe::io::OutputLineCallback &line_callback,
+                const kafe::io::OutputCapturePolicy &policy
+        );
+
+        /**
+         * Execute command, writing stdout to local file as it arrives. Stderr is discarded unless printed.
+         */
+        LocalFileResult local_popen_to_file(
+                const string &command,
+                const string &local_file,
+                bool compress,
+                bool print_output
+        );
+
         void chdir(const string &chdir);
 
         [[nodiscard]] const string &get_chdir() const;
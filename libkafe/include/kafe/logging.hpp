@@ -30,6 +30,9 @@
 #include <vector>
 #include <cstring>
 #include <chrono>
+#include <map>
+#include <mutex>
+#include <thread>
 
 using namespace std;
 
@@ -158,14 +161,23 @@ namespace kafe {
     return timer();
 
     class ILogEventListener {
-        vector<string> context = {};
+        // Context is tracked per thread, so that concurrently running node workers do not mix up their prefixes
+        mutable mutex context_lock;
+        map<thread::id, vector<string>> context = {};
 
     protected:
         virtual void on_log(const LogEvent &event) const = 0;
 
     public:
         [[nodiscard]] vector<string> get_context() const {
-            return context;
+            lock_guard<mutex> lock(context_lock);
+            auto current = this->context.find(this_thread::get_id());
+
+            if (current == this->context.end()) {
+                return {};
+            }
+
+            return current->second;
         }
 
     public:
@@ -174,14 +186,35 @@ namespace kafe {
         }
 
         void context_push(const string &ctx) {
-            this->context.push_back(ctx);
+            lock_guard<mutex> lock(context_lock);
+            this->context[this_thread::get_id()].push_back(ctx);
         }
 
         void context_pop() {
-            if (this->context.empty()) {
+            lock_guard<mutex> lock(context_lock);
+            auto current = this->context.find(this_thread::get_id());
+
+            if (current == this->context.end()) {
                 return;
             }
-            this->context.pop_back();
+
+            if (!current->second.empty()) {
+                current->second.pop_back();
+            }
+
+            if (current->second.empty()) {
+                this->context.erase(current);
+            }
+        }
+
+        void context_inherit(const vector<string> &ctx) {
+            lock_guard<mutex> lock(context_lock);
+            this->context[this_thread::get_id()] = ctx;
+        }
+
+        void context_clear() {
+            lock_guard<mutex> lock(context_lock);
+            this->context.erase(this_thread::get_id());
         }
 
         void emit_trace(const string format, ...) const {
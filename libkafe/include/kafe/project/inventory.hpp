@@ -22,6 +22,7 @@
 
 #include <string>
 #include <list>
+#include <map>
 #include <set>
 #include "kafe/runtime/runtime_exception.hpp"
 
@@ -40,6 +41,7 @@ namespace kafe::project {
         unsigned int port;
         const string environment;
         const string role;
+        const map<string, string> ssh_options;
 
     public:
         InventoryItem(
@@ -50,6 +52,18 @@ namespace kafe::project {
                 string role
         );
 
+        /**
+         * Item with SSH transport options of its own, overriding environment - see get_ssh_options().
+         */
+        InventoryItem(
+                string user,
+                string host,
+                unsigned int port,
+                string environment,
+                string role,
+                map<string, string> ssh_options
+        );
+
         [[nodiscard]] const string &get_environment() const;
 
         [[nodiscard]] const string &get_role() const;
@@ -60,6 +74,11 @@ namespace kafe::project {
 
         [[nodiscard]] unsigned int get_port() const;
 
+        /**
+         * SSH settings for this item, by name of environment variable they override (e.g. KAFE_SSH_CIPHERS).
+         */
+        [[nodiscard]] const map<string, string> &get_ssh_options() const;
+
         [[nodiscard]] bool same_as(const InventoryItem &inventoryItem) const;
 
         [[nodiscard]] string to_string() const;
@@ -0,0 +1,69 @@
+/**
+ * This file is part of Kafe.
+ * https://github.com/libkafe/kafe/
+ *
+ * Copyright 2020 Matiss Treinis
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef LIBKAFE_REMOTE_DIGEST_CACHE_HPP
+#define LIBKAFE_REMOTE_DIGEST_CACHE_HPP
+
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <string>
+
+using namespace std;
+
+namespace kafe::remote {
+    /**
+     * Remembers digests of files uploaded to remote servers, so unchanged files can be skipped without asking the
+     * remote. Also memoizes digests of local files, so a file uploaded to many servers is only read once.
+     */
+    class DigestCache {
+        struct LocalDigest {
+            uint64_t size;
+            int64_t mtime;
+            string digest;
+        };
+
+        string path;
+        mutable mutex cache_lock;
+        bool loaded = false;
+        map<string, string> remote_digests = {};
+        map<string, LocalDigest> local_digests = {};
+
+        void load();
+
+    public:
+        explicit DigestCache(string path);
+
+        /**
+         * Get cache stored in KAFE_DIGEST_CACHE file, or ~/.cache/kafe/upload-digests by default.
+         */
+        static DigestCache &get_default();
+
+        /**
+         * Get SHA-256 of local file, computed again only if file size or modification time changed.
+         */
+        string get_local_digest(const string &file);
+
+        bool has_remote_digest(const string &remote_id, const string &remote_path, const string &digest);
+
+        void put_remote_digest(const string &remote_id, const string &remote_path, const string &digest);
+    };
+}
+
+#endif
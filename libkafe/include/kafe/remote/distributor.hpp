@@ -0,0 +1,130 @@
+/**
+ * This file is part of Kafe.
+ * https://github.com/libkafe/kafe/
+ *
+ * Copyright 2020 Matiss Treinis
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef LIBKAFE_REMOTE_DISTRIBUTOR_HPP
+#define LIBKAFE_REMOTE_DISTRIBUTOR_HPP
+
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <set>
+#include <string>
+#include <utility>
+#include <vector>
+#include "kafe/logging.hpp"
+#include "kafe/project/inventory.hpp"
+#include "kafe/remote/sftp_transfer.hpp"
+#include "kafe/remote/ssh_api.hpp"
+#include "kafe/remote/ssh_pool.hpp"
+
+using namespace std;
+using namespace kafe::project;
+
+namespace kafe::remote {
+    struct MulticastRing;
+
+    /**
+     * Distributes a local file to many nodes in a fan-out tree - the file is uploaded to a few seed nodes only,
+     * every node that has the file forwards it to further nodes over node to node SSH. Every hop is verified.
+     */
+    class Distributor {
+        const SshPool *pool;
+        const map<const string, const string> *envvals;
+        ILogEventListener *log_listener;
+        TransferOptions options;
+        size_t fanout;
+        // Number of nodes sent to at once
+        size_t parallel;
+
+        vector<const InventoryItem *> nodes;
+        string file;
+        string remote_file;
+        string digest;
+        vector<string> logger_context;
+
+        mutex results_lock;
+        map<string, bool> results;
+        uint64_t local_uploads = 0;
+
+        // Nodes waiting to be sent to as (parent index, node index), parent index -1 being the local machine
+        mutex pending_lock;
+        condition_variable pending_changed;
+        deque<pair<long, size_t>> pending;
+        // Parents sending to a node at the moment
+        set<long> sending;
+        size_t in_flight = 0;
+
+        bool receive(const InventoryItem *parent, const InventoryItem *node);
+
+        /**
+         * Queue children of given node, -1 for the local machine, to be sent to from given parent. Must be called
+         * with pending lock held.
+         */
+        void add_children(long parent, long of);
+
+        /**
+         * Send to pending nodes until every node is done.
+         */
+        void forward();
+
+        void send(const InventoryItem *node, MulticastRing *ring, size_t writer);
+
+        /**
+         * Write whole file to given range of nodes at once, returns error reading local file if any.
+         */
+        string multicast_batch(MulticastRing *ring, int fd, uint64_t size, size_t first, size_t count);
+
+        void move_into_place(const SshApi &api, const string &temporary) const;
+
+        void report(LoggingTimer *timer);
+
+    public:
+        Distributor(
+                const SshPool *pool,
+                const map<const string, const string> *envvals,
+                ILogEventListener *log_listener,
+                const TransferOptions &options,
+                size_t fanout,
+                size_t parallel
+        );
+
+        /**
+         * Distribute local file to given path on all nodes, returns success by remote id of every node.
+         */
+        map<string, bool> distribute(
+                const vector<const InventoryItem *> &targets,
+                const string &local_file,
+                const string &remote_path
+        );
+
+        /**
+         * Upload local file to given path on all nodes, up to given number of nodes at once, every block of the file
+         * is read once and written to all nodes being uploaded to. Nodes that can not be written to over SFTP get a regular upload afterwards. Returns success
+         * by remote id of every node.
+         */
+        map<string, bool> multicast(
+                const vector<const InventoryItem *> &targets,
+                const string &local_file,
+                const string &remote_path
+        );
+    };
+}
+
+#endif
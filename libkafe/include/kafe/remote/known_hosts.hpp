@@ -0,0 +1,101 @@
+/**
+ * This file is part of Kafe.
+ * https://github.com/libkafe/kafe/
+ *
+ * Copyright 2020 Matiss Treinis
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef LIBKAFE_REMOTE_KNOWN_HOSTS_HPP
+#define LIBKAFE_REMOTE_KNOWN_HOSTS_HPP
+
+#ifndef _LIBSSH_H
+extern "C" {
+#include "libssh/libssh.h"
+}
+#endif
+
+#include <mutex>
+#include <sys/types.h>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+using namespace std;
+
+namespace kafe::remote {
+    enum class KnownHostMatch {
+        KNOWN,
+        REVOKED,
+        // Not known to the index, which does not mean it is not known at all
+        NOT_CONFIRMED
+    };
+
+    /**
+     * Known hosts file read once and indexed by host, so that verifying host keys does not parse the file again for
+     * every connection. Keys are compared as base64 of their public key blob, same as written in the file.
+     *
+     * Index only confirms keys it knows for exact host names, plain or hashed. Anything else - unknown or changed
+     * keys, wildcard patterns, certificate authorities - is left for libssh to decide.
+     */
+    class KnownHostsIndex {
+        struct HashedHost {
+            string salt;
+            string hash;
+        };
+
+        string path;
+        mutex index_lock;
+        // File the index was built from, index is built again once file is replaced or changed
+        bool loaded = false;
+        dev_t file_device = 0;
+        ino_t file_inode = 0;
+        off_t file_size = 0;
+        time_t file_mtime = 0;
+        // Keys by lowercase host name - host for port 22, [host]:port otherwise, same as in known hosts files
+        unordered_map<string, vector<string>> keys = {};
+        // Hashed host names by key, so only entries with the key offered by the remote are hashed when verifying
+        unordered_map<string, vector<HashedHost>> hashed_hosts = {};
+        unordered_set<string> revoked_keys = {};
+
+        /**
+         * Build index again if file changed since it was built, e.g. a key was removed with ssh-keygen -R.
+         */
+        void refresh();
+
+        void add_line(const string &line);
+
+    public:
+        explicit KnownHostsIndex(string path);
+
+        /**
+         * Get index of given known hosts file, shared by all sessions of the process.
+         */
+        static KnownHostsIndex &get(const string &path);
+
+        /**
+         * Look given key up for given host and port - revoked keys are reported as such for any host.
+         */
+        KnownHostMatch match(const string &host, unsigned int port, const string &key);
+
+        /**
+         * Verify host key of connected session against the index of its known hosts file, falling back to libssh
+         * for keys the index does not confirm. Revoked keys are rejected right away, libssh does not check them.
+         */
+        static bool verify(ssh_session session, const string &host, unsigned int port);
+    };
+}
+
+#endif
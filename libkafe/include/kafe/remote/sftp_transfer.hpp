@@ -0,0 +1,203 @@
+/**
+ * This file is part of Kafe.
+ * https://github.com/libkafe/kafe/
+ *
+ * Copyright 2020 Matiss Treinis
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef LIBKAFE_REMOTE_SFTP_TRANSFER_HPP
+#define LIBKAFE_REMOTE_SFTP_TRANSFER_HPP
+
+#ifndef SFTP_H
+extern "C" {
+#include "libssh/sftp.h"
+}
+#endif
+
+#include <cstdint>
+#include <deque>
+#include <map>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+#include "kafe/logging.hpp"
+#include "kafe/remote/ssh_session.hpp"
+
+// Asynchronous I/O API replaced sftp_async_read in libssh 0.11 and added pipelined writes
+#if LIBSSH_VERSION_INT >= SSH_VERSION_INT(0, 11, 0)
+#define KAFE_SFTP_AIO 1
+#endif
+
+using namespace std;
+
+namespace kafe::remote {
+    enum TransferEngine {
+        TRANSFER_SCP = 0,
+        TRANSFER_SFTP = 1
+    };
+
+    // Uploads over SFTP are only pipelined with the asynchronous I/O API, SCP is faster without it
+#ifdef KAFE_SFTP_AIO
+    static const TransferEngine TRANSFER_DEFAULT = TRANSFER_SFTP;
+#else
+    static const TransferEngine TRANSFER_DEFAULT = TRANSFER_SCP;
+#endif
+
+    /**
+     * File transfer settings. Defaults can be changed with KAFE_SSH_TRANSFER (scp or sftp),
+     * KAFE_SSH_TRANSFER_CHUNK_SIZE (bytes), KAFE_SSH_TRANSFER_REQUESTS and KAFE_SSH_TRANSFER_STREAMS environment
+     * variables.
+     */
+    struct TransferOptions {
+        TransferEngine engine = TRANSFER_DEFAULT;
+        // Size of a single read or write request, capped to what the server accepts
+        size_t chunk_size = 262144;
+        // Number of requests kept in flight at once
+        size_t max_requests = 64;
+        // Number of sessions to upload ranges of a large file over at once, SFTP only
+        size_t streams = 1;
+        // Compare SHA-256 of uploaded file to local one, always done when uploading over multiple streams
+        bool verify = false;
+        // Remote file to reuse unchanged blocks from, only changed blocks are sent if set
+        string delta_base;
+        // Size of blocks compared when uploading delta against base file
+        size_t block_size = 65536;
+        // Skip upload if remote file already has same contents
+        bool skip_identical = false;
+        // Skip upload without asking the remote if the same contents were uploaded to the same path before
+        bool use_cache = false;
+
+        static TransferOptions from_env(const map<const string, const string> *envvals);
+    };
+
+    class SftpUnavailableException : public RuntimeException {
+    public:
+        explicit SftpUnavailableException(const string &reason);
+    };
+
+    /**
+     * Remote file opened for pipelined writing - data is written sequentially from the current offset, without
+     * waiting for the server to confirm every request.
+     */
+    class SftpWriter {
+        ssh_session session;
+        sftp_session sftp;
+        sftp_file remote;
+        string remote_path;
+        size_t chunk_size;
+        size_t max_requests;
+#if LIBSSH_VERSION_INT >= SSH_VERSION_INT(0, 11, 0)
+        deque<sftp_aio> in_flight;
+#endif
+
+        [[noreturn]] void raise(const char *operation) const;
+
+    public:
+        SftpWriter(
+                ssh_session session,
+                sftp_session sftp,
+                const string &remote_path,
+                bool truncate,
+                size_t chunk_size,
+                size_t max_requests
+        );
+
+        SftpWriter(const SftpWriter &) = delete;
+
+        SftpWriter &operator=(const SftpWriter &) = delete;
+
+        virtual ~SftpWriter();
+
+        void seek(uint64_t offset);
+
+        /**
+         * Queue data for writing. Data does not have to outlive the call.
+         */
+        void write(const char *data, size_t size);
+
+        /**
+         * Wait for all writes to complete and close remote file.
+         */
+        void close();
+    };
+
+    /**
+     * Pipelined SFTP file transfer - keeps many requests in flight so throughput is not bound by round trip time.
+     */
+    class SftpTransfer {
+        ssh_session session;
+        const ILogEventListener *log_listener;
+        TransferOptions options;
+        sftp_session sftp;
+
+        [[nodiscard]] size_t get_chunk_size(bool is_write) const;
+
+        [[noreturn]] void raise(const char *operation, const string &path) const;
+
+    public:
+        /**
+         * Start SFTP subsystem on given session. Throws SftpUnavailableException if the server does not support it.
+         */
+        SftpTransfer(ssh_session session, const ILogEventListener *log_listener, const TransferOptions &options);
+
+        SftpTransfer(const SftpTransfer &) = delete;
+
+        SftpTransfer &operator=(const SftpTransfer &) = delete;
+
+        virtual ~SftpTransfer();
+
+        /**
+         * Get path local file is uploaded to. If remote path is an existing directory, file is uploaded into it with
+         * the same name.
+         */
+        [[nodiscard]] string resolve_upload_path(const string &file, const string &remote_file) const;
+
+        /**
+         * Upload local file, returns remote path of uploaded file.
+         */
+        string upload(const string &file, const string &remote_file) const;
+
+        /**
+         * Write given range of local file at the same offset of remote file.
+         */
+        void upload_range(
+                const string &file,
+                const string &remote_path,
+                uint64_t offset,
+                uint64_t length,
+                bool truncate
+        ) const;
+
+        /**
+         * Write given ranges, as offset and length pairs, of local file at the same offsets of remote file.
+         */
+        void upload_ranges(
+                const string &file,
+                const string &remote_path,
+                const vector<pair<uint64_t, uint64_t>> &ranges,
+                bool truncate
+        ) const;
+
+        void download(const string &file, const string &remote_file) const;
+
+        /**
+         * Open remote file for writing, truncating it if asked to.
+         */
+        [[nodiscard]] unique_ptr<SftpWriter> open_writer(const string &remote_path, bool truncate) const;
+    };
+}
+
+#endif
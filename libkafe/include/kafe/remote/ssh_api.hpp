@@ -20,38 +20,301 @@
 #ifndef LIBKAFE_REMOTE_SSH_API_HPP
 #define LIBKAFE_REMOTE_SSH_API_HPP
 
+#include <memory>
+#include <vector>
 #include "kafe/logging.hpp"
+#include "kafe/io/output_capture.hpp"
+#include "kafe/remote/ssh_broker.hpp"
 #include "kafe/remote/ssh_manager.hpp"
 #include "kafe/remote/ssh_session.hpp"
+#include "kafe/remote/sftp_transfer.hpp"
 
 namespace kafe::remote {
+    /**
+     * Quote value as a single POSIX shell word.
+     */
+    string shell_quote(const string &value);
+
     class RemoteResult {
         string out;
         string err;
         int code;
+        bool timed_out = false;
+        bool cancelled = false;
 
     public:
         RemoteResult(string &out, string &err, int code);
 
+        RemoteResult(string &out, string &err, int code, bool timed_out, bool cancelled);
+
         [[nodiscard]] const string &get_stdout() const;
 
         [[nodiscard]] const string &get_stderr() const;
 
         [[nodiscard]] int get_code() const;
+
+        /**
+         * Command was terminated for running longer than allowed. Exit code is -1.
+         */
+        [[nodiscard]] bool is_timed_out() const;
+
+        /**
+         * Command was terminated because cancellation was requested. Exit code is -1.
+         */
+        [[nodiscard]] bool is_cancelled() const;
+    };
+
+    class RemoteFileResult {
+        string err;
+        int code;
+        uint64_t size;
+
+    public:
+        RemoteFileResult(string &err, int code, uint64_t size);
+
+        [[nodiscard]] const string &get_stderr() const;
+
+        [[nodiscard]] int get_code() const;
+
+        [[nodiscard]] uint64_t get_size() const;
     };
 
+    class RemoteBatchResult {
+        string out;
+        string err;
+        int code;
+        uint64_t duration_ms;
+
+    public:
+        RemoteBatchResult(string &out, string &err, int code, uint64_t duration_ms);
+
+        [[nodiscard]] const string &get_stdout() const;
+
+        [[nodiscard]] const string &get_stderr() const;
+
+        [[nodiscard]] int get_code() const;
+
+        /**
+         * Time from completion of previous command of the batch to completion of this one, as seen locally.
+         */
+        [[nodiscard]] uint64_t get_duration_ms() const;
+    };
+
+    struct SshShell;
+
     class SshApi {
         SshManager *manager;
         const ILogEventListener *log_listener;
         string current_chdir;
+        // Shell kept running on the remote to execute commands in, if enabled by KAFE_SSH_PERSISTENT_SHELL
+        mutable unique_ptr<SshShell> shell;
+
+        void log_command(const string &command, LoggingTimer &timer) const;
+
+        /**
+         * Log command about to be executed and get full shell command for it.
+         */
+        string prepare_command(const string &command, LoggingTimer &timer) const;
+
+        /**
+         * Open session channel, reconnecting and retrying once if the connection turns out to be lost.
+         */
+        ssh_channel open_channel() const;
+
+        ssh_channel open_command_channel(const string &command, LoggingTimer &timer) const;
+
+        [[nodiscard]] int get_keepalive_ms() const;
+
+        /**
+         * Default command timeout, 0 if commands may run for any time.
+         */
+        [[nodiscard]] long get_command_timeout_ms() const;
+
+        /**
+         * Log and get result of command that did not complete - timed out, was cancelled or stopped by handler.
+         */
+        [[nodiscard]] RemoteResult aborted_result(
+                string &out,
+                string &err,
+                bool timed_out,
+                long timeout,
+                LoggingTimer &timer
+        ) const;
+
+        /**
+         * Get persistent shell, starting it if it is not running.
+         */
+        SshShell *get_shell() const;
+
+        void close_shell() const;
+
+        /**
+         * Run command in persistent shell, framed by sentinels carrying the exit code, moving output to given
+         * captures. Command runs in a subshell unless it is meant to change state of the shell itself. Returns -1
+         * if command did not complete - it was stopped, timed out or cancelled, the shell is then left mid-command.
+         */
+        int shell_run(
+                SshShell *current,
+                const string &command,
+                bool subshell,
+                kafe::io::OutputCapture &capture_out,
+                kafe::io::OutputCapture &capture_err,
+                const bool &stopped,
+                long timeout_ms,
+                bool &timed_out
+        ) const;
+
+        [[nodiscard]] RemoteResult execute_in_shell(
+                const string &command,
+                bool print_output,
+                const kafe::io::OutputLineCallback &line_callback,
+                const kafe::io::OutputCapturePolicy &policy,
+                long timeout
+        ) const;
+
+        /**
+         * Execute command over connection kept by SSH broker. Throws SshBrokerUnavailableException if broker is
+         * not running.
+         */
+        [[nodiscard]] RemoteResult execute_brokered(
+                const string &command,
+                bool print_output,
+                const kafe::io::OutputLineCallback &line_callback,
+                const kafe::io::OutputCapturePolicy &policy,
+                long timeout
+        ) const;
+
+        void upload_file_parallel(
+                const SftpTransfer &transfer,
+                const string &file,
+                const string &remote_path,
+                uint64_t size,
+                size_t streams,
+                const TransferOptions &options
+        ) const;
+
+        /**
+         * Upload only blocks of the file not found in delta base file, reusing the rest on the remote side.
+         * Returns false if base file can not be used and the file should be uploaded in whole.
+         */
+        bool upload_file_delta(
+                const SftpTransfer &transfer,
+                const string &file,
+                const string &remote_path,
+                uint64_t size,
+                const TransferOptions &options
+        ) const;
+
+        /**
+         * Get SHA-256 of file upload to given path would overwrite, empty if there is no such file.
+         */
+        [[nodiscard]] string remote_upload_digest(const string &remote_path, const string &name) const;
+
+        [[nodiscard]] bool is_upload_identical(
+                const string &digest,
+                const string &remote_path,
+                const string &name,
+                const TransferOptions &options
+        ) const;
+
+        void transfer_file(const string &file, const string &remote_path, const TransferOptions &options) const;
 
     public:
         SshApi(const SshManager *manager, const ILogEventListener *listener);
 
+        SshApi(const SshApi &) = delete;
+
+        SshApi &operator=(const SshApi &) = delete;
+
+        virtual ~SshApi();
+
         void chdir(const string &string);
 
         [[nodiscard]] RemoteResult execute(const string &command, bool print_output) const;
 
+        /**
+         * Execute command, handing each line of output to callback (if any) as it arrives. With callback set, only
+         * output selected by bounded capture policy is retained.
+         */
+        [[nodiscard]] RemoteResult execute(
+                const string &command,
+                bool print_output,
+                const kafe::io::OutputLineCallback &line_callback,
+                const kafe::io::OutputCapturePolicy &policy
+        ) const;
+
+        /**
+         * Execute command, terminating it if it runs for longer than timeout seconds, 0 - no limit. Commands run
+         * with default timeout set by KAFE_SSH_COMMAND_TIMEOUT otherwise.
+         */
+        [[nodiscard]] RemoteResult execute(
+                const string &command,
+                bool print_output,
+                const kafe::io::OutputLineCallback &line_callback,
+                const kafe::io::OutputCapturePolicy &policy,
+                long timeout
+        ) const;
+
+        /**
+         * Execute command, handing raw chunks of output to callback as they arrive. Returns exit code of the
+         * command, -1 if callback stopped it, it timed out or was cancelled. Command is not logged.
+         */
+        int execute_raw(const string &command, const OutputChunkCallback &on_output) const;
+
+        int execute_raw(const string &command, const OutputChunkCallback &on_output, bool &timed_out) const;
+
+        /**
+         * Execute command, aborting it the same way as on cancellation once given check returns true - e.g. when
+         * whoever the output is handed to is gone. Check is called every few hundred milliseconds.
+         */
+        int execute_raw(
+                const string &command,
+                const OutputChunkCallback &on_output,
+                bool &timed_out,
+                const function<bool()> &is_abandoned
+        ) const;
+
+        /**
+         * Execute commands one after another in a single remote shell, shipped over one channel at once. Output of
+         * each command is split off by sentinels. With stop_on_failure set, commands after the first failed one
+         * are not executed and have no result.
+         */
+        [[nodiscard]] vector<RemoteBatchResult> execute_batch(
+                const vector<string> &commands,
+                bool stop_on_failure,
+                bool print_output
+        ) const;
+
+        /**
+         * Execute command, writing stdout to local file as it arrives. Only the last lines of stderr are retained.
+         */
+        [[nodiscard]] RemoteFileResult execute_to_file(
+                const string &command,
+                const string &local_file,
+                bool compress,
+                bool print_output
+        ) const;
+
+        /**
+         * Upload file with given transfer engine. SFTP falls back to SCP if server has no SFTP subsystem. Upload is
+         * skipped if remote file has same contents and options ask for it.
+         */
+        void upload_file(const string &file, const string &remote_path, const TransferOptions &options) const;
+
+        /**
+         * Upload string as file, skipping the upload if remote file has same contents when options ask for it.
+         */
+        void upload_string(const string &content, const string &remote_path, const TransferOptions &options) const;
+
+        void download_file(const string &file, const string &remote_path, const TransferOptions &options) const;
+
+        [[nodiscard]] string remote_sha256(const string &remote_path) const;
+
+        /**
+         * Compare SHA-256 checksum of remote file to given one, throws if they do not match.
+         */
+        void verify_upload(const string &local_digest, const string &remote_path) const;
+
         void scp_upload_file(const string &file, const string &remote_path) const;
 
         void scp_download_file(const string &file, const string &remote_path) const;
@@ -0,0 +1,106 @@
+/**
+ * This file is part of Kafe.
+ * https://github.com/libkafe/kafe/
+ *
+ * Copyright 2020 Matiss Treinis
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef LIBKAFE_REMOTE_SSH_AUTH_HPP
+#define LIBKAFE_REMOTE_SSH_AUTH_HPP
+
+#ifndef _LIBSSH_H
+extern "C" {
+#include "libssh/libssh.h"
+}
+#endif
+
+#include <map>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+using namespace std;
+
+namespace kafe::remote {
+    enum class SshAuthMethod {
+        UNKNOWN,
+        AGENT,
+        IDENTITY,
+        GSSAPI,
+        PASSWORD
+    };
+
+    /**
+     * Auth method a host accepted, along with identity file for public key authentication.
+     */
+    struct SshAuthChoice {
+        SshAuthMethod method;
+        string identity;
+    };
+
+    /**
+     * Private keys and auth methods shared by all sessions of the process. Identity files are read and decrypted
+     * once, not again for every host, and hosts are authenticated to with the method that worked for them before -
+     * or, for hosts not authenticated to yet, for the last host - without asking them for the list of methods.
+     */
+    class SshAuthCache {
+        mutex cache_lock;
+        map<string, ssh_key> public_keys = {};
+        // Decrypted private keys by identity file and passphrase, null for keys that could not be decrypted
+        map<pair<string, string>, ssh_key> private_keys = {};
+        map<string, SshAuthChoice> choices = {};
+        // Key based choice that worked last, tried first for hosts without own choice
+        SshAuthChoice last_choice = {SshAuthMethod::UNKNOWN, ""};
+
+        ssh_key get_private_key(const string &identity, const string &passphrase);
+
+        ssh_key get_public_key(const string &identity, const string &passphrase);
+
+    public:
+        SshAuthCache() = default;
+
+        SshAuthCache(const SshAuthCache &) = delete;
+
+        SshAuthCache &operator=(const SshAuthCache &) = delete;
+
+        virtual ~SshAuthCache();
+
+        static SshAuthCache &get_default();
+
+        /**
+         * Get auth method to try first for given remote id.
+         */
+        [[nodiscard]] SshAuthChoice get_choice(const string &remote_id);
+
+        void remember(const string &remote_id, const SshAuthChoice &choice);
+
+        void forget(const string &remote_id);
+
+        /**
+         * Offer public key of given identity file, and decrypt private key with given passphrase - only once for all
+         * sessions - if the remote accepts it. Returns SSH_AUTH_* result.
+         */
+        int authenticate_with_identity(ssh_session session, const string &identity, const string &passphrase);
+
+        /**
+         * Get identity files of the user, in order they are tried in - one set for the session in SSH config
+         * first, then default ones in ~/.ssh that exist.
+         */
+        [[nodiscard]] static vector<string> get_identity_files(ssh_session session);
+    };
+}
+
+#endif
@@ -0,0 +1,124 @@
+/**
+ * This file is part of Kafe.
+ * https://github.com/libkafe/kafe/
+ *
+ * Copyright 2020 Matiss Treinis
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef LIBKAFE_REMOTE_SSH_BROKER_HPP
+#define LIBKAFE_REMOTE_SSH_BROKER_HPP
+
+#include <chrono>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include "kafe/logging.hpp"
+#include "kafe/project/inventory.hpp"
+#include "kafe/remote/ssh_pool.hpp"
+
+using namespace std;
+using namespace kafe::project;
+
+namespace kafe::remote {
+    /**
+     * Receives raw chunks of command output as they arrive. Returning false stops the command.
+     */
+    typedef function<bool(bool is_stderr, const char *data, size_t size)> OutputChunkCallback;
+
+    /**
+     * Thrown if broker can not be reached. Nothing has been sent to the broker yet, so the command can be
+     * executed over a direct connection instead.
+     */
+    class SshBrokerUnavailableException : public RuntimeException {
+    public:
+        explicit SshBrokerUnavailableException(const string &reason);
+    };
+
+    struct SshBrokerEntry;
+
+    /**
+     * Local process that keeps SSH sessions open between Kafe invocations, similar to OpenSSH ControlMaster.
+     * Commands are handed to the broker over a Unix socket, so connecting and authenticating to remote hosts is
+     * only done once. Sessions not used for a while are closed, broker exits once it has none left.
+     *
+     * Enabled by KAFE_SSH_BROKER environment variable - either 1, for default socket location, or path of the
+     * socket. KAFE_SSH_BROKER_TTL sets number of seconds idle sessions are kept for.
+     */
+    class SshBroker {
+        const map<const string, const string> *envvals;
+        const ILogEventListener *log_listener;
+        string socket_path;
+        chrono::seconds idle_ttl;
+
+        SshPool pool;
+        mutex entries_lock;
+        map<string, shared_ptr<SshBrokerEntry>> entries;
+        size_t active_clients = 0;
+
+        void serve(int fd);
+
+        void expire_idle_sessions();
+
+    public:
+        SshBroker(const map<const string, const string> *envvals, const ILogEventListener *log_listener);
+
+        /**
+         * Accept commands until idle for longer than TTL. Returns right away if another broker is already running.
+         */
+        void run();
+
+        [[nodiscard]] static bool is_enabled(const map<const string, const string> *envvals);
+
+        [[nodiscard]] static string get_socket_path(const map<const string, const string> *envvals);
+
+        [[nodiscard]] static bool is_running(const string &socket_path);
+    };
+
+    /**
+     * Connection to a running broker, executing a single command.
+     */
+    class SshBrokerClient {
+        int fd;
+
+    public:
+        /**
+         * Connect to broker, throws SshBrokerUnavailableException if it is not running.
+         */
+        explicit SshBrokerClient(const string &socket_path);
+
+        SshBrokerClient(const SshBrokerClient &) = delete;
+
+        SshBrokerClient &operator=(const SshBrokerClient &) = delete;
+
+        virtual ~SshBrokerClient();
+
+        /**
+         * Execute command on given remote, handing output to callback as it arrives. Returns exit code of the
+         * command, -1 if callback stopped it, cancellation was requested or it ran for longer than timeout set by
+         * KAFE_SSH_COMMAND_TIMEOUT - timed_out is set then.
+         */
+        int execute(
+                const InventoryItem *item,
+                const map<const string, const string> *envvals,
+                const string &command,
+                const OutputChunkCallback &on_output,
+                bool &timed_out
+        );
+    };
+}
+
+#endif
@@ -0,0 +1,108 @@
+/**
+ * This file is part of Kafe.
+ * https://github.com/libkafe/kafe/
+ *
+ * Copyright 2020 Matiss Treinis
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef LIBKAFE_REMOTE_SSH_JUMP_HPP
+#define LIBKAFE_REMOTE_SSH_JUMP_HPP
+
+#include <atomic>
+#include <condition_variable>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include "kafe/remote/ssh_session.hpp"
+#include "kafe/logging.hpp"
+
+using namespace std;
+
+namespace kafe::remote {
+    struct SshTunnel;
+
+    /**
+     * Connection to jump host (bastion) carrying connections to hosts behind it, each over a direct-tcpip channel of
+     * its own. Channels are relayed to local sockets by a thread of the jump host, so sessions to hosts behind it are
+     * set up and used the same way as direct ones, while the jump host is connected and authenticated to only once.
+     */
+    class SshJumpHost {
+        SshSession *session;
+        // Session is used by relay thread and by threads opening tunnels, libssh sessions are not thread safe
+        mutable mutex session_lock;
+        // Shared with threads waiting for their tunnel to open
+        list<shared_ptr<SshTunnel>> tunnels;
+        // Signalled by relay thread, with session lock held, once a tunnel is opened or failed to open
+        condition_variable tunnel_opened;
+        // Wakes relay thread up when tunnel is added or jump host is closed
+        int wake_fds[2] = {-1, -1};
+        atomic<bool> stopping{false};
+        thread relay;
+
+        void run();
+
+        /**
+         * Continue opening channel of the tunnel without blocking, returns false once the channel failed to open.
+         */
+        bool open(SshTunnel &tunnel);
+
+        /**
+         * Move data between channel and socket of the tunnel, returns false once both directions are closed.
+         */
+        bool pump(SshTunnel &tunnel, short revents);
+
+    public:
+        SshJumpHost(
+                const map<const string, const string> *envvals,
+                const string &user,
+                const string &host,
+                unsigned int port,
+                LogLevel level,
+                long connect_timeout
+        );
+
+        SshJumpHost(const SshJumpHost &) = delete;
+
+        SshJumpHost &operator=(const SshJumpHost &) = delete;
+
+        virtual ~SshJumpHost();
+
+        /**
+         * Open connection from jump host to given host and port. Returns local socket connected to it, owned by
+         * the caller. Throws SshConnectException if jump host can not connect. Channel is opened by the relay
+         * thread without blocking, so that other tunnels keep going meanwhile.
+         */
+        int open_tunnel(const string &host, unsigned int port);
+
+        [[nodiscard]] bool is_alive() const;
+
+        /**
+         * Parse jump host given as [user@]host[:port], as set by KAFE_SSH_JUMP. User defaults to given one, port
+         * to 22.
+         */
+        static void parse(
+                const string &spec,
+                const string &default_user,
+                string &user,
+                string &host,
+                unsigned int &port
+        );
+    };
+}
+
+#endif
@@ -20,6 +20,9 @@
 #ifndef LIBKAFE_REMOTE_SSH_MANAGER_HPP
 #define LIBKAFE_REMOTE_SSH_MANAGER_HPP
 
+#include <map>
+#include <string>
+#include <vector>
 #include "kafe/project/inventory.hpp"
 #include "kafe/remote/ssh_pool.hpp"
 #include "kafe/remote/ssh_session.hpp"
@@ -34,10 +37,89 @@ namespace kafe::remote {
         SshPool *pool;
         const map<const string, const string> *envvals;
         const InventoryItem *item;
+        // Sessions are kept in the pool by this key, remote id of the item unless set otherwise
+        string pool_key;
+        // Environment with SSH options of the item applied, if it has any
+        map<const string, const string> item_envvals;
+        // Pooled session in use by this manager, kept from being closed as idle until the manager is destroyed
+        SshSessionLease lease;
+
+        /**
+         * Connect, retrying with exponential backoff if remote can not be reached.
+         */
+        [[nodiscard]] SshSession *connect_with_retry(LogLevel level, long connect_timeout) const;
+
+        /**
+         * Connect to the item, through jump host set by KAFE_SSH_JUMP if any - jump host is connected to once and
+         * shared through the pool.
+         */
+        [[nodiscard]] SshSession *new_session(LogLevel level, long connect_timeout) const;
+
     public:
         SshManager(const SshPool *pool, const map<const string, const string> *envvals, const InventoryItem *item);
 
+        /**
+         * Manager keeping sessions in the pool by given key instead of remote id of the item, so that sessions to
+         * the same remote set up with different settings are not shared.
+         */
+        SshManager(
+                const SshPool *pool,
+                const map<const string, const string> *envvals,
+                const InventoryItem *item,
+                string pool_key
+        );
+
+        SshManager(const SshManager &) = delete;
+
+        SshManager &operator=(const SshManager &) = delete;
+
+        virtual ~SshManager();
+
+        /**
+         * Get session in use by this manager, leasing pooled session or connecting if there is none. Session stays
+         * in use until the manager is destroyed.
+         */
         const SshSession *get_or_create_session(LogLevel level);
+
+        const SshSession *get_or_create_session(LogLevel level, long connect_timeout);
+
+        /**
+         * Replace pooled session with a new one, e.g. when connection was lost while the session was in use.
+         */
+        const SshSession *reconnect(LogLevel level);
+
+        /**
+         * Get session in use by this manager, or pooled session if there is none, without connecting.
+         */
+        [[nodiscard]] const SshSession *find_session() const;
+
+        [[nodiscard]] string get_remote_id() const;
+
+        [[nodiscard]] const InventoryItem *get_item() const;
+
+        /**
+         * Get environment for connecting to the item - SSH options of inventory item take precedence.
+         */
+        [[nodiscard]] const map<const string, const string> *get_envvals() const;
+
+        /**
+         * Open a new session to the same remote, not shared through the pool. Caller owns the session.
+         */
+        [[nodiscard]] SshSession *create_session(LogLevel level) const;
+
+        /**
+         * Connect to all given items at once, up to given number of connections being set up at a time, and keep
+         * the sessions in the pool. Returns reason of failure by remote id of every item that could not be
+         * connected to.
+         */
+        static map<string, string> prewarm(
+                const SshPool *pool,
+                const map<const string, const string> *envvals,
+                const vector<const InventoryItem *> &items,
+                LogLevel level,
+                size_t parallel,
+                long connect_timeout
+        );
     };
 }
 
@@ -20,26 +20,186 @@
 #ifndef LIBKAFE_REMOTE_SSH_POOL_HPP
 #define LIBKAFE_REMOTE_SSH_POOL_HPP
 
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <list>
+#include <memory>
 #include <string>
 #include <map>
+#include <mutex>
+#include <set>
+#include <vector>
+#include "kafe/remote/ssh_jump.hpp"
 #include "kafe/remote/ssh_session.hpp"
 
 using namespace std;
 
 namespace kafe::remote {
+    struct SshPoolStats {
+        size_t sessions;
+        size_t hits;
+        size_t misses;
+        size_t evictions;
+    };
+
+    class SshPool;
+
+    /**
+     * Pooled session in use. Session is kept open while leased, even if removed from the pool in the meantime, and
+     * returned to the pool as idle when lease is released or destroyed. Lease without pool owns a session that is not
+     * pooled, the session is closed once the lease is released.
+     */
+    class SshSessionLease {
+        SshPool *pool = nullptr;
+        string remote_id;
+        shared_ptr<const SshSession> session;
+
+    public:
+        SshSessionLease();
+
+        SshSessionLease(SshPool *pool, string remote_id, shared_ptr<const SshSession> session);
+
+        SshSessionLease(const SshSessionLease &) = delete;
+
+        SshSessionLease &operator=(const SshSessionLease &) = delete;
+
+        SshSessionLease(SshSessionLease &&other) noexcept;
+
+        SshSessionLease &operator=(SshSessionLease &&other) noexcept;
+
+        virtual ~SshSessionLease();
+
+        void release();
+
+        [[nodiscard]] const SshSession *get() const;
+
+        explicit operator bool() const;
+    };
+
+    /**
+     * Sessions kept open by remote id. Sessions are in use while leased by someone, only idle ones are closed to
+     * stay within size limit - least recently used first - or once idle for longer than the idle limit.
+     *
+     * Safe to use from multiple threads, a session is only leased to one user at a time. Sessions are split in shards
+     * by remote id, each with a lock of its own, so that threads working with different remotes rarely wait for each
+     * other. Size limit applies to the whole pool, least recently used idle sessions are closed from the shard a
+     * session is added to or released in.
+     */
     class SshPool {
-        map<const string, const SshSession *> sessions = {};
+        struct Entry {
+            shared_ptr<const SshSession> session;
+            size_t users;
+            chrono::steady_clock::time_point last_used;
+            // Position in usage order of the shard, most recently used first
+            list<string>::iterator usage;
+        };
+
+        struct Shard {
+            mutex lock;
+            condition_variable connected;
+            map<const string, Entry> sessions;
+            list<string> usage;
+            // Remotes being connected to, by the first one to ask for a session
+            set<string> connecting;
+        };
+
+        vector<unique_ptr<Shard>> shards;
+        size_t max_sessions = 0;
+        chrono::seconds max_idle = chrono::seconds(0);
+        // Number of sessions in all shards
+        atomic<size_t> n_sessions{0};
+        atomic<size_t> hits{0};
+        atomic<size_t> misses{0};
+        atomic<size_t> evictions{0};
+
+        // Jump host replaced after losing connection is only closed once the last one using it is done
+        map<const string, shared_ptr<SshJumpHost>> jump_hosts = {};
+        mutable mutex jump_hosts_lock;
+
+        [[nodiscard]] Shard &get_shard(const string &remote_id) const;
+
+        static void touch(Shard &shard, Entry &entry);
+
+        /**
+         * Take idle sessions past idle limit out of shard, and least recently used idle sessions until given number
+         * of sessions can be added within size limit. Must be called with shard lock held, sessions taken out are
+         * closed once the caller drops them - after releasing the lock, as disconnecting may wait for the remote.
+         */
+        [[nodiscard]] vector<shared_ptr<const SshSession>> evict(Shard &shard, size_t room);
+
+        /**
+         * Mark leased session no longer in use. Does nothing if the session has been removed since.
+         */
+        void release_session(const string &remote_id, const SshSession *session);
+
+        friend class SshSessionLease;
 
     public:
+        /**
+         * Pool without limits, sessions are kept until pool is destroyed or they are removed.
+         */
+        SshPool();
+
+        /**
+         * Pool keeping up to given number of sessions, closing sessions idle for longer than given number of
+         * seconds. Zero disables either limit. Sessions in use are never closed, so pool grows past its size when
+         * more sessions than that are in use at once.
+         */
+        SshPool(size_t max_sessions, long max_idle);
+
+        SshPool(const SshPool &) = delete;
+
+        SshPool &operator=(const SshPool &) = delete;
+
         virtual ~SshPool();
 
+        /**
+         * Maximum number of sessions kept open set by KAFE_SSH_POOL_SIZE, defaults to 512, 0 for no limit.
+         */
+        [[nodiscard]] static size_t get_max_sessions(const map<const string, const string> *envvals);
+
+        /**
+         * Seconds unused sessions are kept open for set by KAFE_SSH_POOL_IDLE, 0 if not set to keep them open.
+         */
+        [[nodiscard]] static long get_max_idle(const map<const string, const string> *envvals);
+
+        /**
+         * Maximum number of sessions kept, 0 if there is no limit.
+         */
+        [[nodiscard]] size_t get_size_limit() const;
+
         [[nodiscard]] bool has_session(const string &remote_id) const;
 
+        /**
+         * Get session without leasing it.
+         */
         [[nodiscard]] SshSession *get_session(const string &remote_id) const;
 
+        /**
+         * Lease idle session to given remote, counting pool hit, or connect with given function if there is none,
+         * counting pool miss. Only one caller connects to a remote at a time, others asking for a session to the
+         * same remote meanwhile wait for it. Sessions are not thread safe - if pooled session is leased already,
+         * caller gets a new session that is not pooled. Exceptions thrown by the function are passed on to the
+         * caller connecting only.
+         */
+        [[nodiscard]] SshSessionLease acquire_session(const string &remote_id, const function<SshSession *()> &connect);
+
         void remove_session(const string &remote_id);
 
-        void add_session(const string &remote_id, const SshSession *session);
+        /**
+         * Remove session from the pool only if it still is the given one, not replaced by someone else already.
+         */
+        void remove_session(const string &remote_id, const SshSession *session);
+
+        [[nodiscard]] SshPoolStats get_stats() const;
+
+        /**
+         * Get jump host kept by given remote id, connecting to it with given function if there is none yet or
+         * connection to it was lost. Concurrent callers wait for the one connecting.
+         */
+        shared_ptr<SshJumpHost> get_jump_host(const string &remote_id, const function<SshJumpHost *()> &connect);
     };
 }
 
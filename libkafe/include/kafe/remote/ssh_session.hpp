@@ -29,6 +29,7 @@ extern "C" {
 
 #include <string>
 #include <map>
+#include "kafe/remote/ssh_auth.hpp"
 #include "kafe/runtime/runtime_exception.hpp"
 #include "kafe/logging.hpp"
 
@@ -38,16 +39,117 @@ using namespace kafe::runtime;
 
 namespace kafe::remote {
     class SshSessionException : public RuntimeException {
-        using RuntimeException::RuntimeException;
+    public:
+        explicit SshSessionException(const char *format, ...);
+    };
+
+    /**
+     * Remote host could not be reached - unlike authentication failures, worth retrying.
+     */
+    class SshConnectException : public SshSessionException {
+    public:
+        explicit SshConnectException(const string &reason);
     };
 
     class SshSession {
         ssh_session session;
+        mutable bool closed = false;
+
+        void configure_keepalive(long keepalive_interval);
+
+        /**
+         * Set compression and algorithm preferences from KAFE_SSH_COMPRESSION, KAFE_SSH_CIPHERS, KAFE_SSH_HMAC,
+         * KAFE_SSH_KEX and KAFE_SSH_HOSTKEYS, leaving libssh defaults for those not set.
+         */
+        void configure_transport(const map<const string, const string> *envvals);
+
+        /**
+         * Authenticate with given method, returning SSH_AUTH_* result.
+         */
+        int authenticate(
+                const SshAuthChoice &choice,
+                const string &key_passphrase,
+                const string &user_passphrase
+        ) const;
+
+        /**
+         * Authenticate with keys in SSH agent or identity files, remembering the one that worked for given remote id.
+         */
+        int authenticate_publickey(const string &auth_id, const string &key_passphrase) const;
+
+        void connect(
+                const map<const string, const string> *envvals,
+                const string &user,
+                const string &host,
+                unsigned int port,
+                LogLevel level,
+                long connect_timeout,
+                int socket_fd
+        );
+
     public:
         SshSession(const map<const string, const string> *envvals, const string &user, const string &host, unsigned int port, LogLevel level);
 
+        /**
+         * Connect and authenticate, giving up on connecting after given number of seconds, 0 for libssh default.
+         */
+        SshSession(
+                const map<const string, const string> *envvals,
+                const string &user,
+                const string &host,
+                unsigned int port,
+                LogLevel level,
+                long connect_timeout
+        );
+
+        /**
+         * Connect and authenticate over given socket connected to the host already, e.g. tunnel through jump host,
+         * or over a new connection if socket is -1. Session takes ownership of the socket.
+         */
+        SshSession(
+                const map<const string, const string> *envvals,
+                const string &user,
+                const string &host,
+                unsigned int port,
+                LogLevel level,
+                long connect_timeout,
+                int socket_fd
+        );
+
+        /**
+         * Connect timeout in seconds set by KAFE_SSH_CONNECT_TIMEOUT, 0 if not set.
+         */
+        static long get_connect_timeout(const map<const string, const string> *envvals);
+
+        /**
+         * Interval in seconds keepalive messages are sent at while connection is idle, set by KAFE_SSH_KEEPALIVE.
+         * Defaults to 30, 0 disables keepalive.
+         */
+        static long get_keepalive_interval(const map<const string, const string> *envvals);
+
+        /**
+         * Time in seconds remote commands are allowed to run for, set by KAFE_SSH_COMMAND_TIMEOUT, 0 if not set.
+         */
+        static long get_command_timeout(const map<const string, const string> *envvals);
+
         [[nodiscard]] bool is_active() const;
 
+        /**
+         * Cheap check whether connection is still usable before reusing it - does not wait for the remote, so only
+         * detects connections closed or reset by the remote or by the operating system.
+         */
+        [[nodiscard]] bool is_alive() const;
+
+        /**
+         * Send a message remote ignores, keeping the connection alive through NAT and firewalls.
+         */
+        bool send_keepalive() const;
+
+        /**
+         * Give up blocking operations after given number of seconds, 0 to wait indefinitely.
+         */
+        void set_timeout(long timeout) const;
+
         [[nodiscard]] ssh_session get_ssh_session() const;
 
         virtual ~SshSession();
@@ -0,0 +1,41 @@
+/**
+ * This file is part of Kafe.
+ * https://github.com/libkafe/kafe/
+ *
+ * Copyright 2020 Matiss Treinis
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef LIBKAFE_RUNTIME_CANCELLATION_HPP
+#define LIBKAFE_RUNTIME_CANCELLATION_HPP
+
+namespace kafe::runtime {
+    /**
+     * Process wide request to cancel remote commands being executed, made on interrupt once handler is installed.
+     * Commands in progress are stopped and no further commands are executed.
+     */
+    class Cancellation {
+    public:
+        /**
+         * Request cancellation on SIGINT. Interrupting again terminates the process right away, as usual.
+         */
+        static void install_interrupt_handler();
+
+        static void request();
+
+        [[nodiscard]] static bool is_requested();
+    };
+}
+
+#endif
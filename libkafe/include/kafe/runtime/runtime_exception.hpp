@@ -20,6 +20,7 @@
 #ifndef LIBKAFE_RUNTIME_RUNTIME_EXCEPTION_HPP
 #define LIBKAFE_RUNTIME_RUNTIME_EXCEPTION_HPP
 
+#include <cstdarg>
 #include <exception>
 #include <string>
 
@@ -27,7 +28,15 @@ using namespace std;
 
 namespace kafe::runtime {
     class RuntimeException : public exception {
-        char* message;
+        string message;
+
+    protected:
+        RuntimeException() = default;
+
+        /**
+         * Set message from printf style format, for subclasses that take format arguments of their own.
+         */
+        void set_message(const char *format, va_list args);
 
     public:
         explicit RuntimeException(const char *format, ...);
@@ -33,11 +33,25 @@ namespace kafe {
             const vector<string> &extra_args,
             const string &project_file
     ) : context(context), inventory(inventory), extra_args(extra_args), project_file(project_file) {
-        this->ssh_pool = new SshPool();
+        const auto *envvals = context.get_envvals();
+        this->ssh_pool = new SshPool(SshPool::get_max_sessions(envvals), SshPool::get_max_idle(envvals));
         this->tasks = new TaskList();
         this->local = new LocalApi(context.get_log_listener());
     }
 
+    ExecutionScope::ExecutionScope(const ExecutionScope *parent)
+            : context(parent->context),
+              inventory(parent->inventory),
+              extra_args(parent->extra_args),
+              project_file(parent->project_file),
+              parent(const_cast<ExecutionScope *>(parent)) {
+        this->ssh_pool = parent->ssh_pool;
+        this->tasks = parent->tasks;
+        this->local = new LocalApi(*parent->local);
+        this->values = parent->values;
+        this->is_strict_exec_mode = parent->is_strict_exec_mode;
+    }
+
     const Context *ExecutionScope::get_context() const {
         return &context;
     }
@@ -71,12 +85,22 @@ namespace kafe {
     }
 
     void ExecutionScope::add_rm_on_destruct(const string &file) {
+        if (nullptr != parent) {
+            parent->add_rm_on_destruct(file);
+            return;
+        }
+
         files_to_rm_on_destruct.push_back(file);
     }
 
     ExecutionScope::~ExecutionScope() {
         clear_current_api();
 
+        if (nullptr != parent) {
+            delete this->local;
+            return;
+        }
+
         for (const auto &file: files_to_rm_on_destruct) {
             try {
                 FileSystem::try_rm_r(file);
@@ -0,0 +1,353 @@
+/**
+ * This file is part of Kafe.
+ * https://github.com/libkafe/kafe/
+ *
+ * Copyright 2020 Matiss Treinis
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <cerrno>
+#include <cstring>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#include "kafe/io/digest.hpp"
+#include "kafe/runtime/runtime_exception.hpp"
+
+using namespace kafe::runtime;
+
+namespace kafe::io {
+    static const uint32_t SHA256_K[64] = {
+            0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+            0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+            0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+            0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+            0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+            0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+            0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+            0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+    };
+
+    static const uint32_t SHA256_INITIAL_STATE[8] = {
+            0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+    };
+
+    static const uint32_t SHA1_INITIAL_STATE[5] = {0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476, 0xc3d2e1f0};
+
+    static const size_t DIGEST_READ_BUFFER_SIZE = 1048576;
+
+    static inline uint32_t rotr(uint32_t x, uint32_t n) {
+        return (x >> n) | (x << (32 - n));
+    }
+
+    static inline uint32_t rotl(uint32_t x, uint32_t n) {
+        return (x << n) | (x >> (32 - n));
+    }
+
+    Sha256::Sha256() {
+        memcpy(state, SHA256_INITIAL_STATE, sizeof(state));
+    }
+
+    void Sha256::transform(const uint8_t *data) {
+        uint32_t w[64];
+
+        for (int i = 0; i < 16; i++) {
+            w[i] = (uint32_t) data[i * 4] << 24 | (uint32_t) data[i * 4 + 1] << 16
+                   | (uint32_t) data[i * 4 + 2] << 8 | (uint32_t) data[i * 4 + 3];
+        }
+
+        for (int i = 16; i < 64; i++) {
+            auto s0 = rotr(w[i - 15], 7) ^ rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+            auto s1 = rotr(w[i - 2], 17) ^ rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+            w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+        }
+
+        auto a = state[0], b = state[1], c = state[2], d = state[3];
+        auto e = state[4], f = state[5], g = state[6], h = state[7];
+
+        for (int i = 0; i < 64; i++) {
+            auto s1 = rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25);
+            auto ch = (e & f) ^ (~e & g);
+            auto t1 = h + s1 + ch + SHA256_K[i] + w[i];
+            auto s0 = rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22);
+            auto maj = (a & b) ^ (a & c) ^ (b & c);
+            auto t2 = s0 + maj;
+
+            h = g;
+            g = f;
+            f = e;
+            e = d + t1;
+            d = c;
+            c = b;
+            b = a;
+            a = t1 + t2;
+        }
+
+        state[0] += a;
+        state[1] += b;
+        state[2] += c;
+        state[3] += d;
+        state[4] += e;
+        state[5] += f;
+        state[6] += g;
+        state[7] += h;
+    }
+
+    void Sha256::update(const void *data, size_t size) {
+        const auto *bytes = (const uint8_t *) data;
+        length += size;
+
+        if (block_size > 0) {
+            auto part = min(size, sizeof(block) - block_size);
+            memcpy(block + block_size, bytes, part);
+            block_size += part;
+            bytes += part;
+            size -= part;
+
+            if (block_size < sizeof(block)) {
+                return;
+            }
+
+            transform(block);
+            block_size = 0;
+        }
+
+        while (size >= sizeof(block)) {
+            transform(bytes);
+            bytes += sizeof(block);
+            size -= sizeof(block);
+        }
+
+        memcpy(block, bytes, size);
+        block_size = size;
+    }
+
+    string Sha256::hex_digest() {
+        auto bit_length = length * 8;
+
+        uint8_t padding[72] = {0x80};
+        auto padding_size = (block_size < 56 ? 56 : 120) - block_size;
+
+        for (int i = 0; i < 8; i++) {
+            padding[padding_size + i] = (uint8_t) (bit_length >> (56 - i * 8));
+        }
+
+        update(padding, padding_size + 8);
+
+        static const char *hex = "0123456789abcdef";
+        string digest;
+        digest.reserve(DIGEST_SIZE * 2);
+
+        for (auto word : state) {
+            for (int shift = 28; shift >= 0; shift -= 4) {
+                digest.push_back(hex[(word >> shift) & 0xf]);
+            }
+        }
+
+        memcpy(state, SHA256_INITIAL_STATE, sizeof(state));
+        block_size = 0;
+        length = 0;
+
+        return digest;
+    }
+
+    string Sha256::hex_digest(const void *data, size_t size) {
+        Sha256 digest;
+        digest.update(data, size);
+        return digest.hex_digest();
+    }
+
+    string Sha256::file_hex_digest(const string &path, uint64_t offset, uint64_t size) {
+        auto fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            throw RuntimeException("Can not open file <%s> - %s", path.c_str(), strerror(errno));
+        }
+
+        Sha256 digest;
+        vector<char> buffer(DIGEST_READ_BUFFER_SIZE);
+        uint64_t remaining = size;
+
+        for (;;) {
+            auto length = 0 == size ? buffer.size() : (size_t) min((uint64_t) buffer.size(), remaining);
+
+            if (0 == length) {
+                break;
+            }
+
+            auto n_read = ::pread(fd, buffer.data(), length, (off_t) offset);
+
+            if (n_read < 0 && EINTR == errno) {
+                continue;
+            }
+
+            if (n_read < 0) {
+                ::close(fd);
+                throw RuntimeException("Can not read file <%s> - %s", path.c_str(), strerror(errno));
+            }
+
+            if (0 == n_read) {
+                break;
+            }
+
+            digest.update(buffer.data(), n_read);
+            offset += n_read;
+            remaining -= min(remaining, (uint64_t) n_read);
+        }
+
+        ::close(fd);
+
+        return digest.hex_digest();
+    }
+
+    string Sha256::file_hex_digest(const string &path) {
+        return file_hex_digest(path, 0, 0);
+    }
+
+    Sha1::Sha1() {
+        memcpy(state, SHA1_INITIAL_STATE, sizeof(state));
+    }
+
+    void Sha1::transform(const uint8_t *data) {
+        uint32_t w[80];
+
+        for (int i = 0; i < 16; i++) {
+            w[i] = (uint32_t) data[i * 4] << 24 | (uint32_t) data[i * 4 + 1] << 16
+                   | (uint32_t) data[i * 4 + 2] << 8 | (uint32_t) data[i * 4 + 3];
+        }
+
+        for (int i = 16; i < 80; i++) {
+            w[i] = rotl(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+        }
+
+        auto a = state[0], b = state[1], c = state[2], d = state[3], e = state[4];
+
+        for (int i = 0; i < 80; i++) {
+            uint32_t f, k;
+
+            if (i < 20) {
+                f = (b & c) | (~b & d);
+                k = 0x5a827999;
+            } else if (i < 40) {
+                f = b ^ c ^ d;
+                k = 0x6ed9eba1;
+            } else if (i < 60) {
+                f = (b & c) | (b & d) | (c & d);
+                k = 0x8f1bbcdc;
+            } else {
+                f = b ^ c ^ d;
+                k = 0xca62c1d6;
+            }
+
+            auto t = rotl(a, 5) + f + e + k + w[i];
+            e = d;
+            d = c;
+            c = rotl(b, 30);
+            b = a;
+            a = t;
+        }
+
+        state[0] += a;
+        state[1] += b;
+        state[2] += c;
+        state[3] += d;
+        state[4] += e;
+    }
+
+    void Sha1::update(const void *data, size_t size) {
+        const auto *bytes = (const uint8_t *) data;
+        length += size;
+
+        if (block_size > 0) {
+            auto part = min(size, sizeof(block) - block_size);
+            memcpy(block + block_size, bytes, part);
+            block_size += part;
+            bytes += part;
+            size -= part;
+
+            if (block_size < sizeof(block)) {
+                return;
+            }
+
+            transform(block);
+            block_size = 0;
+        }
+
+        while (size >= sizeof(block)) {
+            transform(bytes);
+            bytes += sizeof(block);
+            size -= sizeof(block);
+        }
+
+        memcpy(block, bytes, size);
+        block_size = size;
+    }
+
+    string Sha1::digest() {
+        auto bit_length = length * 8;
+
+        uint8_t padding[72] = {0x80};
+        auto padding_size = (block_size < 56 ? 56 : 120) - block_size;
+
+        for (int i = 0; i < 8; i++) {
+            padding[padding_size + i] = (uint8_t) (bit_length >> (56 - i * 8));
+        }
+
+        update(padding, padding_size + 8);
+
+        string digest;
+        digest.reserve(DIGEST_SIZE);
+
+        for (auto word : state) {
+            for (int shift = 24; shift >= 0; shift -= 8) {
+                digest.push_back((char) ((word >> shift) & 0xff));
+            }
+        }
+
+        memcpy(state, SHA1_INITIAL_STATE, sizeof(state));
+        block_size = 0;
+        length = 0;
+
+        return digest;
+    }
+
+    string Sha1::hmac(const string &key, const string &data) {
+        string block_key = key;
+
+        if (block_key.size() > BLOCK_SIZE) {
+            Sha1 key_digest;
+            key_digest.update(block_key.data(), block_key.size());
+            block_key = key_digest.digest();
+        }
+
+        block_key.resize(BLOCK_SIZE, '\0');
+
+        string inner_pad(BLOCK_SIZE, '\0');
+        string outer_pad(BLOCK_SIZE, '\0');
+        for (size_t i = 0; i < BLOCK_SIZE; i++) {
+            inner_pad[i] = (char) (block_key[i] ^ 0x36);
+            outer_pad[i] = (char) (block_key[i] ^ 0x5c);
+        }
+
+        Sha1 inner;
+        inner.update(inner_pad.data(), inner_pad.size());
+        inner.update(data.data(), data.size());
+        auto inner_digest = inner.digest();
+
+        Sha1 outer;
+        outer.update(outer_pad.data(), outer_pad.size());
+        outer.update(inner_digest.data(), inner_digest.size());
+
+        return outer.digest();
+    }
+}
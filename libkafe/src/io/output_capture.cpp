@@ -0,0 +1,195 @@
+/**
+ * This file is part of Kafe.
+ * https://github.com/libkafe/kafe/
+ *
+ * Copyright 2020 Matiss Treinis
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <cstdlib>
+#include <cstring>
+#include <fnmatch.h>
+#include <utility>
+#include "kafe/io/output_capture.hpp"
+#include "kafe/runtime/runtime_exception.hpp"
+
+using namespace kafe::runtime;
+
+namespace kafe::io {
+    static const size_t OUTPUT_CAPTURE_INITIAL_SIZE = 4096;
+
+    bool OutputCapturePolicy::is_bounded() const {
+        return head_bytes > 0 || tail_lines > 0 || !filter.empty();
+    }
+
+    OutputCapture::OutputCapture(OutputLineListener listener) : OutputCapture(move(listener), true) {
+    }
+
+    OutputCapture::OutputCapture(OutputLineListener listener, bool retain)
+            : OutputCapture(move(listener), retain, OutputCapturePolicy()) {
+    }
+
+    OutputCapture::OutputCapture(OutputLineListener listener, bool retain, OutputCapturePolicy policy)
+            : listener(move(listener)), retain(retain && !policy.is_bounded()), policy(move(policy)) {
+    }
+
+    OutputCapture::~OutputCapture() {
+        free(buffer);
+    }
+
+    char *OutputCapture::reserve(size_t length) {
+        if (size + length <= capacity) {
+            return buffer + size;
+        }
+
+        // Grow geometrically - large outputs must not be copied over and over again
+        auto new_capacity = max(capacity * 2, OUTPUT_CAPTURE_INITIAL_SIZE);
+        while (new_capacity < size + length) {
+            new_capacity *= 2;
+        }
+
+        auto *grown = (char *) realloc(buffer, new_capacity);
+        if (nullptr == grown) {
+            throw RuntimeException("Unable to allocate <%zu> bytes to capture command output", new_capacity);
+        }
+
+        buffer = grown;
+        capacity = new_capacity;
+
+        return buffer + size;
+    }
+
+    void OutputCapture::emit_line(string_view line) {
+        if (listener) {
+            listener(line);
+        }
+
+        if (policy.is_bounded()) {
+            keep_line(line);
+        }
+    }
+
+    void OutputCapture::keep_line(string_view line) {
+        if (!policy.filter.empty()) {
+            auto bare = string(line);
+            if (!bare.empty() && '\n' == bare.back()) {
+                bare.pop_back();
+            }
+
+            if (0 != fnmatch(policy.filter.c_str(), bare.c_str(), 0)) {
+                truncated = true;
+                return;
+            }
+        }
+
+        if (policy.tail_lines > 0) {
+            kept_tail.emplace_back(line);
+            if (kept_tail.size() > policy.tail_lines) {
+                kept_tail.pop_front();
+                truncated = true;
+            }
+            return;
+        }
+
+        if (policy.head_bytes > 0 && kept.size() + line.size() > policy.head_bytes) {
+            kept.append(line.substr(0, policy.head_bytes - kept.size()));
+            truncated = true;
+            return;
+        }
+
+        kept.append(line);
+    }
+
+    void OutputCapture::commit(size_t length) {
+        const char *cursor = buffer + size;
+        size += length;
+
+        auto scan = listener || policy.is_bounded();
+
+        const char *end = buffer + size;
+        while (scan && cursor < end) {
+            const auto *line_end = (const char *) memchr(cursor, '\n', end - cursor);
+
+            if (nullptr == line_end) {
+                break;
+            }
+
+            cursor = line_end + 1;
+            emit_line(string_view(buffer + line_start, cursor - (buffer + line_start)));
+            line_start = cursor - buffer;
+        }
+
+        if (retain) {
+            return;
+        }
+
+        if (!scan) {
+            size = 0;
+            return;
+        }
+
+        if (size - line_start >= MAX_LINE_SIZE) {
+            // Never buffer unbounded amount of output waiting for a line break that might never come
+            emit_line(string_view(buffer + line_start, size - line_start));
+            line_start = size;
+        }
+
+        if (line_start > 0) {
+            // Keep only the incomplete line, memory use stays flat regardless of output size
+            memmove(buffer, buffer + line_start, size - line_start);
+            size -= line_start;
+            line_start = 0;
+        }
+    }
+
+    void OutputCapture::append(const char *data, size_t length) {
+        memcpy(reserve(length), data, length);
+        commit(length);
+    }
+
+    string OutputCapture::finish() {
+        if ((listener || policy.is_bounded()) && line_start < size) {
+            emit_line(string_view(buffer + line_start, size - line_start));
+        }
+
+        line_start = size;
+
+        if (!retain) {
+            size = 0;
+            line_start = 0;
+        }
+
+        string result;
+        if (retain) {
+            result = string(buffer, size);
+        } else if (policy.tail_lines > 0) {
+            for (const auto &line : kept_tail) {
+                result.append(line);
+            }
+            kept_tail.clear();
+        } else {
+            result.swap(kept);
+        }
+
+        if (!result.empty() && '\n' == result.back()) {
+            result.pop_back();
+        }
+
+        return result;
+    }
+
+    bool OutputCapture::is_truncated() const {
+        return truncated;
+    }
+}
@@ -0,0 +1,181 @@
+/**
+ * This file is part of Kafe.
+ * https://github.com/libkafe/kafe/
+ *
+ * Copyright 2020 Matiss Treinis
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+
+extern "C" {
+#include <archive_entry.h>
+}
+
+#include "kafe/io/output_file.hpp"
+#include "kafe/runtime/runtime_exception.hpp"
+
+using namespace kafe::runtime;
+
+namespace kafe::io {
+    static string get_archive_error(struct archive *archive) {
+        const auto *error = archive_error_string(archive);
+        return nullptr == error ? "unknown error" : error;
+    }
+
+    OutputFile::OutputFile(const string &path, bool compress) : path(path) {
+        buffer = (char *) malloc(BLOCK_SIZE);
+        if (nullptr == buffer) {
+            throw RuntimeException("Unable to allocate <%zu> bytes to write file <%s>", BLOCK_SIZE, path.c_str());
+        }
+
+        if (!compress) {
+            fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+            if (fd < 0) {
+                free(buffer);
+                throw RuntimeException("Can not open file <%s> for writing - %s", path.c_str(), strerror(errno));
+            }
+            return;
+        }
+
+        // Single file gzip stream - raw format has no archive structure, only compression filter
+        archive = archive_write_new();
+        archive_write_add_filter_gzip(archive);
+        archive_write_set_format_raw(archive);
+        archive_write_set_bytes_per_block(archive, BLOCK_SIZE);
+        // Do not pad the stream to block size, trailing zeros are garbage to gzip
+        archive_write_set_bytes_in_last_block(archive, 1);
+
+        if (ARCHIVE_OK != archive_write_open_filename(archive, path.c_str())) {
+            auto error = get_archive_error(archive);
+            archive_write_free(archive);
+            free(buffer);
+            throw RuntimeException("Can not open file <%s> for writing - %s", path.c_str(), error.c_str());
+        }
+
+        auto *entry = archive_entry_new();
+        archive_entry_set_pathname(entry, "data");
+        archive_entry_set_filetype(entry, AE_IFREG);
+        auto rc = archive_write_header(archive, entry);
+        archive_entry_free(entry);
+
+        if (ARCHIVE_OK != rc) {
+            auto error = get_archive_error(archive);
+            archive_write_free(archive);
+            free(buffer);
+            throw RuntimeException("Can not write file <%s> - %s", path.c_str(), error.c_str());
+        }
+    }
+
+    OutputFile::~OutputFile() {
+        if (nullptr != archive) {
+            archive_write_free(archive);
+        }
+
+        if (fd >= 0) {
+            ::close(fd);
+        }
+
+        free(buffer);
+    }
+
+    void OutputFile::flush() {
+        if (0 == buffered) {
+            return;
+        }
+
+        if (nullptr != archive) {
+            if (archive_write_data(archive, buffer, buffered) < 0) {
+                throw RuntimeException("Can not write file <%s> - %s", path.c_str(),
+                                       get_archive_error(archive).c_str());
+            }
+            buffered = 0;
+            return;
+        }
+
+        size_t written = 0;
+        while (written < buffered) {
+            auto rc = ::write(fd, buffer + written, buffered - written);
+
+            if (rc < 0) {
+                if (EINTR == errno) {
+                    continue;
+                }
+                throw RuntimeException("Can not write file <%s> - %s", path.c_str(), strerror(errno));
+            }
+
+            written += rc;
+        }
+
+        buffered = 0;
+    }
+
+    char *OutputFile::reserve(size_t length) {
+        if (length > BLOCK_SIZE) {
+            throw RuntimeException("Can not reserve <%zu> bytes, block size is <%zu>", length, BLOCK_SIZE);
+        }
+
+        if (buffered + length > BLOCK_SIZE) {
+            flush();
+        }
+
+        return buffer + buffered;
+    }
+
+    void OutputFile::commit(size_t length) {
+        buffered += length;
+        size += length;
+    }
+
+    void OutputFile::append(const char *data, size_t length) {
+        while (length > 0) {
+            auto part = min(length, BLOCK_SIZE);
+            memcpy(reserve(part), data, part);
+            commit(part);
+            data += part;
+            length -= part;
+        }
+    }
+
+    void OutputFile::close() {
+        flush();
+
+        if (nullptr != archive) {
+            auto rc = archive_write_close(archive);
+            archive_write_free(archive);
+            archive = nullptr;
+
+            if (ARCHIVE_OK != rc) {
+                throw RuntimeException("Can not finish writing file <%s>", path.c_str());
+            }
+        }
+
+        if (fd >= 0) {
+            auto rc = ::close(fd);
+            fd = -1;
+
+            if (rc < 0) {
+                throw RuntimeException("Can not write file <%s> - %s", path.c_str(), strerror(errno));
+            }
+        }
+    }
+
+    uint64_t OutputFile::get_size() const {
+        return size;
+    }
+}
@@ -17,12 +17,19 @@
  * limitations under the License.
  */
 
+#include <cerrno>
+#include <csignal>
 #include <cstdio>
 #include <string>
 #include <cstring>
 #include <utility>
+#include <fcntl.h>
+#include <sys/wait.h>
+#include <unistd.h>
 #include "kafe/local/local_api.hpp"
 #include "kafe/io/file_system.hpp"
+#include "kafe/io/output_capture.hpp"
+#include "kafe/io/output_file.hpp"
 #include "kafe/logging.hpp"
 
 using namespace std;
@@ -39,66 +46,79 @@ namespace kafe::local {
         return code;
     }
 
-    LocalApi::LocalApi(const ILogEventListener *log_listener) : log_listener(log_listener) {
+    LocalFileResult::LocalFileResult(const int code, const uint64_t size) : code(code), size(size) {}
+
+    int LocalFileResult::get_code() const {
+        return code;
     }
 
-    string LocalApi::read_out(FILE *pFile, bool print_output) {
-        const size_t buffer_size = 256;
-        size_t output_size = 4096;
+    uint64_t LocalFileResult::get_size() const {
+        return size;
+    }
 
-        char *output = (char *) malloc(output_size);
-        unsigned long current_pos = 0;
-        unsigned long last_line_pos = 0;
-        size_t n_read;
-        char buffer[buffer_size];
-        char *line_buffer = (char *) malloc(256);
-        do {
-            n_read = fread(buffer, 1, buffer_size, pFile);
-            if (n_read > 0) {
-                for (int i = 0; i < n_read; i++) {
-                    auto c = buffer[i];
-                    output[current_pos] = c;
+    LocalApi::LocalApi(const ILogEventListener *log_listener) : log_listener(log_listener) {
+    }
 
-                    if (print_output && c == '\n') {
-                        const unsigned long size_of = sizeof(char) * (current_pos - last_line_pos + 1);
-                        line_buffer = (char *) realloc(line_buffer, size_of + 1);
-                        memcpy(line_buffer, output + last_line_pos, size_of);
-                        line_buffer[size_of] = '\0';
+    LocalProcess LocalApi::spawn(const string &cmd, bool own_group, bool discard_stderr) {
+        int pipe_fds[2];
+        if (0 != ::pipe(pipe_fds)) {
+            return LocalProcess{-1, -1, own_group};
+        }
 
-                        log_listener->on_stdout_line("-> out", line_buffer);
+        // Commands started from other threads meanwhile must not hold on to the pipe
+        ::fcntl(pipe_fds[0], F_SETFD, FD_CLOEXEC);
 
-                        last_line_pos = current_pos + 1;
-                    }
+        auto pid = ::fork();
 
-                    current_pos++;
+        if (0 == pid) {
+            // Only async-signal-safe calls from here on
+            if (own_group) {
+                ::setpgid(0, 0);
 
-                    if (current_pos > output_size) {
-                        output_size += buffer_size;
-                        output = (char *) realloc(output, output_size);
-                    }
+                auto null_fd = ::open("/dev/null", O_RDONLY);
+                if (null_fd >= 0) {
+                    ::dup2(null_fd, STDIN_FILENO);
+                    ::close(null_fd);
                 }
             }
-        } while (n_read > 0);
 
-        // Strip last line
-        if (output[current_pos - 1] == '\n') {
-            output[current_pos - 1] = '\0';
-        } else {
-            output[current_pos] = '\0';
+            if (discard_stderr) {
+                auto null_fd = ::open("/dev/null", O_WRONLY);
+                if (null_fd >= 0) {
+                    ::dup2(null_fd, STDERR_FILENO);
+                    ::close(null_fd);
+                }
+            }
+
+            ::dup2(pipe_fds[1], STDOUT_FILENO);
+            ::close(pipe_fds[0]);
+            ::close(pipe_fds[1]);
+            ::execl("/bin/sh", "sh", "-c", cmd.c_str(), (char *) nullptr);
+            ::_exit(127);
         }
 
-        auto result = string(output);
+        ::close(pipe_fds[1]);
 
-        free(line_buffer);
-        free(output);
+        if (pid < 0) {
+            ::close(pipe_fds[0]);
+            return LocalProcess{-1, -1, own_group};
+        }
 
-        return result;
+        if (own_group) {
+            // Set from both sides, so that the group exists whichever runs first
+            ::setpgid(pid, pid);
+        }
+
+        return LocalProcess{pid, pipe_fds[0], own_group};
     }
 
-    // TODO: this works, but does not capture stderr for obvious reasons...
-    LocalShellResult LocalApi::local_popen(const string &command, bool print_output) {
+    LocalProcess LocalApi::start(
+            const string &command,
+            bool own_group,
+            bool discard_stderr,
+            LoggingTimer &timer
+    ) const {
         string cmd;
-        LoggingTimer timer;
 
         if (!this->current_chdir.empty()) {
             timer = log_listener->emit_info_wt(
@@ -111,14 +131,104 @@ namespace kafe::local {
 
         log_listener->emit_debug("Full local shell command is <%s>", cmd.c_str());
 
-        FILE *p = ::popen(cmd.c_str(), "r");
+        return spawn(cmd, own_group, discard_stderr);
+    }
+
+    int LocalApi::reap(const LocalProcess &process, bool terminate) {
+        if (terminate) {
+            ::kill(process.own_group ? -process.pid : process.pid, SIGTERM);
+        }
+
+        ::close(process.out);
+
+        int status;
+        while (::waitpid(process.pid, &status, 0) < 0) {
+            if (EINTR != errno) {
+                return -1;
+            }
+        }
+
+        return status;
+    }
 
-        if (nullptr == p) {
+    string LocalApi::read_out(
+            int fd,
+            bool print_output,
+            const OutputLineCallback &line_callback,
+            const OutputCapturePolicy &policy,
+            bool &stopped
+    ) {
+        OutputLineListener listener = nullptr;
+        if (print_output || line_callback) {
+            listener = [this, print_output, &line_callback, &stopped](string_view line) {
+                if (print_output) {
+                    log_listener->on_stdout_line("-> out", string(line));
+                }
+
+                if (line_callback && !stopped && !line_callback(false, line)) {
+                    stopped = true;
+                }
+            };
+        }
+
+        // Output streamed to callback is not retained - memory use does not depend on output size
+        OutputCapture capture(listener, !line_callback, policy);
+
+        // Read pipe directly - buffered fread would hold lines back until a whole chunk is available
+        ssize_t n_read;
+        do {
+            n_read = ::read(fd, capture.reserve(OutputCapture::CHUNK_SIZE), OutputCapture::CHUNK_SIZE);
+
+            if (n_read > 0) {
+                capture.commit(n_read);
+            }
+        } while (!stopped && (n_read > 0 || (n_read < 0 && EINTR == errno)));
+
+        auto output = capture.finish();
+
+        if (capture.is_truncated()) {
+            log_listener->emit_debug("Part of command output was discarded by capture policy");
+        }
+
+        return output;
+    }
+
+    LocalShellResult LocalApi::local_popen(const string &command, bool print_output) {
+        return local_popen(command, print_output, nullptr, OutputCapturePolicy());
+    }
+
+    // TODO: this works, but does not capture stderr for obvious reasons...
+    LocalShellResult LocalApi::local_popen(
+            const string &command,
+            bool print_output,
+            const OutputLineCallback &line_callback,
+            const OutputCapturePolicy &policy
+    ) {
+        LoggingTimer timer;
+
+        // Command that can be stopped by output handler is terminated as a whole then - waiting for it to write
+        // again and get SIGPIPE would never end for a quiet command, e.g. tail -f
+        auto process = start(command, static_cast<bool>(line_callback), false, timer);
+
+        if (process.pid < 0) {
             return LocalShellResult({}, -1);
         }
 
-        auto output = read_out(p, print_output);
-        int exit_code = pclose(p);
+        bool stopped = false;
+        string output;
+        try {
+            output = read_out(process.out, print_output, line_callback, policy, stopped);
+        } catch (exception &e) {
+            reap(process, true);
+            throw;
+        }
+
+        int exit_code = reap(process, stopped);
+
+        if (stopped) {
+            log_listener->emit_warning(&timer, "Local command stopped by output handler");
+            return LocalShellResult(output, -1);
+        }
 
         if (0 == exit_code) {
             log_listener->emit_info(&timer, "Local command complete");
@@ -129,6 +239,50 @@ namespace kafe::local {
         return LocalShellResult(output, exit_code);
     }
 
+    LocalFileResult LocalApi::local_popen_to_file(
+            const string &command,
+            const string &local_file,
+            bool compress,
+            bool print_output
+    ) {
+        OutputFile file(local_file, compress);
+
+        LoggingTimer timer;
+        auto process = start(command, false, !print_output, timer);
+
+        if (process.pid < 0) {
+            return LocalFileResult(-1, 0);
+        }
+
+        ssize_t n_read;
+        try {
+            do {
+                n_read = ::read(process.out, file.reserve(OutputCapture::CHUNK_SIZE), OutputCapture::CHUNK_SIZE);
+
+                if (n_read > 0) {
+                    file.commit(n_read);
+                }
+            } while (n_read > 0 || (n_read < 0 && EINTR == errno));
+
+            file.close();
+        } catch (exception &e) {
+            reap(process, true);
+            throw;
+        }
+
+        int exit_code = reap(process, false);
+
+        if (0 == exit_code) {
+            log_listener->emit_info(
+                    &timer, "Local command complete, <%llu> bytes written to <%s>",
+                    (unsigned long long) file.get_size(), local_file.c_str());
+        } else {
+            log_listener->emit_warning(&timer, "Local command complete with non-zero exit code <%d>", exit_code);
+        }
+
+        return LocalFileResult(exit_code, file.get_size());
+    }
+
     void LocalApi::chdir(const string &chdir) {
         this->current_chdir = FileSystem::normalize(chdir, std_fs::current_path());
     }
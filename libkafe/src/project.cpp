@@ -22,10 +22,12 @@
 #include "kafe/execution_scope.hpp"
 #include "kafe/io/file_system.hpp"
 #include "kafe/scripting/script.hpp"
+#include "kafe/runtime/cancellation.hpp"
 
 using namespace std;
 using namespace kafe::io;
 using namespace kafe::scripting;
+using namespace kafe::runtime;
 
 namespace kafe {
     Project::Project(string project_file) : project_file(move(project_file)) {
@@ -94,6 +96,15 @@ namespace kafe {
             }
 
             logger->context_pop();
+
+            if (Cancellation::is_requested()) {
+                logger->emit_error("Execution cancelled, remaining tasks skipped");
+                break;
+            }
         }
+
+        auto stats = scope.get_ssh_pool()->get_stats();
+        logger->emit_debug("SSH pool kept <%zu> sessions open - <%zu> hits, <%zu> misses, <%zu> evictions",
+                           stats.sessions, stats.hits, stats.misses, stats.evictions);
     }
 }
@@ -29,6 +29,16 @@ namespace kafe::project {
             string role
     ) : environment(move(environment)), role(move(role)), user(move(user)), host(move(host)), port(port) {}
 
+    InventoryItem::InventoryItem(
+            string user,
+            string host,
+            unsigned int port,
+            string environment,
+            string role,
+            map<string, string> ssh_options
+    ) : environment(move(environment)), role(move(role)), user(move(user)), host(move(host)), port(port),
+        ssh_options(move(ssh_options)) {}
+
     const string &InventoryItem::get_environment() const {
         return environment;
     }
@@ -49,6 +59,10 @@ namespace kafe::project {
         return port;
     }
 
+    const map<string, string> &InventoryItem::get_ssh_options() const {
+        return ssh_options;
+    }
+
     bool InventoryItem::same_as(const InventoryItem &other) const {
         return other.get_user() == user
                && other.get_host() == host
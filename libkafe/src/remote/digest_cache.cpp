@@ -0,0 +1,132 @@
+/**
+ * This file is part of Kafe.
+ * https://github.com/libkafe/kafe/
+ *
+ * Copyright 2020 Matiss Treinis
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <cstdlib>
+#include <fstream>
+#include <sys/stat.h>
+#include "kafe/remote/digest_cache.hpp"
+#include "kafe/io/digest.hpp"
+#include "kafe/io/file_system.hpp"
+#include "kafe/runtime/runtime_exception.hpp"
+
+using namespace kafe::io;
+using namespace kafe::runtime;
+
+namespace kafe::remote {
+    static string digest_cache_key(const string &remote_id, const string &remote_path) {
+        return remote_id + "\t" + remote_path;
+    }
+
+    DigestCache::DigestCache(string path) : path(move(path)) {
+    }
+
+    DigestCache &DigestCache::get_default() {
+        static DigestCache cache([]() -> string {
+            const auto *path = getenv("KAFE_DIGEST_CACHE");
+            if (nullptr != path && '\0' != *path) {
+                return path;
+            }
+
+            return FileSystem::expand("~/.cache/kafe/upload-digests").string();
+        }());
+
+        return cache;
+    }
+
+    void DigestCache::load() {
+        if (loaded) {
+            return;
+        }
+
+        loaded = true;
+
+        // One entry per line - digest, remote id and remote path separated by tabs, later entries win
+        ifstream file(path);
+        string line;
+        while (getline(file, line)) {
+            auto separator = line.find('\t');
+
+            if (string::npos == separator || line.find('\t', separator + 1) == string::npos) {
+                continue;
+            }
+
+            remote_digests[line.substr(separator + 1)] = line.substr(0, separator);
+        }
+    }
+
+    string DigestCache::get_local_digest(const string &file) {
+        struct stat st{};
+        if (0 != stat(file.c_str(), &st)) {
+            throw RuntimeException("Can not read file <%s>", file.c_str());
+        }
+
+        {
+            lock_guard<mutex> lock(cache_lock);
+            auto cached = local_digests.find(file);
+
+            if (cached != local_digests.end() && cached->second.size == (uint64_t) st.st_size
+                && cached->second.mtime == (int64_t) st.st_mtime) {
+                return cached->second.digest;
+            }
+        }
+
+        auto digest = Sha256::file_hex_digest(file);
+
+        lock_guard<mutex> lock(cache_lock);
+        local_digests[file] = {(uint64_t) st.st_size, (int64_t) st.st_mtime, digest};
+
+        return digest;
+    }
+
+    bool DigestCache::has_remote_digest(const string &remote_id, const string &remote_path, const string &digest) {
+        lock_guard<mutex> lock(cache_lock);
+        load();
+
+        auto cached = remote_digests.find(digest_cache_key(remote_id, remote_path));
+
+        return cached != remote_digests.end() && cached->second == digest;
+    }
+
+    void DigestCache::put_remote_digest(const string &remote_id, const string &remote_path, const string &digest) {
+        lock_guard<mutex> lock(cache_lock);
+        load();
+
+        auto key = digest_cache_key(remote_id, remote_path);
+        auto cached = remote_digests.find(key);
+
+        if (cached != remote_digests.end() && cached->second == digest) {
+            return;
+        }
+
+        remote_digests[key] = digest;
+
+        // Cache is an optimization only - failing to persist it is not an error
+        try {
+            auto directory = std_fs::path(path).parent_path();
+            if (!directory.empty() && !FileSystem::exists(directory)) {
+                FileSystem::mkdirs(directory);
+            }
+        } catch (exception &e) {
+            return;
+        }
+
+        ofstream file(path, ios::app);
+        file << digest << '\t' << key << '\n';
+    }
+}
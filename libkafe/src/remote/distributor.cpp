@@ -0,0 +1,483 @@
+/**
+ * This file is part of Kafe.
+ * https://github.com/libkafe/kafe/
+ *
+ * Copyright 2020 Matiss Treinis
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <algorithm>
+#include <cerrno>
+#include <condition_variable>
+#include <cstring>
+#include <sstream>
+#include <thread>
+#include <fcntl.h>
+#include <unistd.h>
+#include "kafe/remote/distributor.hpp"
+#include "kafe/remote/digest_cache.hpp"
+#include "kafe/remote/ssh_manager.hpp"
+#include "kafe/io/digest.hpp"
+#include "kafe/io/file_system.hpp"
+
+using namespace kafe::io;
+
+namespace kafe::remote {
+    // Multicast reads the local file in blocks of this size, at most given number of blocks is kept in memory, so
+    // the fastest node can not get ahead of the slowest one by more than that
+    static const size_t MULTICAST_BLOCK_SIZE = 1048576;
+    static const size_t MULTICAST_BLOCKS = 32;
+
+    // Files are written next to the target and only moved into place once verified
+    static const char *TEMPORARY_SUFFIX = ".kafe-relay";
+
+    // Position of a writer that is done, successfully or not, and no longer holds back the reader
+    static const uint64_t MULTICAST_WRITER_DONE = UINT64_MAX;
+
+    /**
+     * Blocks of the local file shared by all writers of a multicast upload, block N is kept in slot N % size.
+     */
+    struct MulticastRing {
+        vector<vector<char>> slots;
+        vector<size_t> slot_sizes;
+        uint64_t n_blocks = 0;
+        // Number of blocks read so far
+        uint64_t n_read = 0;
+        // Next block to be written by every writer
+        vector<uint64_t> positions;
+        // Set once whole file is read
+        string digest;
+        bool failed = false;
+
+        mutex lock;
+        condition_variable changed;
+
+        [[nodiscard]] uint64_t slowest_position() const {
+            uint64_t slowest = MULTICAST_WRITER_DONE;
+            for (auto position : positions) {
+                slowest = min(slowest, position);
+            }
+
+            return slowest;
+        }
+    };
+
+    Distributor::Distributor(
+            const SshPool *pool,
+            const map<const string, const string> *envvals,
+            ILogEventListener *log_listener,
+            const TransferOptions &options,
+            size_t fanout,
+            size_t parallel
+    ) : pool(pool),
+        envvals(envvals),
+        log_listener(log_listener),
+        options(options),
+        fanout(max(fanout, (size_t) 1)),
+        parallel(max(parallel, (size_t) 1)) {
+    }
+
+    bool Distributor::receive(const InventoryItem *parent, const InventoryItem *node) {
+        // Every node uses its own session and each node is only handled by one thread at a time
+        SshManager manager(pool, envvals, node);
+        SshApi api(&manager, log_listener);
+
+        auto temporary = remote_file + TEMPORARY_SUFFIX;
+
+        try {
+            bool received = false;
+
+            if (nullptr != parent) {
+                SshManager parent_manager(pool, envvals, parent);
+                SshApi parent_api(&parent_manager, log_listener);
+
+                ostringstream cmd;
+                cmd << "ssh -o BatchMode=yes -p " << node->get_port() << " "
+                    << shell_quote(node->get_user() + "@" + node->get_host()) << " "
+                    << shell_quote("cat > " + shell_quote(temporary)) << " < " << shell_quote(remote_file);
+
+                try {
+                    auto result = parent_api.execute(cmd.str(), false);
+
+                    if (0 == result.get_code()) {
+                        api.verify_upload(digest, temporary);
+                        received = true;
+                    } else {
+                        log_listener->emit_warning("Relay from <%s> failed - %s", parent->remote_id().c_str(),
+                                                   result.get_stderr().c_str());
+                    }
+                } catch (exception &e) {
+                    log_listener->emit_warning("Relay from <%s> failed - %s", parent->remote_id().c_str(), e.what());
+                }
+            }
+
+            if (!received) {
+                if (nullptr != parent) {
+                    log_listener->emit_info("Uploading directly instead");
+                }
+
+                api.upload_file(file, temporary, options);
+                api.verify_upload(digest, temporary);
+
+                lock_guard<mutex> lock(results_lock);
+                local_uploads++;
+            }
+
+            move_into_place(api, temporary);
+        } catch (exception &e) {
+            log_listener->emit_error("Distribution failed - %s", e.what());
+            return false;
+        }
+
+        return true;
+    }
+
+    void Distributor::move_into_place(const SshApi &api, const string &temporary) const {
+        auto result = api.execute("mv -f -- " + shell_quote(temporary) + " " + shell_quote(remote_file), false);
+        if (0 != result.get_code()) {
+            throw RuntimeException("Can not move file into place - %s", result.get_stderr().c_str());
+        }
+    }
+
+    void Distributor::add_children(long parent, long of) {
+        // Children of a node in a k-ary tree laid over the node list, local machine being the root
+        for (size_t i = 0; i < fanout; i++) {
+            auto child = (size_t) (of + 1) * fanout + i;
+            if (child < nodes.size()) {
+                pending.emplace_back(parent, child);
+            }
+        }
+    }
+
+    void Distributor::forward() {
+        log_listener->context_inherit(logger_context);
+
+        unique_lock<mutex> lock(pending_lock);
+        for (;;) {
+            // Every parent sends to one node at a time, nodes of busy parents wait for them
+            auto task = pending.end();
+            pending_changed.wait(lock, [this, &task]() {
+                task = find_if(pending.begin(), pending.end(), [this](const pair<long, size_t> &candidate) {
+                    return sending.find(candidate.first) == sending.end();
+                });
+
+                return task != pending.end() || 0 == in_flight;
+            });
+
+            if (task == pending.end()) {
+                break;
+            }
+
+            auto [index, child] = *task;
+            pending.erase(task);
+            sending.insert(index);
+            in_flight++;
+            lock.unlock();
+
+            const auto *parent = index < 0 ? nullptr : nodes[index];
+            const auto *node = nodes[child];
+
+            if (nullptr != parent) {
+                log_listener->context_push(parent->remote_id());
+            }
+
+            log_listener->emit_info("Sending to node <%s>", node->remote_id().c_str());
+
+            // Sessions to parent and node are only in use while sending
+            auto ok = receive(parent, node);
+
+            if (nullptr != parent) {
+                log_listener->context_pop();
+            }
+
+            {
+                lock_guard<mutex> results_guard(results_lock);
+                results[node->remote_id()] = ok;
+            }
+
+            lock.lock();
+            sending.erase(index);
+            in_flight--;
+
+            // Node forwards to own children, children of a failed node are served by its parent instead
+            add_children(ok ? (long) child : index, (long) child);
+            pending_changed.notify_all();
+        }
+
+        log_listener->context_clear();
+    }
+
+    map<string, bool> Distributor::distribute(
+            const vector<const InventoryItem *> &targets,
+            const string &local_file,
+            const string &remote_path
+    ) {
+        nodes = targets;
+        file = local_file;
+        remote_file = remote_path;
+        digest = DigestCache::get_default().get_local_digest(local_file);
+        logger_context = log_listener->get_context();
+        results.clear();
+        local_uploads = 0;
+
+        auto timer = log_listener->emit_info_wt(
+                "Distributing <%s> to <%zu> nodes, fan-out <%zu>", file.c_str(), nodes.size(), fanout);
+
+        {
+            lock_guard<mutex> lock(pending_lock);
+            pending.clear();
+            sending.clear();
+            in_flight = 0;
+            add_children(-1, -1);
+        }
+
+        // Fixed number of workers sends along the tree, forward() clears logger context of the thread it runs on
+        vector<thread> workers;
+        auto n_workers = min(parallel, nodes.size());
+        for (size_t i = 0; i < n_workers; i++) {
+            workers.emplace_back(&Distributor::forward, this);
+        }
+
+        for (auto &worker : workers) {
+            worker.join();
+        }
+
+        report(&timer);
+
+        return results;
+    }
+
+    void Distributor::report(LoggingTimer *timer) {
+        size_t failures = 0;
+        for (const auto &[remote_id, ok] : results) {
+            if (!ok) {
+                failures++;
+            }
+        }
+
+        if (0 == failures) {
+            log_listener->emit_success(timer, "Distribution complete, <%llu> of <%zu> nodes uploaded from local",
+                                       (unsigned long long) local_uploads, nodes.size());
+        } else {
+            log_listener->emit_warning(timer, "Distribution failed for <%zu> of <%zu> nodes",
+                                       failures, nodes.size());
+        }
+    }
+
+    void Distributor::send(const InventoryItem *node, MulticastRing *ring, size_t writer) {
+        log_listener->context_inherit(logger_context);
+        log_listener->context_push(node->remote_id());
+
+        auto temporary = remote_file + TEMPORARY_SUFFIX;
+        bool ok = false;
+
+        try {
+            SshManager manager(pool, envvals, node);
+            SshApi api(&manager, log_listener);
+
+            const auto *session = manager.get_or_create_session(log_listener->get_level());
+            SftpTransfer transfer(session->get_ssh_session(), log_listener, options);
+            auto remote = transfer.open_writer(temporary, true);
+
+            unique_lock<mutex> lock(ring->lock);
+            for (uint64_t block = 0; block < ring->n_blocks; block++) {
+                ring->changed.wait(lock, [ring, block]() {
+                    return ring->failed || ring->n_read > block;
+                });
+
+                if (ring->failed) {
+                    throw RuntimeException("Reading local file failed");
+                }
+
+                // Reader does not reuse the slot until every writer has moved past it
+                const auto slot = block % ring->slots.size();
+                lock.unlock();
+                remote->write(ring->slots[slot].data(), ring->slot_sizes[slot]);
+                lock.lock();
+
+                ring->positions[writer] = block + 1;
+                ring->changed.notify_all();
+            }
+
+            ring->changed.wait(lock, [ring]() {
+                return ring->failed || !ring->digest.empty();
+            });
+
+            if (ring->failed) {
+                throw RuntimeException("Reading local file failed");
+            }
+
+            lock.unlock();
+
+            remote->close();
+            api.verify_upload(ring->digest, temporary);
+            move_into_place(api, temporary);
+            ok = true;
+        } catch (exception &e) {
+            log_listener->emit_warning("Multicast failed - %s", e.what());
+        }
+
+        {
+            lock_guard<mutex> lock(ring->lock);
+            ring->positions[writer] = MULTICAST_WRITER_DONE;
+            ring->changed.notify_all();
+        }
+
+        {
+            lock_guard<mutex> lock(results_lock);
+            results[node->remote_id()] = ok;
+        }
+
+        log_listener->context_clear();
+    }
+
+    string Distributor::multicast_batch(MulticastRing *ring, int fd, uint64_t size, size_t first, size_t count) {
+        ring->n_read = 0;
+        ring->positions.assign(count, 0);
+        ring->failed = false;
+
+        vector<thread> writers;
+        for (size_t i = 0; i < count; i++) {
+            writers.emplace_back(&Distributor::send, this, nodes[first + i], ring, i);
+        }
+
+        // Blocks are read once for all nodes of the batch, digest is computed along the way
+        Sha256 sha;
+        string read_error;
+        for (uint64_t block = 0; block < ring->n_blocks; block++) {
+            unique_lock<mutex> lock(ring->lock);
+            ring->changed.wait(lock, [ring, block]() {
+                auto slowest = ring->slowest_position();
+                return MULTICAST_WRITER_DONE == slowest || block - slowest < ring->slots.size();
+            });
+
+            if (MULTICAST_WRITER_DONE == ring->slowest_position()) {
+                // Every writer failed, the rest of the file is not needed
+                break;
+            }
+
+            lock.unlock();
+
+            const auto slot = block % ring->slots.size();
+            auto offset = block * MULTICAST_BLOCK_SIZE;
+            auto length = (size_t) min((uint64_t) MULTICAST_BLOCK_SIZE, size - offset);
+            size_t filled = 0;
+
+            while (filled < length) {
+                auto *buffer = ring->slots[slot].data() + filled;
+                auto n_read = ::pread(fd, buffer, length - filled, (off_t) (offset + filled));
+
+                if (n_read < 0 && EINTR == errno) {
+                    continue;
+                }
+
+                if (n_read <= 0) {
+                    read_error = n_read < 0 ? strerror(errno) : "file truncated while uploading";
+                    break;
+                }
+
+                filled += n_read;
+            }
+
+            lock.lock();
+
+            if (!read_error.empty()) {
+                ring->failed = true;
+                ring->changed.notify_all();
+                break;
+            }
+
+            if (ring->digest.empty()) {
+                sha.update(ring->slots[slot].data(), length);
+            }
+            ring->slot_sizes[slot] = length;
+            ring->n_read = block + 1;
+            ring->changed.notify_all();
+        }
+
+        {
+            // Digest of a previous batch is kept, file must not change between batches
+            lock_guard<mutex> lock(ring->lock);
+            if (ring->digest.empty() && !ring->failed && ring->n_read == ring->n_blocks) {
+                ring->digest = sha.hex_digest();
+            }
+            ring->changed.notify_all();
+        }
+
+        for (auto &writer : writers) {
+            writer.join();
+        }
+
+        return read_error;
+    }
+
+    map<string, bool> Distributor::multicast(
+            const vector<const InventoryItem *> &targets,
+            const string &local_file,
+            const string &remote_path
+    ) {
+        nodes = targets;
+        file = local_file;
+        remote_file = remote_path;
+        logger_context = log_listener->get_context();
+        results.clear();
+        local_uploads = 0;
+
+        auto timer = log_listener->emit_info_wt("Multicasting <%s> to <%zu> nodes", file.c_str(), nodes.size());
+
+        auto fd = ::open(file.c_str(), O_RDONLY);
+        if (fd < 0) {
+            throw RuntimeException("Can not open file <%s> - %s", file.c_str(), strerror(errno));
+        }
+
+        auto size = std_fs::file_size(file);
+
+        MulticastRing ring;
+        ring.n_blocks = (size + MULTICAST_BLOCK_SIZE - 1) / MULTICAST_BLOCK_SIZE;
+        ring.slots.resize((size_t) min((uint64_t) MULTICAST_BLOCKS, max(ring.n_blocks, (uint64_t) 1)));
+        ring.slot_sizes.resize(ring.slots.size());
+        for (auto &slot : ring.slots) {
+            slot.resize(MULTICAST_BLOCK_SIZE);
+        }
+
+        // Only given number of nodes is written to at once, the same ring is used for every batch
+        string read_error;
+        for (size_t first = 0; first < nodes.size() && read_error.empty(); first += parallel) {
+            read_error = multicast_batch(&ring, fd, size, first, min(parallel, nodes.size() - first));
+        }
+
+        ::close(fd);
+
+        if (!read_error.empty()) {
+            throw RuntimeException("Can not read file <%s> - %s", file.c_str(), read_error.c_str());
+        }
+
+        // Nodes multicast could not reach, e.g. ones without SFTP, get a regular upload
+        digest = ring.digest.empty() ? DigestCache::get_default().get_local_digest(file) : ring.digest;
+        for (const auto *node : nodes) {
+            if (results[node->remote_id()]) {
+                continue;
+            }
+
+            log_listener->context_push(node->remote_id());
+            log_listener->emit_info("Uploading to node separately");
+            results[node->remote_id()] = receive(nullptr, node);
+            log_listener->context_pop();
+        }
+
+        report(&timer);
+
+        return results;
+    }
+}
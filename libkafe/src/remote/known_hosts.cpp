@@ -0,0 +1,298 @@
+/**
+ * This file is part of Kafe.
+ * https://github.com/libkafe/kafe/
+ *
+ * Copyright 2020 Matiss Treinis
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <algorithm>
+#include <cctype>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <sstream>
+#include <utility>
+#include <sys/stat.h>
+#include "kafe/remote/known_hosts.hpp"
+#include "kafe/io/digest.hpp"
+#include "kafe/io/file_system.hpp"
+#include "kafe/runtime/runtime_exception.hpp"
+
+using namespace kafe::io;
+using namespace kafe::runtime;
+
+namespace kafe::remote {
+    static const char *const KNOWN_HOSTS_HASH_MAGIC = "|1|";
+
+    static bool base64_decode(const string &encoded, string &decoded) {
+        decoded.clear();
+        uint32_t buffer = 0;
+        int bits = 0;
+
+        for (auto c : encoded) {
+            uint32_t value;
+
+            if (c >= 'A' && c <= 'Z') {
+                value = c - 'A';
+            } else if (c >= 'a' && c <= 'z') {
+                value = c - 'a' + 26;
+            } else if (c >= '0' && c <= '9') {
+                value = c - '0' + 52;
+            } else if ('+' == c) {
+                value = 62;
+            } else if ('/' == c) {
+                value = 63;
+            } else if ('=' == c) {
+                break;
+            } else {
+                return false;
+            }
+
+            buffer = (buffer << 6) | value;
+            bits += 6;
+
+            if (bits >= 8) {
+                bits -= 8;
+                decoded.push_back((char) ((buffer >> bits) & 0xff));
+            }
+        }
+
+        return true;
+    }
+
+    static string to_lower(string value) {
+        transform(value.begin(), value.end(), value.begin(), [](unsigned char c) {
+            return (char) tolower(c);
+        });
+
+        return value;
+    }
+
+    static string known_host_name(const string &host, unsigned int port) {
+        if (22 == port) {
+            return host;
+        }
+
+        return "[" + host + "]:" + to_string(port);
+    }
+
+    KnownHostsIndex::KnownHostsIndex(string path) : path(move(path)) {
+    }
+
+    KnownHostsIndex &KnownHostsIndex::get(const string &path) {
+        static mutex indexes_lock;
+        static map<string, unique_ptr<KnownHostsIndex>> indexes;
+
+        lock_guard<mutex> lock(indexes_lock);
+        auto &index = indexes[path];
+
+        if (!index) {
+            index = make_unique<KnownHostsIndex>(path);
+        }
+
+        return *index;
+    }
+
+    void KnownHostsIndex::refresh() {
+        struct stat info{};
+        auto exists = 0 == stat(path.c_str(), &info);
+
+        if (loaded && exists && info.st_dev == file_device && info.st_ino == file_inode
+            && info.st_size == file_size && info.st_mtime == file_mtime) {
+            return;
+        }
+
+        keys.clear();
+        hashed_hosts.clear();
+        revoked_keys.clear();
+
+        loaded = exists;
+        if (!exists) {
+            // Missing file leaves index empty, libssh reports it
+            return;
+        }
+
+        file_device = info.st_dev;
+        file_inode = info.st_ino;
+        file_size = info.st_size;
+        file_mtime = info.st_mtime;
+
+        ifstream file(path);
+        string line;
+
+        while (getline(file, line)) {
+            add_line(line);
+        }
+    }
+
+    void KnownHostsIndex::add_line(const string &line) {
+        istringstream fields(line);
+        string hosts;
+
+        if (!(fields >> hosts) || '#' == hosts[0]) {
+            return;
+        }
+
+        string marker;
+        if ('@' == hosts[0]) {
+            marker = hosts;
+
+            if (!(fields >> hosts)) {
+                return;
+            }
+        }
+
+        string key_type;
+        string key;
+        if (!(fields >> key_type >> key)) {
+            return;
+        }
+
+        if ("@revoked" == marker) {
+            revoked_keys.insert(key);
+            return;
+        }
+
+        // Keys of certificate authorities only sign host keys, they are never host keys themselves
+        if (!marker.empty()) {
+            return;
+        }
+
+        if (0 == hosts.rfind(KNOWN_HOSTS_HASH_MAGIC, 0)) {
+            auto separator = hosts.find('|', 3);
+            HashedHost hashed;
+
+            if (string::npos == separator
+                || !base64_decode(hosts.substr(3, separator - 3), hashed.salt)
+                || !base64_decode(hosts.substr(separator + 1), hashed.hash)) {
+                return;
+            }
+
+            hashed_hosts[key].push_back(hashed);
+            return;
+        }
+
+        // Patterns are left for libssh, along with the rest of the line - a negated pattern excludes hosts from it
+        if (string::npos != hosts.find_first_of("*?!")) {
+            return;
+        }
+
+        istringstream names(hosts);
+        string name;
+        while (getline(names, name, ',')) {
+            if (!name.empty()) {
+                keys[to_lower(name)].push_back(key);
+            }
+        }
+    }
+
+    KnownHostMatch KnownHostsIndex::match(const string &host, unsigned int port, const string &key) {
+        lock_guard<mutex> lock(index_lock);
+        refresh();
+
+        if (revoked_keys.find(key) != revoked_keys.end()) {
+            return KnownHostMatch::REVOKED;
+        }
+
+        auto name = known_host_name(host, port);
+        auto plain = keys.find(to_lower(name));
+
+        if (plain != keys.end() && plain->second.end() != find(plain->second.begin(), plain->second.end(), key)) {
+            return KnownHostMatch::KNOWN;
+        }
+
+        auto hashed = hashed_hosts.find(key);
+        if (hashed == hashed_hosts.end()) {
+            return KnownHostMatch::NOT_CONFIRMED;
+        }
+
+        for (const auto &entry : hashed->second) {
+            if (Sha1::hmac(entry.salt, name) == entry.hash) {
+                return KnownHostMatch::KNOWN;
+            }
+        }
+
+        return KnownHostMatch::NOT_CONFIRMED;
+    }
+
+    static string get_known_hosts_file(ssh_session session) {
+        char *configured = nullptr;
+        string known_hosts = "~/.ssh/known_hosts";
+
+        if (SSH_OK == ssh_options_get(session, SSH_OPTIONS_KNOWNHOSTS, &configured) && nullptr != configured) {
+            known_hosts = configured;
+            ssh_string_free_char(configured);
+        }
+
+        if (0 == known_hosts.rfind("%d", 0)) {
+            known_hosts = "~/.ssh" + known_hosts.substr(2);
+        }
+
+        return FileSystem::expand(known_hosts).string();
+    }
+
+    static bool get_server_key(ssh_session session, string &key) {
+        ssh_key server_key = nullptr;
+
+#if LIBSSH_VERSION_INT >= SSH_VERSION_INT(0, 8, 0)
+        auto rc = ssh_get_server_publickey(session, &server_key);
+#else
+        auto rc = ssh_get_publickey(session, &server_key);
+#endif
+        if (SSH_OK != rc) {
+            return false;
+        }
+
+        char *encoded = nullptr;
+        rc = ssh_pki_export_pubkey_base64(server_key, &encoded);
+        ssh_key_free(server_key);
+
+        if (SSH_OK != rc || nullptr == encoded) {
+            return false;
+        }
+
+        key = encoded;
+        ssh_string_free_char(encoded);
+
+        return true;
+    }
+
+    bool KnownHostsIndex::verify(ssh_session session, const string &host, unsigned int port) {
+        string key;
+        auto result = KnownHostMatch::NOT_CONFIRMED;
+
+        try {
+            if (get_server_key(session, key)) {
+                result = get(get_known_hosts_file(session)).match(host, port, key);
+            }
+        } catch (RuntimeException &e) {
+            // Without home directory, libssh is left to find known hosts itself
+        }
+
+        if (KnownHostMatch::REVOKED == result) {
+            return false;
+        }
+
+        if (KnownHostMatch::KNOWN == result) {
+            return true;
+        }
+
+#if LIBSSH_VERSION_INT >= SSH_VERSION_INT(0, 8, 4)
+        return SSH_KNOWN_HOSTS_OK == ssh_session_is_known_server(session);
+#else
+        return SSH_SERVER_KNOWN_OK == ssh_is_server_known(session);
+#endif
+    }
+}
@@ -0,0 +1,495 @@
+/**
+ * This file is part of Kafe.
+ * https://github.com/libkafe/kafe/
+ *
+ * Copyright 2020 Matiss Treinis
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <vector>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "kafe/remote/sftp_transfer.hpp"
+#include "kafe/io/file_system.hpp"
+
+using namespace kafe::io;
+
+namespace kafe::remote {
+    // Largest request every SFTP server is required to accept
+    static const size_t SFTP_COMPAT_CHUNK_SIZE = 32768;
+
+#ifdef KAFE_SFTP_AIO
+    typedef sftp_aio SftpReadRequest;
+
+    static bool sftp_read_begin(sftp_file file, size_t length, SftpReadRequest *request) {
+        return sftp_aio_begin_read(file, length, request) >= 0;
+    }
+
+    static ssize_t sftp_read_wait(sftp_file, SftpReadRequest *request, void *buffer, size_t length) {
+        return sftp_aio_wait_read(request, buffer, length);
+    }
+
+    static void sftp_read_free(SftpReadRequest *request) {
+        sftp_aio_free(*request);
+    }
+#else
+    typedef uint32_t SftpReadRequest;
+
+    static bool sftp_read_begin(sftp_file file, size_t length, SftpReadRequest *request) {
+        auto id = sftp_async_read_begin(file, (uint32_t) length);
+        *request = (uint32_t) id;
+        return id >= 0;
+    }
+
+    static ssize_t sftp_read_wait(sftp_file file, SftpReadRequest *request, void *buffer, size_t length) {
+        return sftp_async_read(file, buffer, (uint32_t) length, *request);
+    }
+
+    static void sftp_read_free(SftpReadRequest *) {
+        // Responses to abandoned requests are discarded by libssh once the file is closed
+    }
+#endif
+
+    struct SftpPendingRead {
+        SftpReadRequest request;
+        uint64_t offset;
+        size_t length;
+    };
+
+    static string get_env(const map<const string, const string> *envvals, const char *name) {
+        auto value = envvals->find(name);
+
+        return envvals->end() == value ? string() : value->second;
+    }
+
+    static size_t get_env_size(
+            const map<const string, const string> *envvals,
+            const char *name,
+            size_t default_value
+    ) {
+        auto value = get_env(envvals, name);
+
+        if (value.empty()) {
+            return default_value;
+        }
+
+        char *end = nullptr;
+        auto parsed = strtoull(value.c_str(), &end, 10);
+
+        if (nullptr == end || '\0' != *end || 0 == parsed) {
+            throw RuntimeException("Environment variable <%s> must be a positive integer", name);
+        }
+
+        return (size_t) parsed;
+    }
+
+    TransferOptions TransferOptions::from_env(const map<const string, const string> *envvals) {
+        TransferOptions options;
+
+        auto engine = get_env(envvals, "KAFE_SSH_TRANSFER");
+        if (!engine.empty()) {
+            if ("scp" == engine) {
+                options.engine = TRANSFER_SCP;
+            } else if ("sftp" == engine) {
+                options.engine = TRANSFER_SFTP;
+            } else {
+                throw RuntimeException("Environment variable <KAFE_SSH_TRANSFER> must be either scp or sftp");
+            }
+        }
+
+        options.chunk_size = get_env_size(envvals, "KAFE_SSH_TRANSFER_CHUNK_SIZE", options.chunk_size);
+        options.max_requests = get_env_size(envvals, "KAFE_SSH_TRANSFER_REQUESTS", options.max_requests);
+        options.streams = get_env_size(envvals, "KAFE_SSH_TRANSFER_STREAMS", options.streams);
+
+        return options;
+    }
+
+    SftpUnavailableException::SftpUnavailableException(const string &reason)
+            : RuntimeException("SFTP subsystem not available - %s", reason.c_str()) {
+    }
+
+    SftpTransfer::SftpTransfer(
+            ssh_session session,
+            const ILogEventListener *log_listener,
+            const TransferOptions &options
+    ) : session(session), log_listener(log_listener), options(options) {
+        sftp = sftp_new(session);
+
+        if (nullptr == sftp) {
+            throw SftpUnavailableException(ssh_get_error(session));
+        }
+
+        if (SSH_OK != sftp_init(sftp)) {
+            auto reason = string(ssh_get_error(session));
+            sftp_free(sftp);
+            throw SftpUnavailableException(reason);
+        }
+    }
+
+    SftpTransfer::~SftpTransfer() {
+        sftp_free(sftp);
+    }
+
+    size_t SftpTransfer::get_chunk_size(bool is_write) const {
+        auto chunk_size = options.chunk_size;
+
+#if LIBSSH_VERSION_INT >= SSH_VERSION_INT(0, 10, 0)
+        auto *limits = sftp_limits(sftp);
+        if (nullptr != limits) {
+            auto limit = is_write ? limits->max_write_length : limits->max_read_length;
+            if (limit > 0 && chunk_size > limit) {
+                chunk_size = (size_t) limit;
+            }
+            sftp_limits_free(limits);
+        } else {
+            chunk_size = min(chunk_size, SFTP_COMPAT_CHUNK_SIZE);
+        }
+#else
+        chunk_size = min(chunk_size, SFTP_COMPAT_CHUNK_SIZE);
+#endif
+
+        return max(chunk_size, (size_t) 1);
+    }
+
+    void SftpTransfer::raise(const char *operation, const string &path) const {
+        throw RuntimeException("SFTP error %s <%s> [code %d: %s]", operation, path.c_str(), sftp_get_error(sftp),
+                               ssh_get_error(session));
+    }
+
+    string SftpTransfer::resolve_upload_path(const string &file, const string &remote_file) const {
+        // Same as SCP - when target is a directory, upload into it
+        auto remote_path = remote_file;
+        auto *attributes = sftp_stat(sftp, remote_path.c_str());
+        if (nullptr != attributes) {
+            if (SSH_FILEXFER_TYPE_DIRECTORY == attributes->type) {
+                remote_path = (std_fs::path(remote_path) / std_fs::path(file).filename()).string();
+            }
+            sftp_attributes_free(attributes);
+        }
+
+        return remote_path;
+    }
+
+    string SftpTransfer::upload(const string &file, const string &remote_file) const {
+        auto remote_path = resolve_upload_path(file, remote_file);
+        upload_range(file, remote_path, 0, std_fs::file_size(file), true);
+        return remote_path;
+    }
+
+    void SftpTransfer::upload_range(
+            const string &file,
+            const string &remote_path,
+            uint64_t offset,
+            uint64_t length,
+            bool truncate
+    ) const {
+        upload_ranges(file, remote_path, {{offset, length}}, truncate);
+    }
+
+    void SftpTransfer::upload_ranges(
+            const string &file,
+            const string &remote_path,
+            const vector<pair<uint64_t, uint64_t>> &ranges,
+            bool truncate
+    ) const {
+        auto writer = open_writer(remote_path, truncate);
+
+        auto fd = ::open(file.c_str(), O_RDONLY);
+        if (fd < 0) {
+            throw RuntimeException("Can not open file <%s> - %s", file.c_str(), strerror(errno));
+        }
+
+        const auto chunk_size = get_chunk_size(true);
+        vector<char> buffer(chunk_size);
+
+        log_listener->emit_debug("SFTP upload in <%zu> byte chunks, up to <%zu> requests in flight",
+                                 chunk_size, options.max_requests);
+
+        try {
+            uint64_t position = 0;
+
+            for (const auto &[range_offset, range_length] : ranges) {
+                // Requests already in flight are not affected by moving to the next range
+                if (range_offset != position) {
+                    writer->seek(range_offset);
+                }
+
+                auto offset = range_offset;
+                auto end = range_offset + range_length;
+
+                while (offset < end) {
+                    auto request_length = (size_t) min((uint64_t) chunk_size, end - offset);
+                    auto n_read = ::pread(fd, buffer.data(), request_length, (off_t) offset);
+
+                    if (n_read < 0 && EINTR == errno) {
+                        continue;
+                    }
+
+                    if (n_read <= 0) {
+                        throw RuntimeException("Can not read file <%s> - %s", file.c_str(),
+                                               n_read < 0 ? strerror(errno) : "file truncated while uploading");
+                    }
+
+                    writer->write(buffer.data(), (size_t) n_read);
+                    offset += n_read;
+                }
+
+                position = end;
+            }
+
+            writer->close();
+        } catch (...) {
+            ::close(fd);
+            throw;
+        }
+
+        ::close(fd);
+    }
+
+    unique_ptr<SftpWriter> SftpTransfer::open_writer(const string &remote_path, bool truncate) const {
+        return make_unique<SftpWriter>(session, sftp, remote_path, truncate, get_chunk_size(true),
+                                       max(options.max_requests, (size_t) 1));
+    }
+
+    SftpWriter::SftpWriter(
+            ssh_session session,
+            sftp_session sftp,
+            const string &remote_path,
+            bool truncate,
+            size_t chunk_size,
+            size_t max_requests
+    ) : session(session), sftp(sftp), remote_path(remote_path), chunk_size(chunk_size), max_requests(max_requests) {
+        auto flags = truncate ? O_WRONLY | O_CREAT | O_TRUNC : O_WRONLY;
+        remote = sftp_open(sftp, remote_path.c_str(), flags, 0600);
+
+        if (nullptr == remote) {
+            raise("opening");
+        }
+    }
+
+    SftpWriter::~SftpWriter() {
+#ifdef KAFE_SFTP_AIO
+        for (auto aio : in_flight) {
+            sftp_aio_free(aio);
+        }
+#endif
+
+        if (nullptr != remote) {
+            sftp_close(remote);
+        }
+    }
+
+    void SftpWriter::raise(const char *operation) const {
+        throw RuntimeException("SFTP error %s <%s> [code %d: %s]", operation, remote_path.c_str(),
+                               sftp_get_error(sftp), ssh_get_error(session));
+    }
+
+    void SftpWriter::seek(uint64_t offset) {
+        if (SSH_OK != sftp_seek64(remote, offset)) {
+            raise("seeking in");
+        }
+    }
+
+    void SftpWriter::write(const char *data, size_t size) {
+        while (size > 0) {
+            auto length = min(size, chunk_size);
+
+#ifdef KAFE_SFTP_AIO
+            if (in_flight.size() >= max_requests) {
+                auto aio = in_flight.front();
+                in_flight.pop_front();
+
+                if (sftp_aio_wait_write(&aio) < 0) {
+                    raise("writing");
+                }
+            }
+
+            // Request is sent out right away, data can be reused once this returns
+            sftp_aio aio = nullptr;
+            auto n_written = sftp_aio_begin_write(remote, data, length, &aio);
+            if (n_written <= 0) {
+                raise("writing");
+            }
+            in_flight.push_back(aio);
+            length = (size_t) n_written;
+#else
+            if (sftp_write(remote, data, length) != (ssize_t) length) {
+                raise("writing");
+            }
+#endif
+
+            data += length;
+            size -= length;
+        }
+    }
+
+    void SftpWriter::close() {
+#ifdef KAFE_SFTP_AIO
+        while (!in_flight.empty()) {
+            auto aio = in_flight.front();
+            in_flight.pop_front();
+
+            if (sftp_aio_wait_write(&aio) < 0) {
+                raise("writing");
+            }
+        }
+#endif
+
+        auto *file = remote;
+        remote = nullptr;
+
+        if (SSH_NO_ERROR != sftp_close(file)) {
+            raise("closing");
+        }
+    }
+
+    void SftpTransfer::download(const string &file, const string &remote_file) const {
+        auto *remote = sftp_open(sftp, remote_file.c_str(), O_RDONLY, 0);
+        if (nullptr == remote) {
+            raise("opening", remote_file);
+        }
+
+        auto *attributes = sftp_fstat(remote);
+        if (nullptr == attributes) {
+            sftp_close(remote);
+            raise("reading attributes of", remote_file);
+        }
+
+        auto size = attributes->size;
+        sftp_attributes_free(attributes);
+
+        auto fd = ::open(file.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) {
+            sftp_close(remote);
+            throw RuntimeException("Can not open file <%s> for writing - %s", file.c_str(), strerror(errno));
+        }
+
+#ifdef __linux__
+        // Reserve space up front - avoids fragmentation and fails early if the disk is full
+        auto rc = posix_fallocate(fd, 0, (off_t) size);
+        if (0 != rc && EOPNOTSUPP != rc && EINVAL != rc) {
+            ::close(fd);
+            sftp_close(remote);
+            throw RuntimeException("Can not allocate <%llu> bytes for file <%s> - %s",
+                                   (unsigned long long) size, file.c_str(), strerror(rc));
+        }
+#endif
+
+        const auto chunk_size = get_chunk_size(false);
+        vector<char> buffer(chunk_size);
+
+        log_listener->emit_debug("SFTP download in <%zu> byte chunks, up to <%zu> requests in flight",
+                                 chunk_size, options.max_requests);
+
+        deque<SftpPendingRead> in_flight;
+        uint64_t next_offset = 0;
+        // Remote file might shrink while being downloaded, it ends where first EOF is seen
+        uint64_t end = size;
+        bool failed = false;
+        const char *failed_operation = "reading";
+
+        while (!failed) {
+            while (in_flight.size() < options.max_requests && next_offset < end) {
+                SftpPendingRead pending{};
+                pending.offset = next_offset;
+                pending.length = (size_t) min((uint64_t) chunk_size, end - next_offset);
+
+                if (!sftp_read_begin(remote, pending.length, &pending.request)) {
+                    failed = true;
+                    break;
+                }
+
+                in_flight.push_back(pending);
+                next_offset += pending.length;
+            }
+
+            if (failed || in_flight.empty()) {
+                break;
+            }
+
+            auto pending = in_flight.front();
+            in_flight.pop_front();
+
+            auto n_read = sftp_read_wait(remote, &pending.request, buffer.data(), pending.length);
+
+            if (n_read < 0) {
+                failed = true;
+                break;
+            }
+
+            if (0 == n_read) {
+                end = min(end, pending.offset);
+                continue;
+            }
+
+            size_t written = 0;
+            while (written < (size_t) n_read) {
+                auto n_written = ::pwrite(fd, buffer.data() + written, n_read - written,
+                                          (off_t) (pending.offset + written));
+                if (n_written < 0 && EINTR == errno) {
+                    continue;
+                }
+
+                if (n_written <= 0) {
+                    failed = true;
+                    failed_operation = "writing local file for";
+                    break;
+                }
+
+                written += n_written;
+            }
+
+            if ((size_t) n_read < pending.length && !failed) {
+                // Server returned less than asked for - request the rest again, out of order
+                SftpPendingRead rest{};
+                rest.offset = pending.offset + n_read;
+                rest.length = pending.length - n_read;
+
+                if (SSH_OK != sftp_seek64(remote, rest.offset) || !sftp_read_begin(remote, rest.length, &rest.request)
+                    || SSH_OK != sftp_seek64(remote, next_offset)) {
+                    failed = true;
+                    break;
+                }
+
+                in_flight.push_back(rest);
+            }
+        }
+
+        for (auto &pending : in_flight) {
+            sftp_read_free(&pending.request);
+        }
+
+        if (failed) {
+            ::close(fd);
+            sftp_close(remote);
+            raise(failed_operation, remote_file);
+        }
+
+        sftp_close(remote);
+
+        if (end < size && 0 != ftruncate(fd, (off_t) end)) {
+            ::close(fd);
+            throw RuntimeException("Can not write file <%s> - %s", file.c_str(), strerror(errno));
+        }
+
+        if (0 != ::close(fd)) {
+            throw RuntimeException("Can not write file <%s> - %s", file.c_str(), strerror(errno));
+        }
+    }
+}
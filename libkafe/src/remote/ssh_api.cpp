@@ -17,12 +17,29 @@
  * limitations under the License.
  */
 
+#include <chrono>
 #include <fstream>
 #include <iostream>
+#include <map>
+#include <memory>
+#include <random>
+#include <sstream>
 #include <string>
+#include <tuple>
+#include <climits>
 #include <cstring>
+#include <thread>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
 #include "kafe/remote/ssh_api.hpp"
 #include "kafe/io/file_system.hpp"
+#include "kafe/io/output_capture.hpp"
+#include "kafe/io/output_file.hpp"
+#include "kafe/remote/sftp_transfer.hpp"
+#include "kafe/io/digest.hpp"
+#include "kafe/remote/digest_cache.hpp"
+#include "kafe/runtime/cancellation.hpp"
 
 using namespace kafe;
 using namespace kafe::io;
@@ -31,6 +48,10 @@ namespace kafe::remote {
     RemoteResult::RemoteResult(string &out, string &err, int code) : out(out), err(err), code(code) {
     }
 
+    RemoteResult::RemoteResult(string &out, string &err, int code, bool timed_out, bool cancelled)
+            : out(out), err(err), code(code), timed_out(timed_out), cancelled(cancelled) {
+    }
+
     const string &RemoteResult::get_stdout() const {
         return out;
     }
@@ -43,111 +64,577 @@ namespace kafe::remote {
         return code;
     }
 
-    static string ssh_read_channel_out(
+    bool RemoteResult::is_timed_out() const {
+        return timed_out;
+    }
+
+    bool RemoteResult::is_cancelled() const {
+        return cancelled;
+    }
+
+    RemoteFileResult::RemoteFileResult(string &err, int code, uint64_t size) : err(err), code(code), size(size) {
+    }
+
+    const string &RemoteFileResult::get_stderr() const {
+        return err;
+    }
+
+    int RemoteFileResult::get_code() const {
+        return code;
+    }
+
+    uint64_t RemoteFileResult::get_size() const {
+        return size;
+    }
+
+    RemoteBatchResult::RemoteBatchResult(string &out, string &err, int code, uint64_t duration_ms)
+            : out(out), err(err), code(code), duration_ms(duration_ms) {
+    }
+
+    const string &RemoteBatchResult::get_stdout() const {
+        return out;
+    }
+
+    const string &RemoteBatchResult::get_stderr() const {
+        return err;
+    }
+
+    int RemoteBatchResult::get_code() const {
+        return code;
+    }
+
+    uint64_t RemoteBatchResult::get_duration_ms() const {
+        return duration_ms;
+    }
+
+    // Output is waited for in slices this long, to notice timeout and cancellation of silent commands
+    static const int SSH_POLL_SLICE_MS = 200;
+
+    // Opening a channel is given up on after this many seconds, and retried over a new connection once
+    static const long SSH_CHANNEL_OPEN_TIMEOUT = 30;
+    static const size_t SSH_CHANNEL_OPEN_ATTEMPTS = 2;
+
+    // Commands writing output to file are expected to only report progress or errors on stderr
+    static const size_t SSH_FILE_STDERR_TAIL_LINES = 1000;
+
+    // Shell reading commands from stdin - login shell is used if it is a POSIX shell, same as for commands executed
+    // directly
+    static const char *SSH_POSIX_SHELL_COMMAND =
+            "exec /bin/sh -c 'case \"${SHELL##*/}\" in bash|zsh|ksh|mksh|dash|ash) exec \"$SHELL\";; esac; "
+            "exec /bin/sh'";
+
+    template<typename T>
+    static bool ssh_drain_channel(ssh_channel channel, int is_stderr, T &sink) {
+        int n_read;
+
+        do {
+            auto *buffer = sink.reserve(OutputCapture::CHUNK_SIZE);
+            n_read = ssh_channel_read_nonblocking(channel, buffer, OutputCapture::CHUNK_SIZE, is_stderr);
+
+            if (n_read > 0) {
+                sink.commit(n_read);
+            }
+        } while (n_read > 0);
+
+        return SSH_ERROR != n_read;
+    }
+
+    /**
+     * How reading output of remote command ended.
+     */
+    enum class ChannelPollEnd {
+        // Remote end closed the channel or connection was lost - silent commands are only given up on by timeout
+        COMPLETE,
+        STOPPED,
+        TIMED_OUT,
+        CANCELLED
+    };
+
+    /**
+     * Ask remote command to terminate and close the channel. Servers not supporting signals only hang up on the
+     * command, which ends it once it writes output or reads input.
+     */
+    static void ssh_abort_channel(ssh_channel channel) {
+        if (ssh_channel_is_open(channel)) {
+            ssh_channel_request_send_signal(channel, "TERM");
+            ssh_channel_close(channel);
+        }
+    }
+
+    static long ssh_elapsed_ms(const chrono::steady_clock::time_point &since) {
+        return (long) chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - since).count();
+    }
+
+    /**
+     * Move stdout and stderr of the channel to given sinks as data arrives, until remote end closes both, stopped
+     * is set, command runs for longer than timeout (if not 0) or cancellation is requested - or given check, if
+     * any, tells nobody waits for the command any more.
+     */
+    template<typename T, typename U>
+    static ChannelPollEnd ssh_poll_channel(
             const ILogEventListener *listener,
             ssh_channel channel,
-            int is_stderr,
-            bool print_output
+            T &sink_out,
+            U &sink_err,
+            const bool &stopped,
+            int keepalive_ms,
+            long timeout_ms,
+            const function<bool()> &is_abandoned
     ) {
-        const size_t buffer_size = 256;
-        size_t output_size = 4096;
-
-        char *output = (char *) malloc(output_size);
-        unsigned long current_pos = 0;
-        unsigned long last_line_pos = 0;
-        int ssh_n_read = 0;
-        char buffer[buffer_size];
-        char *line_buffer = (char *) malloc(256);
-        do {
-            ssh_n_read = ssh_channel_read_timeout(channel, buffer, buffer_size, is_stderr, 1800000);
-            if (ssh_n_read > 0) {
-                for (int i = 0; i < ssh_n_read; i++) {
-                    auto c = buffer[i];
-                    output[current_pos] = c;
-
-                    if (print_output && c == '\n') {
-                        const unsigned long size_of = sizeof(char) * (current_pos - last_line_pos + 1);
-                        line_buffer = (char *) realloc(line_buffer, size_of + 1);
-                        memcpy(line_buffer, output + last_line_pos, size_of);
-                        line_buffer[size_of] = '\0';
-
-                        if (is_stderr) {
-                            listener->on_stderr_line(">> err", line_buffer);
-                        } else {
-                            listener->on_stdout_line(">> out", line_buffer);
-                        }
-
-                        last_line_pos = current_pos + 1;
-                    }
+        auto started = chrono::steady_clock::now();
+        auto last_activity = started;
+        auto last_keepalive = started;
+        auto result = ChannelPollEnd::COMPLETE;
+
+        auto *event = ssh_event_new();
+        ssh_event_add_session(event, ssh_channel_get_session(channel));
+
+        try {
+            for (;;) {
+                if (!ssh_drain_channel(channel, 0, sink_out) || !ssh_drain_channel(channel, 1, sink_err)) {
+                    break;
+                }
+
+                if (stopped) {
+                    result = ChannelPollEnd::STOPPED;
+                    break;
+                }
+
+                if (ssh_channel_is_eof(channel) || ssh_channel_is_closed(channel)) {
+                    // Remote might have sent data along with EOF - pick up whatever is left in buffers
+                    ssh_drain_channel(channel, 0, sink_out);
+                    ssh_drain_channel(channel, 1, sink_err);
+                    break;
+                }
+
+                if (Cancellation::is_requested() || (is_abandoned && is_abandoned())) {
+                    result = ChannelPollEnd::CANCELLED;
+                    break;
+                }
+
+                if (timeout_ms > 0 && ssh_elapsed_ms(started) >= timeout_ms) {
+                    result = ChannelPollEnd::TIMED_OUT;
+                    break;
+                }
 
-                    current_pos++;
+                // Waits in short slices, so that timeout and cancellation are noticed while command is silent
+                auto rc = ssh_event_dopoll(event, SSH_POLL_SLICE_MS);
 
-                    if (current_pos > output_size) {
-                        output_size += buffer_size;
-                        output = (char *) realloc(output, output_size);
+                if (SSH_ERROR == rc) {
+                    // Interrupt makes polling fail
+                    if (Cancellation::is_requested()) {
+                        result = ChannelPollEnd::CANCELLED;
                     }
+                    break;
+                }
+
+                if (SSH_AGAIN != rc) {
+                    last_activity = chrono::steady_clock::now();
+                    continue;
+                }
+
+                if (keepalive_ms <= 0 || ssh_elapsed_ms(last_activity) < keepalive_ms
+                    || ssh_elapsed_ms(last_keepalive) < keepalive_ms) {
+                    continue;
+                }
+
+                // Idle connections are dropped by NAT and firewalls along the way if nothing is sent
+                last_keepalive = chrono::steady_clock::now();
+                if (SSH_OK != ssh_send_ignore(ssh_channel_get_session(channel), "")) {
+                    listener->emit_warning("Connection lost while waiting for output of remote command");
+                    break;
                 }
             }
-        } while (ssh_n_read > 0);
+        } catch (exception &e) {
+            ssh_event_remove_session(event, ssh_channel_get_session(channel));
+            ssh_event_free(event);
+            throw;
+        }
 
-        // Strip last line
-        if (output[current_pos - 1] == '\n') {
-            output[current_pos - 1] = '\0';
-        } else {
-            output[current_pos] = '\0';
+        ssh_event_remove_session(event, ssh_channel_get_session(channel));
+        ssh_event_free(event);
+
+        return result;
+    }
+
+    template<typename T, typename U>
+    static ChannelPollEnd ssh_poll_channel(
+            const ILogEventListener *listener,
+            ssh_channel channel,
+            T &sink_out,
+            U &sink_err,
+            const bool &stopped,
+            int keepalive_ms,
+            long timeout_ms
+    ) {
+        return ssh_poll_channel(listener, channel, sink_out, sink_err, stopped, keepalive_ms, timeout_ms, nullptr);
+    }
+
+    /**
+     * Sink handing raw chunks of output to a callback, without retaining them.
+     */
+    class OutputChunkSink {
+        const OutputChunkCallback &callback;
+        bool is_stderr;
+        bool &stopped;
+        vector<char> buffer;
+
+    public:
+        OutputChunkSink(const OutputChunkCallback &callback, bool is_stderr, bool &stopped)
+                : callback(callback), is_stderr(is_stderr), stopped(stopped) {
         }
 
-        auto result = string(output);
+        char *reserve(size_t length) {
+            buffer.resize(length);
+            return buffer.data();
+        }
 
-        delete[](line_buffer);
-        delete[](output);
+        void commit(size_t length) {
+            if (!stopped && !callback(is_stderr, buffer.data(), length)) {
+                stopped = true;
+            }
+        }
+    };
 
-        return result;
+    static OutputLineListener ssh_line_listener(
+            const ILogEventListener *listener,
+            bool is_stderr,
+            bool print_output,
+            const OutputLineCallback &line_callback,
+            bool &stopped
+    ) {
+        if (!print_output && !line_callback) {
+            return nullptr;
+        }
+
+        return [listener, is_stderr, print_output, line_callback, &stopped](string_view line) {
+            if (print_output) {
+                if (is_stderr) {
+                    listener->on_stderr_line(">> err", string(line));
+                } else {
+                    listener->on_stdout_line(">> out", string(line));
+                }
+            }
+
+            if (line_callback && !stopped && !line_callback(is_stderr, line)) {
+                stopped = true;
+            }
+        };
     }
 
-    SshApi::SshApi(const SshManager *manager, const ILogEventListener *log_listener)
-            : manager(const_cast<SshManager *>(manager)), log_listener(log_listener) {}
+    /**
+     * Read stdout and stderr of the channel concurrently, as data arrives, until remote end closes both or reading
+     * ends early - line callback requested the command to be stopped, it timed out or was cancelled.
+     */
+    static ChannelPollEnd ssh_read_channel_out(
+            const ILogEventListener *listener,
+            ssh_channel channel,
+            bool print_output,
+            const OutputLineCallback &line_callback,
+            const OutputCapturePolicy &policy,
+            string &out,
+            string &err,
+            int keepalive_ms,
+            long timeout_ms
+    ) {
+        bool stopped = false;
+        // Output streamed to callback is not retained - memory use does not depend on output size
+        bool retain = !line_callback;
 
-    void SshApi::chdir(const string &chdir) {
-        this->current_chdir = chdir;
+        OutputCapture capture_out(
+                ssh_line_listener(listener, false, print_output, line_callback, stopped), retain, policy);
+        OutputCapture capture_err(
+                ssh_line_listener(listener, true, print_output, line_callback, stopped), retain, policy);
+
+        auto result = ssh_poll_channel(listener, channel, capture_out, capture_err, stopped, keepalive_ms, timeout_ms);
+
+        out = capture_out.finish();
+        err = capture_err.finish();
+
+        if (capture_out.is_truncated() || capture_err.is_truncated()) {
+            listener->emit_debug("Part of command output was discarded by capture policy");
+        }
+
+        return result;
     }
 
-    RemoteResult SshApi::execute(const string &command, const bool print_output) const {
-        const auto *session = manager->get_or_create_session(log_listener->get_level());
-        auto *ssh_session = session->get_ssh_session();
+    /**
+     * Shell kept running on the remote, commands are written to its stdin one after another.
+     */
+    struct SshShell {
+        // Channel is gone along with the session it was opened on, if that session has been replaced since
+        const SshSession *session = nullptr;
+        ssh_channel channel = nullptr;
+        // Makes sentinels impossible to guess for commands producing output
+        string token;
+        uint64_t counter = 0;
+        // Directory shell is in, as set with SshApi::chdir - shell starts in home directory same as exec does
+        string directory;
+        bool directory_known = true;
+    };
+
+    /**
+     * Sink moving output of command executed in persistent shell to capture, up to sentinel marking its end.
+     */
+    class ShellSentinelSink {
+        OutputCapture &capture;
+        const string marker;
+        function<void()> on_progress;
+        vector<char> buffer;
+        string pending;
+        bool found = false;
+        string trailer;
+
+        void forward(const char *data, size_t length) {
+            if (0 == length) {
+                return;
+            }
 
-        ssh_channel channel;
-        int rc;
+            memcpy(capture.reserve(length), data, length);
+            capture.commit(length);
+        }
 
-        channel = ssh_channel_new(ssh_session);
-        if (nullptr == channel) {
-            throw RuntimeException("SSH error [code %d: %s]", ssh_get_error_code(ssh_session),
-                                   ssh_get_error(ssh_session));
+    public:
+        ShellSentinelSink(OutputCapture &capture, const string &sentinel, function<void()> on_progress)
+                : capture(capture), marker("\n" + sentinel), on_progress(move(on_progress)) {
         }
 
-        rc = ssh_channel_open_session(channel);
-        if (SSH_OK != rc) {
-            ssh_channel_free(channel);
-            throw RuntimeException("SSH error [code %d: %s]", ssh_get_error_code(ssh_session),
-                                   ssh_get_error(ssh_session));
+        char *reserve(size_t length) {
+            buffer.resize(length);
+            return buffer.data();
         }
 
-        ostringstream cmd_buf;
+        void commit(size_t length) {
+            if (found) {
+                trailer.append(buffer.data(), length);
+                on_progress();
+                return;
+            }
 
-        LoggingTimer timer;
+            pending.append(buffer.data(), length);
+
+            auto at = pending.find(marker);
+            if (string::npos != at) {
+                forward(pending.data(), at);
+                trailer = pending.substr(at + marker.size());
+                pending.clear();
+                found = true;
+            } else {
+                // Tail might be the beginning of the marker, it is held back until more data arrives
+                auto keep = min(pending.size(), marker.size() - 1);
+                forward(pending.data(), pending.size() - keep);
+                pending.erase(0, pending.size() - keep);
+            }
+
+            on_progress();
+        }
+
+        [[nodiscard]] bool is_complete() const {
+            return found && string::npos != trailer.find('\n');
+        }
+
+        [[nodiscard]] int get_code() const {
+            return (int) strtol(trailer.c_str(), nullptr, 10);
+        }
+    };
+
+    /**
+     * Sink splitting output of a batch of commands at sentinels following each of them, moving output of each command
+     * to capture of its own. Sentinel on stdout carries exit code of the command.
+     */
+    class BatchSentinelSink {
+        vector<unique_ptr<OutputCapture>> &captures;
+        const string sentinel;
+        function<void(size_t, const string &)> on_complete;
+        vector<char> buffer;
+        string pending;
+        size_t index = 0;
+        bool in_trailer = false;
+
+        void forward(const char *data, size_t length) {
+            if (0 == length) {
+                return;
+            }
+
+            auto &capture = *captures[index];
+            memcpy(capture.reserve(length), data, length);
+            capture.commit(length);
+        }
+
+    public:
+        BatchSentinelSink(
+                vector<unique_ptr<OutputCapture>> &captures,
+                const string &sentinel,
+                function<void(size_t, const string &)> on_complete
+        ) : captures(captures), sentinel(sentinel), on_complete(move(on_complete)) {
+        }
+
+        char *reserve(size_t length) {
+            buffer.resize(length);
+            return buffer.data();
+        }
+
+        void commit(size_t length) {
+            pending.append(buffer.data(), length);
+
+            while (index < captures.size()) {
+                if (in_trailer) {
+                    auto end = pending.find('\n');
+                    if (string::npos == end) {
+                        return;
+                    }
+
+                    on_complete(index, pending.substr(0, end));
+                    pending.erase(0, end + 1);
+                    in_trailer = false;
+                    index++;
+                    continue;
+                }
+
+                auto marker = "\n" + sentinel + "_" + to_string(index) + "__";
+                auto at = pending.find(marker);
+                if (string::npos != at) {
+                    forward(pending.data(), at);
+                    pending.erase(0, at + marker.size());
+                    in_trailer = true;
+                    continue;
+                }
+
+                // Tail might be the beginning of the marker, it is held back until more data arrives
+                auto keep = min(pending.size(), marker.size() - 1);
+                forward(pending.data(), pending.size() - keep);
+                pending.erase(0, pending.size() - keep);
+                return;
+            }
+
+            // Nothing is expected after sentinel of the last command
+            pending.clear();
+        }
+
+        /**
+         * Move output held back to the command that was running when remote end closed the stream.
+         */
+        void finish() {
+            if (index < captures.size() && !in_trailer) {
+                forward(pending.data(), pending.size());
+            }
+
+            pending.clear();
+        }
+
+        /**
+         * Number of commands that have written sentinel to this stream.
+         */
+        [[nodiscard]] size_t get_completed() const {
+            return index;
+        }
+    };
+
+    static string shell_token() {
+        random_device random;
+        ostringstream token;
+        token << hex << random() << random();
+        return token.str();
+    }
+
+    static void ssh_write_shell(ssh_channel channel, const string &data) {
+        size_t written = 0;
+        while (written < data.size()) {
+            auto rc = ssh_channel_write(channel, data.data() + written, (uint32_t) (data.size() - written));
+
+            if (SSH_ERROR == rc) {
+                throw RuntimeException("Can not write to remote shell - %s",
+                                       ssh_get_error(ssh_channel_get_session(channel)));
+            }
+
+            written += rc;
+        }
+    }
+
+    static bool is_persistent_shell_enabled(const map<const string, const string> *envvals) {
+        auto value = envvals->find("KAFE_SSH_PERSISTENT_SHELL");
+        return value != envvals->end() && "1" == value->second;
+    }
+
+    SshApi::SshApi(const SshManager *manager, const ILogEventListener *log_listener)
+            : manager(const_cast<SshManager *>(manager)), log_listener(log_listener) {}
+
+    SshApi::~SshApi() {
+        close_shell();
+    }
+
+    void SshApi::chdir(const string &chdir) {
+        this->current_chdir = chdir;
+    }
+
+    void SshApi::log_command(const string &command, LoggingTimer &timer) const {
         if (!this->current_chdir.empty()) {
             timer = log_listener->emit_info_wt(
                     "In directory <%s> executing <%s>", this->current_chdir.c_str(), command.c_str());
-            cmd_buf << "cd " << this->current_chdir << " && ";
         } else {
             timer = log_listener->emit_info_wt("Executing command <%s>", command.c_str());
         }
+    }
+
+    string SshApi::prepare_command(const string &command, LoggingTimer &timer) const {
+        ostringstream cmd_buf;
+
+        log_command(command, timer);
+
+        if (!this->current_chdir.empty()) {
+            cmd_buf << "cd " << this->current_chdir << " && ";
+        }
 
         cmd_buf << command;
 
         log_listener->emit_debug("Full shell command is <%s>", cmd_buf.str().c_str());
 
-        rc = ssh_channel_request_exec(channel, cmd_buf.str().c_str());
+        return cmd_buf.str();
+    }
+
+    ssh_channel SshApi::open_channel() const {
+        const auto *session = manager->get_or_create_session(log_listener->get_level());
+
+        for (size_t attempt = 1;; attempt++) {
+            auto *ssh_session = session->get_ssh_session();
+
+            // Connection that silently went away must not hang opening the channel
+            session->set_timeout(SSH_CHANNEL_OPEN_TIMEOUT);
+
+            auto channel = ssh_channel_new(ssh_session);
+            auto rc = nullptr == channel ? SSH_ERROR : ssh_channel_open_session(channel);
+
+            session->set_timeout(0);
+
+            if (SSH_OK == rc) {
+                return channel;
+            }
+
+            auto error_code = ssh_get_error_code(ssh_session);
+            auto error = string(ssh_get_error(ssh_session));
+
+            if (nullptr != channel) {
+                ssh_channel_free(channel);
+            }
+
+            if (attempt >= SSH_CHANNEL_OPEN_ATTEMPTS) {
+                throw RuntimeException("SSH error [code %d: %s]", error_code, error.c_str());
+            }
+
+            // Nothing has been executed on the remote yet, so opening the channel is safe to retry
+            log_listener->emit_warning("Can not open channel to <%s>, reconnecting - %s",
+                                       manager->get_remote_id().c_str(), error.c_str());
+            session = manager->reconnect(log_listener->get_level());
+        }
+    }
+
+    ssh_channel SshApi::open_command_channel(const string &command, LoggingTimer &timer) const {
+        auto channel = open_channel();
+        auto *ssh_session = ssh_channel_get_session(channel);
+
+        auto full_command = prepare_command(command, timer);
+
+        auto rc = ssh_channel_request_exec(channel, full_command.c_str());
 
         timer.stop();
 
@@ -159,14 +646,95 @@ namespace kafe::remote {
                                    ssh_get_error(ssh_session));
         }
 
-        auto out = ssh_read_channel_out(log_listener, channel, 0, print_output);
-        auto err = ssh_read_channel_out(log_listener, channel, 1, print_output);
+        return channel;
+    }
+
+    int SshApi::get_keepalive_ms() const {
+        return (int) min(SshSession::get_keepalive_interval(manager->get_envvals()) * 1000, (long) INT_MAX);
+    }
 
-        if (ssh_channel_is_open(channel)) {
+    long SshApi::get_command_timeout_ms() const {
+        return SshSession::get_command_timeout(manager->get_envvals()) * 1000;
+    }
+
+    RemoteResult SshApi::aborted_result(
+            string &out,
+            string &err,
+            const bool timed_out,
+            const long timeout,
+            LoggingTimer &timer
+    ) const {
+        if (timed_out) {
+            log_listener->emit_warning(&timer, "Command timed out after <%ld> seconds", timeout);
+            return RemoteResult(out, err, -1, true, false);
+        }
+
+        if (Cancellation::is_requested()) {
+            log_listener->emit_warning(&timer, "Command cancelled");
+            return RemoteResult(out, err, -1, false, true);
+        }
+
+        log_listener->emit_warning(&timer, "Command stopped by output handler");
+        return RemoteResult(out, err, -1);
+    }
+
+    RemoteResult SshApi::execute(const string &command, const bool print_output) const {
+        return execute(command, print_output, nullptr, OutputCapturePolicy());
+    }
+
+    RemoteResult SshApi::execute(
+            const string &command,
+            const bool print_output,
+            const OutputLineCallback &line_callback,
+            const OutputCapturePolicy &policy
+    ) const {
+        return execute(command, print_output, line_callback, policy,
+                       SshSession::get_command_timeout(manager->get_envvals()));
+    }
+
+    RemoteResult SshApi::execute(
+            const string &command,
+            const bool print_output,
+            const OutputLineCallback &line_callback,
+            const OutputCapturePolicy &policy,
+            const long timeout
+    ) const {
+        if (Cancellation::is_requested()) {
+            throw RuntimeException("Execution cancelled, command <%s> not executed", command.c_str());
+        }
+
+        if (SshBroker::is_enabled(manager->get_envvals())) {
+            try {
+                return execute_brokered(command, print_output, line_callback, policy, timeout);
+            } catch (SshBrokerUnavailableException &e) {
+                log_listener->emit_debug("%s, connecting directly", e.what());
+            }
+        }
+
+        if (is_persistent_shell_enabled(manager->get_envvals())) {
+            return execute_in_shell(command, print_output, line_callback, policy, timeout);
+        }
+
+        LoggingTimer timer;
+        auto channel = open_command_channel(command, timer);
+
+        string out;
+        string err;
+        auto result = ssh_read_channel_out(log_listener, channel, print_output, line_callback, policy, out, err,
+                                           get_keepalive_ms(), timeout * 1000);
+
+        if (ChannelPollEnd::TIMED_OUT == result || ChannelPollEnd::CANCELLED == result) {
+            ssh_abort_channel(channel);
+        } else if (ssh_channel_is_open(channel)) {
             ssh_channel_send_eof(channel);
             ssh_channel_close(channel);
         }
 
+        if (ChannelPollEnd::COMPLETE != result) {
+            ssh_channel_free(channel);
+            return aborted_result(out, err, ChannelPollEnd::TIMED_OUT == result, timeout, timer);
+        }
+
         auto e = ssh_channel_get_exit_status(channel);
 
         ssh_channel_free(channel);
@@ -180,6 +748,1020 @@ namespace kafe::remote {
         return RemoteResult(out, err, e);
     }
 
+    SshShell *SshApi::get_shell() const {
+        const auto *session = manager->get_or_create_session(log_listener->get_level());
+
+        if (shell && shell->session != session) {
+            // Connection was lost and session replaced, channel was freed along with the old session
+            shell.reset();
+        }
+
+        if (shell && (!ssh_channel_is_open(shell->channel) || ssh_channel_is_eof(shell->channel))) {
+            close_shell();
+        }
+
+        if (shell) {
+            return shell.get();
+        }
+
+        auto channel = open_channel();
+
+        if (SSH_OK != ssh_channel_request_exec(channel, SSH_POSIX_SHELL_COMMAND)) {
+            auto *ssh_session = ssh_channel_get_session(channel);
+            auto error = string(ssh_get_error(ssh_session));
+            ssh_channel_close(channel);
+            ssh_channel_free(channel);
+            throw RuntimeException("Can not start remote shell - %s", error.c_str());
+        }
+
+        shell = make_unique<SshShell>();
+        shell->session = manager->find_session();
+        shell->channel = channel;
+        shell->token = shell_token();
+
+        log_listener->emit_debug("Started persistent shell on <%s>", manager->get_remote_id().c_str());
+
+        // Waits for shell to start and discards anything startup files print
+        bool stopped = false;
+        OutputCapture capture_out(nullptr, false);
+        OutputCapture capture_err(nullptr, false);
+
+        bool timed_out = false;
+
+        try {
+            shell_run(shell.get(), ":", false, capture_out, capture_err, stopped, 0, timed_out);
+        } catch (exception &e) {
+            close_shell();
+            throw;
+        }
+
+        if (Cancellation::is_requested()) {
+            close_shell();
+            throw RuntimeException("Execution cancelled while starting remote shell");
+        }
+
+        return shell.get();
+    }
+
+    void SshApi::close_shell() const {
+        if (!shell) {
+            return;
+        }
+
+        if (manager->find_session() == shell->session) {
+            if (ssh_channel_is_open(shell->channel)) {
+                ssh_channel_send_eof(shell->channel);
+                ssh_channel_close(shell->channel);
+            }
+            ssh_channel_free(shell->channel);
+        }
+
+        shell.reset();
+    }
+
+    /**
+     * Script running given command in a shell whose input further commands are written to, then printing given
+     * sentinel with exit code of the command to stdout and the sentinel alone to stderr. Exit code is left in
+     * __kafe_rc.
+     */
+    static string shell_frame(const string &command, bool subshell, const string &sentinel) {
+        // Command is passed quoted to eval, so unbalanced quotes or a trailing comment in it can not swallow the
+        // sentinel. It must not read from shell input, which the following commands are written to.
+        ostringstream script;
+        if (subshell) {
+            script << "( eval " << shell_quote(command) << " ) </dev/null\n";
+        } else {
+            script << "eval " << shell_quote(command) << " </dev/null\n";
+        }
+        script << "__kafe_rc=$?\n"
+               << "printf '\\n" << sentinel << " %d\\n' \"$__kafe_rc\"\n"
+               << "printf '\\n" << sentinel << "\\n' >&2\n";
+
+        return script.str();
+    }
+
+    int SshApi::shell_run(
+            SshShell *current,
+            const string &command,
+            bool subshell,
+            OutputCapture &capture_out,
+            OutputCapture &capture_err,
+            const bool &stopped,
+            const long timeout_ms,
+            bool &timed_out
+    ) const {
+        auto sentinel = "__KAFE_" + current->token + "_" + to_string(++current->counter) + "__";
+
+        ssh_write_shell(current->channel, shell_frame(command, subshell, sentinel));
+
+        bool done = false;
+        ShellSentinelSink *sinks[2] = {nullptr, nullptr};
+        auto on_progress = [&done, &stopped, &sinks]() {
+            done = stopped || (sinks[0]->is_complete() && sinks[1]->is_complete());
+        };
+
+        ShellSentinelSink sink_out(capture_out, sentinel, on_progress);
+        ShellSentinelSink sink_err(capture_err, sentinel, on_progress);
+        sinks[0] = &sink_out;
+        sinks[1] = &sink_err;
+
+        auto result = ssh_poll_channel(
+                log_listener, current->channel, sink_out, sink_err, done, get_keepalive_ms(), timeout_ms);
+
+        if (ChannelPollEnd::TIMED_OUT == result || ChannelPollEnd::CANCELLED == result) {
+            timed_out = ChannelPollEnd::TIMED_OUT == result;
+            return -1;
+        }
+
+        if (stopped) {
+            return -1;
+        }
+
+        if (!sink_out.is_complete() || !sink_err.is_complete()) {
+            throw RuntimeException("Remote shell exited before command completed");
+        }
+
+        return sink_out.get_code();
+    }
+
+    RemoteResult SshApi::execute_in_shell(
+            const string &command,
+            const bool print_output,
+            const OutputLineCallback &line_callback,
+            const OutputCapturePolicy &policy,
+            const long timeout
+    ) const {
+        auto *current = get_shell();
+
+        LoggingTimer timer;
+        log_command(command, timer);
+
+        bool stopped = false;
+        bool retain = !line_callback;
+
+        OutputCapture capture_out(
+                ssh_line_listener(log_listener, false, print_output, line_callback, stopped), retain, policy);
+        OutputCapture capture_err(
+                ssh_line_listener(log_listener, true, print_output, line_callback, stopped), retain, policy);
+
+        int e = 0;
+        bool timed_out = false;
+        try {
+            // Directory changes persist in the shell, so shell only changes directory when asked to use another
+            if (!current->directory_known || current->directory != current_chdir) {
+                current->directory_known = false;
+
+                auto cd = current_chdir.empty() ? string("cd") : "cd " + current_chdir;
+                e = shell_run(current, cd, false, capture_out, capture_err, stopped, timeout * 1000, timed_out);
+
+                if (0 == e) {
+                    current->directory = current_chdir;
+                    current->directory_known = true;
+                }
+            }
+
+            if (0 == e && !stopped) {
+                e = shell_run(current, command, true, capture_out, capture_err, stopped, timeout * 1000, timed_out);
+            }
+        } catch (exception &ex) {
+            // Shell might be in the middle of a command, it can not be used for further commands
+            close_shell();
+            throw;
+        }
+
+        timer.stop();
+
+        string out = capture_out.finish();
+        string err = capture_err.finish();
+
+        // Exit codes are never negative, -1 is only returned if command did not complete
+        if (-1 == e) {
+            // Command is still running in the shell, there is no way to stop it but to close the shell
+            if (timed_out || !stopped) {
+                ssh_abort_channel(current->channel);
+            }
+            close_shell();
+            return aborted_result(out, err, timed_out, timeout, timer);
+        }
+
+        if (0 == e) {
+            log_listener->emit_info(&timer, "Command complete");
+        } else {
+            log_listener->emit_warning(&timer, "Command complete with non-zero exit code <%d>", e);
+        }
+
+        return RemoteResult(out, err, e);
+    }
+
+    RemoteResult SshApi::execute_brokered(
+            const string &command,
+            const bool print_output,
+            const OutputLineCallback &line_callback,
+            const OutputCapturePolicy &policy,
+            const long timeout
+    ) const {
+        SshBrokerClient client(SshBroker::get_socket_path(manager->get_envvals()));
+
+        // Broker enforces timeout of the call as if it was the default one
+        map<const string, const string> envvals(*manager->get_envvals());
+        envvals.erase("KAFE_SSH_COMMAND_TIMEOUT");
+        envvals.emplace("KAFE_SSH_COMMAND_TIMEOUT", to_string(timeout));
+
+        LoggingTimer timer;
+        auto full_command = prepare_command(command, timer);
+
+        bool stopped = false;
+        bool retain = !line_callback;
+
+        OutputCapture capture_out(
+                ssh_line_listener(log_listener, false, print_output, line_callback, stopped), retain, policy);
+        OutputCapture capture_err(
+                ssh_line_listener(log_listener, true, print_output, line_callback, stopped), retain, policy);
+
+        bool timed_out = false;
+        auto e = client.execute(
+                manager->get_item(),
+                &envvals,
+                full_command,
+                [&capture_out, &capture_err, &stopped](bool is_stderr, const char *data, size_t size) {
+                    auto &capture = is_stderr ? capture_err : capture_out;
+
+                    while (size > 0) {
+                        auto length = min(size, OutputCapture::CHUNK_SIZE);
+                        memcpy(capture.reserve(length), data, length);
+                        capture.commit(length);
+                        data += length;
+                        size -= length;
+                    }
+
+                    return !stopped;
+                },
+                timed_out
+        );
+
+        timer.stop();
+
+        string out = capture_out.finish();
+        string err = capture_err.finish();
+
+        if (-1 == e) {
+            return aborted_result(out, err, timed_out, timeout, timer);
+        }
+
+        if (0 == e) {
+            log_listener->emit_info(&timer, "Command complete");
+        } else {
+            log_listener->emit_warning(&timer, "Command complete with non-zero exit code <%d>", e);
+        }
+
+        return RemoteResult(out, err, e);
+    }
+
+    int SshApi::execute_raw(const string &command, const OutputChunkCallback &on_output) const {
+        bool timed_out = false;
+        return execute_raw(command, on_output, timed_out);
+    }
+
+    int SshApi::execute_raw(const string &command, const OutputChunkCallback &on_output, bool &timed_out) const {
+        return execute_raw(command, on_output, timed_out, nullptr);
+    }
+
+    int SshApi::execute_raw(
+            const string &command,
+            const OutputChunkCallback &on_output,
+            bool &timed_out,
+            const function<bool()> &is_abandoned
+    ) const {
+        auto channel = open_channel();
+        auto *ssh_session = ssh_channel_get_session(channel);
+
+        if (SSH_OK != ssh_channel_request_exec(channel, command.c_str())) {
+            ssh_channel_close(channel);
+            ssh_channel_free(channel);
+            throw RuntimeException("SSH error [code %d: %s]", ssh_get_error_code(ssh_session),
+                                   ssh_get_error(ssh_session));
+        }
+
+        bool stopped = false;
+        OutputChunkSink sink_out(on_output, false, stopped);
+        OutputChunkSink sink_err(on_output, true, stopped);
+
+        auto result = ChannelPollEnd::COMPLETE;
+        try {
+            result = ssh_poll_channel(log_listener, channel, sink_out, sink_err, stopped, get_keepalive_ms(),
+                                      get_command_timeout_ms(), is_abandoned);
+        } catch (exception &e) {
+            ssh_channel_close(channel);
+            ssh_channel_free(channel);
+            throw;
+        }
+
+        // Nobody takes output any more once callback stopped the command, e.g. client of the broker hung up
+        if (ChannelPollEnd::COMPLETE != result) {
+            ssh_abort_channel(channel);
+        } else if (ssh_channel_is_open(channel)) {
+            ssh_channel_send_eof(channel);
+            ssh_channel_close(channel);
+        }
+
+        timed_out = ChannelPollEnd::TIMED_OUT == result;
+        auto e = ChannelPollEnd::COMPLETE != result ? -1 : ssh_channel_get_exit_status(channel);
+
+        ssh_channel_free(channel);
+
+        return e;
+    }
+
+    vector<RemoteBatchResult> SshApi::execute_batch(
+            const vector<string> &commands,
+            const bool stop_on_failure,
+            const bool print_output
+    ) const {
+        vector<RemoteBatchResult> results;
+
+        if (commands.empty()) {
+            return results;
+        }
+
+        if (Cancellation::is_requested()) {
+            throw RuntimeException("Execution cancelled, batch not executed");
+        }
+
+        LoggingTimer timer;
+        if (!this->current_chdir.empty()) {
+            timer = log_listener->emit_info_wt("In directory <%s> executing batch of <%zu> commands",
+                                               this->current_chdir.c_str(), commands.size());
+        } else {
+            timer = log_listener->emit_info_wt("Executing batch of <%zu> commands", commands.size());
+        }
+
+        auto sentinel = "__KAFE_" + shell_token();
+
+        // Commands are written to shell input at once, each runs in a subshell that can not read the rest of them
+        ostringstream script;
+        if (!this->current_chdir.empty()) {
+            script << "cd " << this->current_chdir << " </dev/null || exit\n";
+        }
+
+        for (size_t i = 0; i < commands.size(); i++) {
+            log_listener->emit_info("Batch command <%zu>: <%s>", i + 1, commands[i].c_str());
+
+            auto marker = sentinel + "_" + to_string(i) + "__";
+            script << shell_frame(commands[i], true, marker);
+
+            if (stop_on_failure) {
+                script << "[ \"$__kafe_rc\" -eq 0 ] || exit \"$__kafe_rc\"\n";
+            }
+        }
+
+        auto channel = open_channel();
+
+        bool stopped = false;
+        vector<unique_ptr<OutputCapture>> captures_out;
+        vector<unique_ptr<OutputCapture>> captures_err;
+        for (size_t i = 0; i < commands.size(); i++) {
+            captures_out.push_back(make_unique<OutputCapture>(
+                    ssh_line_listener(log_listener, false, print_output, nullptr, stopped), true));
+            captures_err.push_back(make_unique<OutputCapture>(
+                    ssh_line_listener(log_listener, true, print_output, nullptr, stopped), true));
+        }
+
+        // Command is over once its sentinel arrives on stdout, duration is measured between sentinels
+        vector<int> codes;
+        vector<uint64_t> durations;
+        auto last_complete = chrono::steady_clock::now();
+        auto on_complete = [&codes, &durations, &last_complete](size_t, const string &trailer) {
+            auto now = chrono::steady_clock::now();
+            codes.push_back((int) strtol(trailer.c_str(), nullptr, 10));
+            durations.push_back(
+                    (uint64_t) chrono::duration_cast<chrono::milliseconds>(now - last_complete).count());
+            last_complete = now;
+        };
+
+        BatchSentinelSink sink_out(captures_out, sentinel, on_complete);
+        BatchSentinelSink sink_err(captures_err, sentinel, [](size_t, const string &) {});
+
+        auto result = ChannelPollEnd::COMPLETE;
+        try {
+            if (SSH_OK != ssh_channel_request_exec(channel, SSH_POSIX_SHELL_COMMAND)) {
+                throw RuntimeException("Can not start remote shell - %s",
+                                       ssh_get_error(ssh_channel_get_session(channel)));
+            }
+
+            last_complete = chrono::steady_clock::now();
+            ssh_write_shell(channel, script.str());
+            ssh_channel_send_eof(channel);
+
+            result = ssh_poll_channel(
+                    log_listener, channel, sink_out, sink_err, stopped, get_keepalive_ms(), get_command_timeout_ms());
+        } catch (exception &e) {
+            ssh_channel_close(channel);
+            ssh_channel_free(channel);
+            throw;
+        }
+
+        sink_out.finish();
+        sink_err.finish();
+
+        auto aborted = ChannelPollEnd::TIMED_OUT == result || ChannelPollEnd::CANCELLED == result;
+        if (aborted) {
+            ssh_abort_channel(channel);
+        } else if (ssh_channel_is_open(channel)) {
+            ssh_channel_close(channel);
+        }
+
+        auto e = aborted ? -1 : ssh_channel_get_exit_status(channel);
+
+        ssh_channel_free(channel);
+
+        timer.stop();
+
+        auto completed = sink_out.get_completed();
+        auto failed_at = completed;
+        for (size_t i = 0; i < completed; i++) {
+            string out = captures_out[i]->finish();
+            string err = captures_err[i]->finish();
+            results.emplace_back(out, err, codes[i], durations[i]);
+
+            if (0 != codes[i]) {
+                log_listener->emit_warning("Batch command <%zu> complete with non-zero exit code <%d>", i + 1,
+                                           codes[i]);
+                failed_at = min(failed_at, i);
+            }
+        }
+
+        // Shell went away in the middle of a command, unless it was asked to stop after a failed one
+        if (completed < commands.size() && !(stop_on_failure && failed_at < completed)) {
+            auto now = chrono::steady_clock::now();
+            auto duration = (uint64_t) chrono::duration_cast<chrono::milliseconds>(now - last_complete).count();
+            string out = captures_out[completed]->finish();
+            string err = captures_err[completed]->finish();
+            auto code = 0 == e ? -1 : e;
+            results.emplace_back(out, err, code, duration);
+
+            if (ChannelPollEnd::TIMED_OUT == result) {
+                log_listener->emit_warning("Batch command <%zu> did not complete, batch timed out", completed + 1);
+            } else if (ChannelPollEnd::CANCELLED == result) {
+                log_listener->emit_warning("Batch command <%zu> did not complete, batch cancelled", completed + 1);
+            } else {
+                log_listener->emit_warning(
+                        "Batch command <%zu> did not complete, remote shell exited with code <%d>", completed + 1, e);
+            }
+        }
+
+        size_t succeeded = 0;
+        for (const auto &result: results) {
+            succeeded += 0 == result.get_code() ? 1 : 0;
+        }
+
+        if (succeeded == commands.size()) {
+            log_listener->emit_info(&timer, "Batch complete");
+        } else {
+            log_listener->emit_warning(&timer, "Batch complete, <%zu> of <%zu> commands succeeded", succeeded,
+                                       commands.size());
+        }
+
+        return results;
+    }
+
+    RemoteFileResult SshApi::execute_to_file(
+            const string &command,
+            const string &local_file,
+            bool compress,
+            bool print_output
+    ) const {
+        if (Cancellation::is_requested()) {
+            throw RuntimeException("Execution cancelled, command <%s> not executed", command.c_str());
+        }
+
+        OutputFile file(local_file, compress);
+
+        LoggingTimer timer;
+        auto channel = open_command_channel(command, timer);
+
+        bool stopped = false;
+        OutputCapturePolicy err_policy;
+        err_policy.tail_lines = SSH_FILE_STDERR_TAIL_LINES;
+        OutputCapture capture_err(
+                ssh_line_listener(log_listener, true, print_output, nullptr, stopped), true, err_policy);
+
+        auto result = ChannelPollEnd::COMPLETE;
+        try {
+            result = ssh_poll_channel(
+                    log_listener, channel, file, capture_err, stopped, get_keepalive_ms(), get_command_timeout_ms());
+            file.close();
+        } catch (exception &e) {
+            ssh_channel_close(channel);
+            ssh_channel_free(channel);
+            throw;
+        }
+
+        auto err = capture_err.finish();
+
+        auto aborted = ChannelPollEnd::TIMED_OUT == result || ChannelPollEnd::CANCELLED == result;
+        if (aborted) {
+            ssh_abort_channel(channel);
+            log_listener->emit_warning("Command %s, output file is incomplete",
+                                       ChannelPollEnd::TIMED_OUT == result ? "timed out" : "cancelled");
+        } else if (ssh_channel_is_open(channel)) {
+            ssh_channel_send_eof(channel);
+            ssh_channel_close(channel);
+        }
+
+        auto e = aborted ? -1 : ssh_channel_get_exit_status(channel);
+
+        ssh_channel_free(channel);
+
+        if (0 == e) {
+            log_listener->emit_info(
+                    &timer, "Command complete, <%llu> bytes written to <%s>",
+                    (unsigned long long) file.get_size(), local_file.c_str());
+        } else {
+            log_listener->emit_warning(&timer, "Command complete with non-zero exit code <%d>", e);
+        }
+
+        return RemoteFileResult(err, e, file.get_size());
+    }
+
+    // Ranges smaller than this are not worth a session of their own
+    static const uint64_t PARALLEL_UPLOAD_MIN_RANGE = 16777216;
+
+    string shell_quote(const string &value) {
+        string quoted = "'";
+
+        for (auto c : value) {
+            if ('\'' == c) {
+                quoted += "'\\''";
+            } else {
+                quoted += c;
+            }
+        }
+
+        return quoted + "'";
+    }
+
+    string SshApi::remote_sha256(const string &remote_path) const {
+        auto result = execute("sha256sum -- " + shell_quote(remote_path), false);
+        const auto &out = result.get_stdout();
+
+        if (0 != result.get_code() || out.size() < Sha256::DIGEST_SIZE * 2) {
+            throw RuntimeException("Can not get checksum of remote file <%s> - %s", remote_path.c_str(),
+                                   result.get_stderr().c_str());
+        }
+
+        return out.substr(0, Sha256::DIGEST_SIZE * 2);
+    }
+
+    void SshApi::verify_upload(const string &local_digest, const string &remote_path) const {
+        auto remote_digest = remote_sha256(remote_path);
+
+        if (local_digest != remote_digest) {
+            throw RuntimeException("Checksum of remote file <%s> does not match - expected <%s>, got <%s>",
+                                   remote_path.c_str(), local_digest.c_str(), remote_digest.c_str());
+        }
+
+        log_listener->emit_debug("Checksum of remote file <%s> verified", remote_path.c_str());
+    }
+
+    void SshApi::upload_file_parallel(
+            const SftpTransfer &transfer,
+            const string &file,
+            const string &remote_path,
+            uint64_t size,
+            size_t streams,
+            const TransferOptions &options
+    ) const {
+        auto *logger = const_cast<ILogEventListener *>(log_listener);
+        auto logger_context = logger->get_context();
+        auto level = log_listener->get_level();
+
+        log_listener->emit_debug("Uploading <%s> in <%zu> parallel streams", file.c_str(), streams);
+
+        // Create or truncate target once, every stream then writes own range at its offset
+        transfer.upload_range(file, remote_path, 0, 0, true);
+
+        auto range_size = (size + streams - 1) / streams;
+        vector<string> errors(streams);
+        string local_digest;
+        string digest_error;
+
+        // Local checksum is calculated while upload is running
+        thread digest_worker([&]() {
+            try {
+                local_digest = Sha256::file_hex_digest(file);
+            } catch (exception &e) {
+                digest_error = e.what();
+            }
+        });
+
+        vector<thread> workers;
+        for (size_t i = 1; i < streams; i++) {
+            workers.emplace_back([&, i]() {
+                logger->context_inherit(logger_context);
+
+                try {
+                    unique_ptr<SshSession> session(manager->create_session(level));
+                    SftpTransfer stream(session->get_ssh_session(), log_listener, options);
+                    auto offset = i * range_size;
+                    stream.upload_range(file, remote_path, offset, min(range_size, size - offset), false);
+                } catch (exception &e) {
+                    errors[i] = e.what();
+                }
+
+                logger->context_clear();
+            });
+        }
+
+        try {
+            transfer.upload_range(file, remote_path, 0, min(range_size, size), false);
+        } catch (exception &e) {
+            errors[0] = e.what();
+        }
+
+        for (auto &worker : workers) {
+            worker.join();
+        }
+        digest_worker.join();
+
+        for (size_t i = 0; i < streams; i++) {
+            if (!errors[i].empty()) {
+                throw RuntimeException("Upload of range <%zu> failed - %s", i, errors[i].c_str());
+            }
+        }
+
+        if (!digest_error.empty()) {
+            throw RuntimeException("%s", digest_error.c_str());
+        }
+
+        verify_upload(local_digest, remote_path);
+    }
+
+    // Copy commands sent to remote shell at once when assembling delta upload
+    static const size_t DELTA_COPY_BATCH = 256;
+
+    // Exit code of block listing if the remote lacks tools delta uploads rely on
+    static const int DELTA_TOOLS_MISSING = 3;
+
+    bool SshApi::upload_file_delta(
+            const SftpTransfer &transfer,
+            const string &file,
+            const string &remote_path,
+            uint64_t size,
+            const TransferOptions &options
+    ) const {
+        const auto block_size = (uint64_t) options.block_size;
+
+        std_fs::path base_path;
+        if (!current_chdir.empty()) {
+            base_path = FileSystem::absolute(options.delta_base, current_chdir);
+        } else {
+            base_path = std_fs::path(options.delta_base);
+        }
+        auto base = shell_quote(base_path.string());
+
+        // Size of base file followed by checksums of every block of it - split of GNU coreutils is needed for that,
+        // probed on empty input first, so that its absence is not mistaken for missing base file
+        ostringstream listing_cmd;
+        listing_cmd << "{ command -v sha256sum && split --filter=: -- /dev/null; } >/dev/null 2>&1"
+                    << " || exit " << DELTA_TOOLS_MISSING << "; "
+                    << "wc -c < " << base << " && split -b " << block_size << " --filter=sha256sum -- " << base;
+        auto listing = execute(listing_cmd.str(), false);
+
+        if (DELTA_TOOLS_MISSING == listing.get_code()) {
+            log_listener->emit_warning("Delta uploads require GNU split and sha256sum on the remote, uploading whole "
+                                       "file");
+            return false;
+        }
+
+        if (0 != listing.get_code()) {
+            log_listener->emit_warning("Can not read blocks of base file <%s>, uploading whole file",
+                                       base_path.c_str());
+            return false;
+        }
+
+        istringstream lines(listing.get_stdout());
+        string line;
+        getline(lines, line);
+
+        uint64_t base_size;
+        try {
+            base_size = stoull(line);
+        } catch (exception &e) {
+            log_listener->emit_warning("Unexpected size of base file <%s>, uploading whole file", base_path.c_str());
+            return false;
+        }
+
+        // Block checksum to index in base, only the first occurrence is needed
+        map<string, uint64_t> base_blocks;
+        uint64_t base_index = 0;
+        while (getline(lines, line)) {
+            if (line.size() >= Sha256::DIGEST_SIZE * 2) {
+                base_blocks.emplace(line.substr(0, Sha256::DIGEST_SIZE * 2), base_index);
+            }
+            base_index++;
+        }
+
+        auto block_length = [block_size](uint64_t index, uint64_t total) {
+            return min(block_size, total - index * block_size);
+        };
+
+        // Runs of blocks to copy from base as (target index, base index, count), and ranges to send
+        vector<tuple<uint64_t, uint64_t, uint64_t>> copies;
+        vector<pair<uint64_t, uint64_t>> literals;
+        uint64_t reused = 0;
+
+        auto fd = ::open(file.c_str(), O_RDONLY);
+        if (fd < 0) {
+            throw RuntimeException("Can not open file <%s> - %s", file.c_str(), strerror(errno));
+        }
+
+        vector<char> buffer(block_size);
+        Sha256 file_digest;
+        const auto blocks = (size + block_size - 1) / block_size;
+
+        for (uint64_t index = 0; index < blocks; index++) {
+            auto length = block_length(index, size);
+            auto offset = index * block_size;
+            uint64_t n_read = 0;
+
+            while (n_read < length) {
+                auto rc = ::pread(fd, buffer.data() + n_read, length - n_read, (off_t) (offset + n_read));
+                if (rc < 0 && EINTR == errno) {
+                    continue;
+                }
+                if (rc <= 0) {
+                    ::close(fd);
+                    throw RuntimeException("Can not read file <%s>", file.c_str());
+                }
+                n_read += rc;
+            }
+
+            file_digest.update(buffer.data(), length);
+
+            auto match = base_blocks.find(Sha256::hex_digest(buffer.data(), length));
+            if (match != base_blocks.end() && block_length(match->second, base_size) == length) {
+                if (!copies.empty()
+                    && get<0>(copies.back()) + get<2>(copies.back()) == index
+                    && get<1>(copies.back()) + get<2>(copies.back()) == match->second) {
+                    get<2>(copies.back())++;
+                } else {
+                    copies.emplace_back(index, match->second, 1);
+                }
+                reused++;
+                continue;
+            }
+
+            if (!literals.empty() && literals.back().first + literals.back().second == offset) {
+                literals.back().second += length;
+            } else {
+                literals.emplace_back(offset, length);
+            }
+        }
+
+        ::close(fd);
+
+        auto local_digest = file_digest.hex_digest();
+
+        // Assemble next to target and move into place once complete - target might be the base itself
+        auto temporary = remote_path + ".kafe-delta";
+        auto temporary_q = shell_quote(temporary);
+
+        try {
+            transfer.upload_ranges(file, temporary, literals, true);
+
+            for (size_t i = 0; i < copies.size(); i += DELTA_COPY_BATCH) {
+                ostringstream script;
+                script << "set -e";
+                for (size_t j = i; j < min(copies.size(), i + DELTA_COPY_BATCH); j++) {
+                    const auto &copy = copies[j];
+                    script << "; dd if=" << base << " of=" << temporary_q << " bs=" << block_size
+                           << " skip=" << get<1>(copy) << " seek=" << get<0>(copy) << " count=" << get<2>(copy)
+                           << " conv=notrunc status=none";
+                }
+
+                auto result = execute(script.str(), false);
+                if (0 != result.get_code()) {
+                    throw RuntimeException("Can not copy blocks from base file - %s", result.get_stderr().c_str());
+                }
+            }
+
+            verify_upload(local_digest, temporary);
+
+            // Replaced target keeps its owner, mode and ACLs - owner and ACLs only where permitted and supported
+            auto target_q = shell_quote(remote_path);
+            ostringstream move;
+            move << "if [ -e " << target_q << " ]; then "
+                 << "{ chown --reference=" << target_q << " -- " << temporary_q << " 2>/dev/null || true; } && "
+                 << "chmod --reference=" << target_q << " -- " << temporary_q << " && "
+                 << "{ getfacl -p -- " << target_q << " 2>/dev/null | setfacl --set-file=- -- " << temporary_q
+                 << " 2>/dev/null || true; }; "
+                 << "fi && mv -f -- " << temporary_q << " " << target_q;
+
+            auto result = execute(move.str(), false);
+            if (0 != result.get_code()) {
+                throw RuntimeException("Can not move <%s> into place - %s", temporary.c_str(),
+                                       result.get_stderr().c_str());
+            }
+        } catch (exception &e) {
+            try {
+                auto cleanup = execute("rm -f -- " + temporary_q, false);
+            } catch (exception &cleanup_e) {
+                log_listener->emit_debug("Can not remove <%s> - %s", temporary.c_str(), cleanup_e.what());
+            }
+            throw;
+        }
+
+        uint64_t sent = 0;
+        for (const auto &literal : literals) {
+            sent += literal.second;
+        }
+
+        log_listener->emit_info("Delta upload sent <%llu> of <%llu> bytes, <%llu> of <%llu> blocks reused",
+                                (unsigned long long) sent, (unsigned long long) size,
+                                (unsigned long long) reused, (unsigned long long) blocks);
+
+        return true;
+    }
+
+    string SshApi::remote_upload_digest(const string &remote_path, const string &name) const {
+        // Single round trip - resolve directory target the same way upload does and hash it if it exists
+        ostringstream cmd;
+        cmd << "f=" << shell_quote(remote_path) << "; ";
+        if (!name.empty()) {
+            cmd << "if [ -d \"$f\" ]; then f=\"$f\"/" << shell_quote(name) << "; fi; ";
+        }
+        cmd << "if [ -f \"$f\" ]; then sha256sum -- \"$f\"; fi";
+
+        auto result = execute(cmd.str(), false);
+        const auto &out = result.get_stdout();
+
+        if (0 != result.get_code() || out.size() < Sha256::DIGEST_SIZE * 2) {
+            return {};
+        }
+
+        return out.substr(0, Sha256::DIGEST_SIZE * 2);
+    }
+
+    bool SshApi::is_upload_identical(
+            const string &digest,
+            const string &remote_path,
+            const string &name,
+            const TransferOptions &options
+    ) const {
+        auto &cache = DigestCache::get_default();
+        auto cache_path = name.empty() ? remote_path : remote_path + "\t" + name;
+
+        if (options.use_cache && cache.has_remote_digest(manager->get_remote_id(), cache_path, digest)) {
+            log_listener->emit_info("Remote file <%s> was uploaded with same contents before, skipping upload",
+                                    remote_path.c_str());
+            return true;
+        }
+
+        if (remote_upload_digest(remote_path, name) != digest) {
+            return false;
+        }
+
+        log_listener->emit_info("Remote file <%s> has same contents, skipping upload", remote_path.c_str());
+
+        if (options.use_cache) {
+            cache.put_remote_digest(manager->get_remote_id(), cache_path, digest);
+        }
+
+        return true;
+    }
+
+    void SshApi::upload_file(const string &file, const string &remote_file, const TransferOptions &options) const {
+        if (!options.skip_identical && !options.use_cache) {
+            transfer_file(file, remote_file, options);
+            return;
+        }
+
+        if (!FileSystem::is_file_or_symlink(file)) {
+            throw RuntimeException("File <%s> is not file", file.c_str());
+        }
+
+        auto remote_path = current_chdir.empty()
+                           ? remote_file
+                           : FileSystem::absolute(remote_file, current_chdir).string();
+        auto name = std_fs::path(file).filename().string();
+        auto digest = DigestCache::get_default().get_local_digest(file);
+
+        if (is_upload_identical(digest, remote_path, name, options)) {
+            return;
+        }
+
+        transfer_file(file, remote_file, options);
+
+        if (options.use_cache) {
+            DigestCache::get_default().put_remote_digest(manager->get_remote_id(), remote_path + "\t" + name, digest);
+        }
+    }
+
+    void SshApi::upload_string(const string &content, const string &remote_file, const TransferOptions &options) const {
+        if (options.skip_identical || options.use_cache) {
+            auto remote_path = current_chdir.empty()
+                               ? remote_file
+                               : FileSystem::absolute(remote_file, current_chdir).string();
+            auto digest = Sha256::hex_digest(content.data(), content.size());
+
+            if (is_upload_identical(digest, remote_path, {}, options)) {
+                return;
+            }
+
+            scp_upload_file_from_string(content, remote_file);
+
+            if (options.use_cache) {
+                DigestCache::get_default().put_remote_digest(manager->get_remote_id(), remote_path, digest);
+            }
+
+            return;
+        }
+
+        scp_upload_file_from_string(content, remote_file);
+    }
+
+    void SshApi::transfer_file(const string &file, const string &remote_file, const TransferOptions &options) const {
+        if (TRANSFER_SFTP == options.engine) {
+            if (!FileSystem::is_file_or_symlink(file)) {
+                throw RuntimeException("File <%s> is not file", file.c_str());
+            }
+
+            std_fs::path remote_path;
+            if (!current_chdir.empty()) {
+                remote_path = FileSystem::absolute(remote_file, current_chdir);
+            } else {
+                remote_path = std_fs::path(remote_file);
+            }
+
+            const auto *session = manager->get_or_create_session(log_listener->get_level());
+
+            unique_ptr<SftpTransfer> transfer;
+            try {
+                transfer = make_unique<SftpTransfer>(session->get_ssh_session(), log_listener, options);
+            } catch (SftpUnavailableException &e) {
+                log_listener->emit_debug("%s, falling back to SCP", e.what());
+            }
+
+            if (transfer) {
+                auto size = std_fs::file_size(file);
+                auto max_streams = max((uint64_t) 1, size / PARALLEL_UPLOAD_MIN_RANGE);
+                auto streams = (size_t) min((uint64_t) options.streams, max_streams);
+#if LIBSSH_VERSION_INT < SSH_VERSION_INT(0, 8, 0)
+                // Sessions can not be used from multiple threads safely
+                streams = 1;
+#endif
+                auto target = transfer->resolve_upload_path(file, remote_path.string());
+
+                if (!options.delta_base.empty() && upload_file_delta(*transfer, file, target, size, options)) {
+                    return;
+                }
+
+                if (streams > 1) {
+                    upload_file_parallel(*transfer, file, target, size, streams, options);
+                    return;
+                }
+
+                transfer->upload_range(file, target, 0, size, true);
+
+                if (options.verify) {
+                    verify_upload(DigestCache::get_default().get_local_digest(file), target);
+                }
+
+                return;
+            }
+        }
+
+        if (options.verify) {
+            log_listener->emit_warning("Uploads over SCP can not be verified, skipping checksum verification");
+        }
+
+        if (!options.delta_base.empty()) {
+            log_listener->emit_warning("Delta uploads require SFTP, ignoring option <base> and uploading whole file");
+        }
+
+        if (options.streams > 1) {
+            log_listener->emit_warning("Parallel uploads require SFTP, ignoring option <streams>");
+        }
+
+        scp_upload_file(file, remote_file);
+    }
+
+    void SshApi::download_file(const string &file, const string &remote_file, const TransferOptions &options) const {
+        if (TRANSFER_SFTP == options.engine) {
+            const auto *session = manager->get_or_create_session(log_listener->get_level());
+
+            try {
+                SftpTransfer transfer(session->get_ssh_session(), log_listener, options);
+                transfer.download(file, remote_file);
+                return;
+            } catch (SftpUnavailableException &e) {
+                log_listener->emit_debug("%s, falling back to SCP", e.what());
+            }
+        }
+
+        scp_download_file(file, remote_file);
+    }
+
     void SshApi::scp_upload_file(const string &file, const string &remote_file) const {
         if (!FileSystem::is_file_or_symlink(file)) {
             throw RuntimeException("File <%s> is not file", file.c_str());
@@ -0,0 +1,203 @@
+/**
+ * This file is part of Kafe.
+ * https://github.com/libkafe/kafe/
+ *
+ * Copyright 2020 Matiss Treinis
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <algorithm>
+#include <unistd.h>
+#include "kafe/remote/ssh_auth.hpp"
+#include "kafe/io/file_system.hpp"
+#include "kafe/runtime/runtime_exception.hpp"
+
+using namespace kafe::io;
+using namespace kafe::runtime;
+
+namespace kafe::remote {
+    // Same as default identities of libssh, in the same order
+    static const char *const SSH_DEFAULT_IDENTITIES[] = {"id_ed25519", "id_ecdsa", "id_rsa", "id_dsa"};
+
+    SshAuthCache::~SshAuthCache() {
+        for (const auto &[key, value] : public_keys) {
+            ssh_key_free(value);
+        }
+
+        for (const auto &[key, value] : private_keys) {
+            if (nullptr != value) {
+                ssh_key_free(value);
+            }
+        }
+    }
+
+    SshAuthCache &SshAuthCache::get_default() {
+        static SshAuthCache cache;
+        return cache;
+    }
+
+    SshAuthChoice SshAuthCache::get_choice(const string &remote_id) {
+        lock_guard<mutex> lock(cache_lock);
+        auto candidate = choices.find(remote_id);
+
+        if (candidate == choices.end()) {
+            return last_choice;
+        }
+
+        return candidate->second;
+    }
+
+    void SshAuthCache::remember(const string &remote_id, const SshAuthChoice &choice) {
+        lock_guard<mutex> lock(cache_lock);
+        choices[remote_id] = choice;
+
+        // Password is never sent to, nor GSSAPI tried on, a host just because it worked for another one
+        if (SshAuthMethod::AGENT == choice.method || SshAuthMethod::IDENTITY == choice.method) {
+            last_choice = choice;
+        }
+    }
+
+    void SshAuthCache::forget(const string &remote_id) {
+        lock_guard<mutex> lock(cache_lock);
+        choices.erase(remote_id);
+    }
+
+    ssh_key SshAuthCache::get_private_key(const string &identity, const string &passphrase) {
+        auto candidate = private_keys.find({identity, passphrase});
+
+        if (candidate != private_keys.end()) {
+            return candidate->second;
+        }
+
+        ssh_key key = nullptr;
+        auto rc = ssh_pki_import_privkey_file(
+                identity.c_str(),
+                passphrase.empty() ? nullptr : passphrase.c_str(),
+                nullptr,
+                nullptr,
+                &key
+        );
+
+        if (SSH_OK != rc) {
+            key = nullptr;
+        }
+
+        // Keys that can not be decrypted are not tried again either
+        private_keys.emplace(make_pair(identity, passphrase), key);
+
+        return key;
+    }
+
+    ssh_key SshAuthCache::get_public_key(const string &identity, const string &passphrase) {
+        auto candidate = public_keys.find(identity);
+
+        if (candidate != public_keys.end()) {
+            return candidate->second;
+        }
+
+        ssh_key key = nullptr;
+        auto public_identity = identity + ".pub";
+
+        if (SSH_OK != ssh_pki_import_pubkey_file(public_identity.c_str(), &key)) {
+            // Without public key file, public key is taken from the private key, decrypting it right away
+            auto *private_key = get_private_key(identity, passphrase);
+
+            if (nullptr == private_key || SSH_OK != ssh_pki_export_privkey_to_pubkey(private_key, &key)) {
+                return nullptr;
+            }
+        }
+
+        public_keys.emplace(identity, key);
+
+        return key;
+    }
+
+    int SshAuthCache::authenticate_with_identity(
+            ssh_session session,
+            const string &identity,
+            const string &passphrase
+    ) {
+        ssh_key public_key;
+        {
+            lock_guard<mutex> lock(cache_lock);
+            public_key = get_public_key(identity, passphrase);
+        }
+
+        if (nullptr == public_key) {
+            return SSH_AUTH_DENIED;
+        }
+
+        // Remote is asked whether it accepts the key before decrypting it
+        auto rc = ssh_userauth_try_publickey(session, nullptr, public_key);
+
+        if (SSH_AUTH_SUCCESS != rc) {
+            return rc;
+        }
+
+        ssh_key private_key;
+        {
+            // Concurrent sessions wait for the key being decrypted, instead of decrypting it too
+            lock_guard<mutex> lock(cache_lock);
+            private_key = get_private_key(identity, passphrase);
+        }
+
+        if (nullptr == private_key) {
+            return SSH_AUTH_DENIED;
+        }
+
+        return ssh_userauth_publickey(session, nullptr, private_key);
+    }
+
+    vector<string> SshAuthCache::get_identity_files(ssh_session session) {
+        vector<string> identities;
+        string ssh_dir;
+
+        try {
+            ssh_dir = FileSystem::expand("~/.ssh").string();
+        } catch (RuntimeException &e) {
+            // Without home directory, libssh is left to find identities itself
+            return identities;
+        }
+
+        char *configured = nullptr;
+        if (SSH_OK == ssh_options_get(session, SSH_OPTIONS_IDENTITY, &configured) && nullptr != configured) {
+            string identity = configured;
+            ssh_string_free_char(configured);
+
+            if (0 == identity.rfind("%d", 0)) {
+                identity = ssh_dir + identity.substr(2);
+            } else if (0 == identity.rfind('~', 0)) {
+                identity = FileSystem::expand(identity).string();
+            }
+
+            if (0 == access(identity.c_str(), R_OK)) {
+                identities.push_back(identity);
+            }
+        }
+
+        for (const auto *name : SSH_DEFAULT_IDENTITIES) {
+            auto identity = ssh_dir + "/" + name;
+
+            if (identities.end() != find(identities.begin(), identities.end(), identity)) {
+                continue;
+            }
+
+            if (0 == access(identity.c_str(), R_OK)) {
+                identities.push_back(identity);
+            }
+        }
+
+        return identities;
+    }
+}
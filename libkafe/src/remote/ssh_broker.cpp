@@ -0,0 +1,651 @@
+/**
+ * This file is part of Kafe.
+ * https://github.com/libkafe/kafe/
+ *
+ * Copyright 2020 Matiss Treinis
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <thread>
+#include <vector>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include "kafe/remote/ssh_broker.hpp"
+#include "kafe/remote/ssh_api.hpp"
+#include "kafe/remote/ssh_manager.hpp"
+#include "kafe/io/digest.hpp"
+#include "kafe/io/file_system.hpp"
+#include "kafe/runtime/cancellation.hpp"
+
+using namespace kafe::io;
+
+#ifdef MSG_NOSIGNAL
+#define KAFE_BROKER_SEND_FLAGS MSG_NOSIGNAL
+#else
+#define KAFE_BROKER_SEND_FLAGS 0
+#endif
+
+namespace kafe::remote {
+    static const long BROKER_DEFAULT_IDLE_TTL = 600;
+    static const int BROKER_POLL_INTERVAL_MS = 1000;
+    static const uint32_t BROKER_MAX_FRAME_SIZE = 16777216;
+
+    // Every frame is a type byte, followed by payload length as 32-bit big endian integer and payload
+    static const size_t BROKER_FRAME_HEADER_SIZE = 5;
+    // Client to broker - remote user, host, port, command and KAFE_SSH_* environment, separated by NUL
+    static const char BROKER_FRAME_EXECUTE = 'E';
+    // Broker to client - chunk of stdout or stderr, exit code once command completes, command terminated for running
+    // longer than KAFE_SSH_COMMAND_TIMEOUT, or reason of failure
+    static const char BROKER_FRAME_STDOUT = 'O';
+    static const char BROKER_FRAME_STDERR = 'R';
+    static const char BROKER_FRAME_EXIT = 'X';
+    static const char BROKER_FRAME_TIMEOUT = 'T';
+    static const char BROKER_FRAME_FAILURE = 'F';
+
+    // Client waits for response in slices this long, to notice cancellation
+    static const int BROKER_CLIENT_POLL_SLICE_MS = 200;
+
+    // Environment forwarded to the broker with every command - authentication and connection settings
+    static const char *BROKER_ENV_PREFIX = "KAFE_SSH_";
+
+    /**
+     * Remote the broker keeps a session to, set up with the same settings.
+     */
+    struct SshBrokerEntry {
+        mutex lock;
+        chrono::steady_clock::time_point last_used = chrono::steady_clock::now();
+        // Commands running with a session to the remote at the moment, entry does not expire while there are any
+        size_t users = 0;
+        // Set once session has expired, commands holding on to the entry must look it up again
+        bool removed = false;
+    };
+
+    SshBrokerUnavailableException::SshBrokerUnavailableException(const string &reason)
+            : RuntimeException("SSH broker not available - %s", reason.c_str()) {
+    }
+
+    // Forwarded environment that sessions are set up with - sessions are only shared by commands that agree on all
+    static const char *const BROKER_SESSION_ENV[] = {
+            "KAFE_SSH_CIPHERS", "KAFE_SSH_COMPRESSION", "KAFE_SSH_HMAC", "KAFE_SSH_HOSTKEYS", "KAFE_SSH_JUMP",
+            "KAFE_SSH_KEEPALIVE", "KAFE_SSH_KEX", "KAFE_SSH_PKEY_PASS", "KAFE_SSH_USER_PASS"
+    };
+
+    /**
+     * Key of broker entry and pooled session for given remote and forwarded environment.
+     */
+    static string broker_session_key(const string &remote_id, const map<const string, const string> &envvals) {
+        Sha256 sha;
+
+        for (const auto *name : BROKER_SESSION_ENV) {
+            auto value = envvals.find(name);
+            if (value == envvals.end()) {
+                continue;
+            }
+
+            // Names and values can not contain NUL, they are separated by it on the wire too
+            sha.update(value->first.c_str(), value->first.size() + 1);
+            sha.update(value->second.c_str(), value->second.size() + 1);
+        }
+
+        return remote_id + "#" + sha.hex_digest();
+    }
+
+    static string get_env(const map<const string, const string> *envvals, const string &key) {
+        auto value = envvals->find(key);
+
+        if (value == envvals->end()) {
+            return "";
+        }
+
+        return value->second;
+    }
+
+    static bool broker_write(int fd, const char *data, size_t size) {
+        while (size > 0) {
+            auto n_written = send(fd, data, size, KAFE_BROKER_SEND_FLAGS);
+
+            if (n_written < 0 && EINTR == errno) {
+                continue;
+            }
+
+            if (n_written <= 0) {
+                return false;
+            }
+
+            data += n_written;
+            size -= n_written;
+        }
+
+        return true;
+    }
+
+    static bool broker_read(int fd, char *data, size_t size) {
+        while (size > 0) {
+            auto n_read = recv(fd, data, size, 0);
+
+            if (n_read < 0 && EINTR == errno) {
+                continue;
+            }
+
+            if (n_read <= 0) {
+                return false;
+            }
+
+            data += n_read;
+            size -= n_read;
+        }
+
+        return true;
+    }
+
+    static bool broker_write_frame(int fd, char type, const char *data, size_t size) {
+        unsigned char header[BROKER_FRAME_HEADER_SIZE] = {
+                (unsigned char) type,
+                (unsigned char) (size >> 24u),
+                (unsigned char) (size >> 16u),
+                (unsigned char) (size >> 8u),
+                (unsigned char) size
+        };
+
+        return broker_write(fd, (const char *) header, BROKER_FRAME_HEADER_SIZE) && broker_write(fd, data, size);
+    }
+
+    static bool broker_write_frame(int fd, char type, const string &payload) {
+        return broker_write_frame(fd, type, payload.data(), payload.size());
+    }
+
+    static bool broker_read_frame(int fd, char &type, string &payload) {
+        unsigned char header[BROKER_FRAME_HEADER_SIZE];
+
+        if (!broker_read(fd, (char *) header, BROKER_FRAME_HEADER_SIZE)) {
+            return false;
+        }
+
+        uint32_t size = ((uint32_t) header[1] << 24u) | ((uint32_t) header[2] << 16u)
+                        | ((uint32_t) header[3] << 8u) | (uint32_t) header[4];
+
+        if (size > BROKER_MAX_FRAME_SIZE) {
+            return false;
+        }
+
+        type = (char) header[0];
+        payload.resize(size);
+
+        return broker_read(fd, payload.data(), size);
+    }
+
+    /**
+     * Whether client hung up - it sends nothing after the request, so anything readable means end of stream.
+     */
+    static bool broker_client_gone(int fd) {
+        pollfd client = {fd, POLLIN, 0};
+
+        if (poll(&client, 1, 0) <= 0) {
+            return false;
+        }
+
+        if (client.revents & (POLLHUP | POLLERR | POLLNVAL)) {
+            return true;
+        }
+
+        char byte;
+        return 0 == recv(fd, &byte, 1, MSG_PEEK | MSG_DONTWAIT);
+    }
+
+    static sockaddr_un broker_address(const string &socket_path) {
+        sockaddr_un address{};
+        address.sun_family = AF_UNIX;
+
+        if (socket_path.size() >= sizeof(address.sun_path)) {
+            throw RuntimeException("SSH broker socket path <%s> is too long", socket_path.c_str());
+        }
+
+        strncpy(address.sun_path, socket_path.c_str(), sizeof(address.sun_path) - 1);
+
+        return address;
+    }
+
+    static int broker_socket() {
+        auto fd = socket(AF_UNIX, SOCK_STREAM, 0);
+
+#ifdef SO_NOSIGPIPE
+        if (fd >= 0) {
+            int on = 1;
+            setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+        }
+#endif
+
+        return fd;
+    }
+
+    static int broker_connect(const string &socket_path) {
+        auto address = broker_address(socket_path);
+        auto fd = broker_socket();
+
+        if (fd < 0) {
+            return -1;
+        }
+
+        if (0 != connect(fd, (const sockaddr *) &address, sizeof(address))) {
+            auto error = errno;
+            close(fd);
+            errno = error;
+            return -1;
+        }
+
+        return fd;
+    }
+
+    static vector<string> broker_split(const string &payload) {
+        vector<string> fields;
+        size_t start = 0;
+
+        while (start <= payload.size()) {
+            auto end = payload.find('\0', start);
+            if (string::npos == end) {
+                end = payload.size();
+            }
+
+            fields.push_back(payload.substr(start, end - start));
+            start = end + 1;
+        }
+
+        return fields;
+    }
+
+    SshBroker::SshBroker(const map<const string, const string> *envvals, const ILogEventListener *log_listener)
+            : envvals(envvals),
+              log_listener(log_listener),
+              pool(SshPool::get_max_sessions(envvals), SshPool::get_max_idle(envvals)) {
+        socket_path = get_socket_path(envvals);
+
+        if (socket_path.empty()) {
+            throw RuntimeException("SSH broker is not enabled, set environment variable <KAFE_SSH_BROKER>");
+        }
+
+        auto ttl = get_env(envvals, "KAFE_SSH_BROKER_TTL");
+        idle_ttl = chrono::seconds(BROKER_DEFAULT_IDLE_TTL);
+
+        if (!ttl.empty()) {
+            char *end = nullptr;
+            auto parsed = strtol(ttl.c_str(), &end, 10);
+
+            if (nullptr == end || '\0' != *end || parsed <= 0) {
+                throw RuntimeException("Environment variable <KAFE_SSH_BROKER_TTL> must be a positive integer");
+            }
+
+            idle_ttl = chrono::seconds(parsed);
+        }
+    }
+
+    bool SshBroker::is_enabled(const map<const string, const string> *envvals) {
+        auto value = get_env(envvals, "KAFE_SSH_BROKER");
+        return !value.empty() && "0" != value;
+    }
+
+    string SshBroker::get_socket_path(const map<const string, const string> *envvals) {
+        if (!is_enabled(envvals)) {
+            return "";
+        }
+
+        auto value = get_env(envvals, "KAFE_SSH_BROKER");
+        if ("1" != value) {
+            return value;
+        }
+
+        auto runtime_dir = get_env(envvals, "XDG_RUNTIME_DIR");
+        if (!runtime_dir.empty()) {
+            return runtime_dir + "/kafe-broker.sock";
+        }
+
+        return "/tmp/kafe-broker-" + to_string(getuid()) + "/broker.sock";
+    }
+
+    bool SshBroker::is_running(const string &socket_path) {
+        auto fd = broker_connect(socket_path);
+
+        if (fd < 0) {
+            return false;
+        }
+
+        close(fd);
+        return true;
+    }
+
+    void SshBroker::run() {
+#if LIBSSH_VERSION_INT < SSH_VERSION_INT(0, 8, 0)
+        throw RuntimeException("SSH broker requires libkafe built with libssh 0.8 or newer");
+#endif
+
+        if (is_running(socket_path)) {
+            log_listener->emit_info("SSH broker is already running on <%s>", socket_path.c_str());
+            return;
+        }
+
+        // Commands carry credentials - socket must only be reachable by current user
+        auto directory = std_fs::path(socket_path).parent_path();
+        if (!directory.empty()) {
+            mkdir(directory.c_str(), 0700);
+
+            struct stat info{};
+            if (0 != lstat(directory.c_str(), &info) || !S_ISDIR(info.st_mode) || info.st_uid != getuid()) {
+                throw RuntimeException("SSH broker socket directory <%s> must be a directory owned by current user",
+                                       directory.c_str());
+            }
+        }
+
+        auto address = broker_address(socket_path);
+        auto fd = broker_socket();
+        if (fd < 0) {
+            throw RuntimeException("Can not create SSH broker socket - %s", strerror(errno));
+        }
+
+        // Left behind by a broker that did not exit cleanly
+        unlink(socket_path.c_str());
+
+        auto previous_umask = umask(0077);
+        auto rc = ::bind(fd, (const sockaddr *) &address, sizeof(address));
+        umask(previous_umask);
+
+        if (0 != rc || 0 != listen(fd, SOMAXCONN)) {
+            auto error = errno;
+            close(fd);
+            throw RuntimeException("Can not listen on SSH broker socket <%s> - %s", socket_path.c_str(),
+                                   strerror(error));
+        }
+
+        log_listener->emit_info("SSH broker listening on <%s>, idle sessions are kept for <%lld> seconds",
+                                socket_path.c_str(), (long long) idle_ttl.count());
+
+        auto idle_since = chrono::steady_clock::now();
+
+        auto accept_client = [this](int listen_fd) {
+            auto client = accept(listen_fd, nullptr, nullptr);
+            if (client < 0) {
+                return;
+            }
+
+            {
+                lock_guard<mutex> lock(entries_lock);
+                active_clients++;
+            }
+
+            thread(&SshBroker::serve, this, client).detach();
+        };
+
+        for (;;) {
+            pollfd listening{fd, POLLIN, 0};
+            rc = poll(&listening, 1, BROKER_POLL_INTERVAL_MS);
+
+            if (rc < 0 && EINTR != errno) {
+                log_listener->emit_error("SSH broker failed to wait for clients - %s", strerror(errno));
+                break;
+            }
+
+            if (rc > 0 && (listening.revents & POLLIN)) {
+                accept_client(fd);
+            }
+
+            expire_idle_sessions();
+
+            lock_guard<mutex> lock(entries_lock);
+            auto now = chrono::steady_clock::now();
+
+            if (active_clients > 0 || !entries.empty()) {
+                idle_since = now;
+            } else if (now - idle_since >= idle_ttl) {
+                break;
+            }
+        }
+
+        // New clients connect directly from now on, ones already waiting are still served
+        unlink(socket_path.c_str());
+
+        for (;;) {
+            pollfd listening{fd, POLLIN, 0};
+            if (poll(&listening, 1, 0) <= 0 || !(listening.revents & POLLIN)) {
+                break;
+            }
+
+            accept_client(fd);
+        }
+
+        close(fd);
+
+        // Client threads refer to the broker, it must outlive them
+        for (;;) {
+            {
+                lock_guard<mutex> lock(entries_lock);
+                if (0 == active_clients) {
+                    break;
+                }
+            }
+
+            this_thread::sleep_for(chrono::milliseconds(BROKER_POLL_INTERVAL_MS / 10));
+        }
+
+        log_listener->emit_info("SSH broker idle, exiting");
+    }
+
+    void SshBroker::serve(int fd) {
+        char type;
+        string payload;
+
+        if (broker_read_frame(fd, type, payload) && BROKER_FRAME_EXECUTE == type) {
+            auto fields = broker_split(payload);
+
+            map<const string, const string> request_envvals;
+            for (size_t i = 4; i < fields.size(); i++) {
+                auto separator = fields[i].find('=');
+                if (string::npos != separator) {
+                    request_envvals.emplace(fields[i].substr(0, separator), fields[i].substr(separator + 1));
+                }
+            }
+
+            if (fields.size() < 4) {
+                broker_write_frame(fd, BROKER_FRAME_FAILURE, "Malformed request");
+            } else {
+                auto port = (unsigned int) strtoul(fields[2].c_str(), nullptr, 10);
+                InventoryItem item(fields[0], fields[1], port, "", "");
+                const auto &command = fields[3];
+                auto remote_id = item.remote_id();
+                auto key = broker_session_key(remote_id, request_envvals);
+
+                auto *logger = const_cast<ILogEventListener *>(log_listener);
+                logger->context_push(remote_id);
+
+                for (;;) {
+                    shared_ptr<SshBrokerEntry> entry;
+                    {
+                        lock_guard<mutex> lock(entries_lock);
+                        auto &current = entries[key];
+                        if (!current) {
+                            current = make_shared<SshBrokerEntry>();
+                        }
+                        entry = current;
+                    }
+
+                    {
+                        lock_guard<mutex> entry_lock(entry->lock);
+                        if (entry->removed) {
+                            continue;
+                        }
+                        entry->users++;
+                    }
+
+                    try {
+                        // Entry is only locked while looking it up - commands to the same remote run concurrently,
+                        // each with a session of its own while the pooled one is in use
+                        SshManager manager(&pool, &request_envvals, &item, key);
+                        SshApi api(&manager, log_listener);
+
+                        log_listener->emit_debug("Executing command <%s>", command.c_str());
+
+                        bool timed_out = false;
+                        bool client_gone = false;
+                        auto code = api.execute_raw(command, [fd](bool is_stderr, const char *data, size_t size) {
+                            auto frame_type = is_stderr ? BROKER_FRAME_STDERR : BROKER_FRAME_STDOUT;
+                            return broker_write_frame(fd, frame_type, data, size);
+                        }, timed_out, [fd, &client_gone]() {
+                            // Client cancelled, command is terminated instead of holding the session up
+                            client_gone = broker_client_gone(fd);
+                            return client_gone;
+                        });
+
+                        if (client_gone) {
+                            log_listener->emit_warning("Client hung up, command terminated");
+                        } else if (timed_out) {
+                            broker_write_frame(fd, BROKER_FRAME_TIMEOUT, "");
+                        } else {
+                            broker_write_frame(fd, BROKER_FRAME_EXIT, to_string(code));
+                        }
+                    } catch (exception &e) {
+                        log_listener->emit_warning("Command failed - %s", e.what());
+                        broker_write_frame(fd, BROKER_FRAME_FAILURE, e.what());
+                    }
+
+                    lock_guard<mutex> entry_lock(entry->lock);
+                    entry->users--;
+                    entry->last_used = chrono::steady_clock::now();
+                    break;
+                }
+
+                logger->context_clear();
+            }
+        }
+
+        close(fd);
+
+        lock_guard<mutex> lock(entries_lock);
+        active_clients--;
+    }
+
+    void SshBroker::expire_idle_sessions() {
+        lock_guard<mutex> lock(entries_lock);
+        auto now = chrono::steady_clock::now();
+
+        for (auto current = entries.begin(); current != entries.end();) {
+            // Entry must outlive the lock on it
+            auto entry = current->second;
+            unique_lock<mutex> entry_lock(entry->lock, try_to_lock);
+
+            if (!entry_lock.owns_lock() || entry->users > 0 || now - entry->last_used < idle_ttl) {
+                ++current;
+                continue;
+            }
+
+            log_listener->emit_info("Closing idle session to <%s>",
+                                    current->first.substr(0, current->first.rfind('#')).c_str());
+
+            entry->removed = true;
+            pool.remove_session(current->first);
+            current = entries.erase(current);
+        }
+    }
+
+    SshBrokerClient::SshBrokerClient(const string &socket_path) {
+        // Commands carry credentials - never hand them to a socket someone else could have put in place
+        struct stat info{};
+        if (0 != lstat(socket_path.c_str(), &info)) {
+            throw SshBrokerUnavailableException("no socket at <" + socket_path + ">");
+        }
+
+        if (!S_ISSOCK(info.st_mode) || info.st_uid != getuid()) {
+            throw SshBrokerUnavailableException("<" + socket_path + "> is not a socket owned by current user");
+        }
+
+        fd = broker_connect(socket_path);
+
+        if (fd < 0) {
+            throw SshBrokerUnavailableException(strerror(errno));
+        }
+    }
+
+    SshBrokerClient::~SshBrokerClient() {
+        close(fd);
+    }
+
+    int SshBrokerClient::execute(
+            const InventoryItem *item,
+            const map<const string, const string> *envvals,
+            const string &command,
+            const OutputChunkCallback &on_output,
+            bool &timed_out
+    ) {
+        string payload;
+        payload += item->get_user() + '\0';
+        payload += item->get_host() + '\0';
+        payload += to_string(item->get_port()) + '\0';
+        payload += command;
+
+        for (const auto &[key, value] : *envvals) {
+            if (0 == key.rfind(BROKER_ENV_PREFIX, 0)) {
+                payload += '\0' + key + '=' + value;
+            }
+        }
+
+        // Broker does not act on partial requests, command can still be executed directly
+        if (!broker_write_frame(fd, BROKER_FRAME_EXECUTE, payload)) {
+            throw SshBrokerUnavailableException(string("can not send command - ") + strerror(errno));
+        }
+
+        char type;
+        string response;
+
+        for (;;) {
+            pollfd waiting{fd, POLLIN, 0};
+            auto rc = poll(&waiting, 1, BROKER_CLIENT_POLL_SLICE_MS);
+
+            if (Cancellation::is_requested()) {
+                // Broker stops the command once it can no longer send output, connection is closed along with client
+                return -1;
+            }
+
+            if (0 == rc || (rc < 0 && EINTR == errno)) {
+                continue;
+            }
+
+            if (!broker_read_frame(fd, type, response)) {
+                break;
+            }
+
+            switch (type) {
+                case BROKER_FRAME_STDOUT:
+                case BROKER_FRAME_STDERR:
+                    if (!on_output(BROKER_FRAME_STDERR == type, response.data(), response.size())) {
+                        // Broker stops the command once it can no longer send output
+                        return -1;
+                    }
+                    break;
+                case BROKER_FRAME_EXIT:
+                    return (int) strtol(response.c_str(), nullptr, 10);
+                case BROKER_FRAME_TIMEOUT:
+                    timed_out = true;
+                    return -1;
+                case BROKER_FRAME_FAILURE:
+                    throw RuntimeException("SSH broker failed to execute command - %s", response.c_str());
+                default:
+                    throw RuntimeException("Unexpected response from SSH broker");
+            }
+        }
+
+        throw RuntimeException("Connection to SSH broker lost while executing command");
+    }
+}
@@ -0,0 +1,385 @@
+/**
+ * This file is part of Kafe.
+ * https://github.com/libkafe/kafe/
+ *
+ * Copyright 2020 Matiss Treinis
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <vector>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include "kafe/remote/ssh_jump.hpp"
+
+namespace kafe::remote {
+    // Relay thread checks for new tunnels and closing at least this often
+    static const int SSH_JUMP_POLL_MS = 1000;
+
+    // Opening a channel is given up on after this long
+    static const chrono::seconds SSH_JUMP_OPEN_TIMEOUT = chrono::seconds(30);
+
+    static const size_t SSH_JUMP_BUFFER_SIZE = 65536;
+
+    static void ssh_jump_wake(int fd) {
+        // Pipe being full means relay is about to wake up anyway
+        if (write(fd, "", 1) < 0) {
+            return;
+        }
+    }
+
+    /**
+     * Direct-tcpip channel relayed to local socket. Each direction is closed on its own, as TCP does.
+     */
+    struct SshTunnel {
+        ssh_channel channel = nullptr;
+        // Relay side of the socket pair
+        int fd = -1;
+        // Data read from channel, not yet written to socket
+        string pending;
+        // Socket was closed for writing by the session using it - EOF sent to channel
+        bool socket_eof = false;
+        // Channel was closed for writing by the remote - socket shut down for writing
+        bool channel_eof = false;
+        // Channel is being opened by the relay thread, data is not relayed yet
+        bool opening = true;
+        string host;
+        unsigned int port = 0;
+        chrono::steady_clock::time_point deadline;
+        // Reason channel failed to open, if it did
+        string error;
+    };
+
+    SshJumpHost::SshJumpHost(
+            const map<const string, const string> *envvals,
+            const string &user,
+            const string &host,
+            unsigned int port,
+            LogLevel level,
+            long connect_timeout
+    ) {
+        session = new SshSession(envvals, user, host, port, level, connect_timeout);
+
+        if (0 != pipe(wake_fds)) {
+            delete session;
+            throw SshSessionException("Can not set up jump host <%s:%d> - %s", host.c_str(), port, strerror(errno));
+        }
+
+        fcntl(wake_fds[0], F_SETFL, fcntl(wake_fds[0], F_GETFL) | O_NONBLOCK);
+        fcntl(wake_fds[1], F_SETFL, fcntl(wake_fds[1], F_GETFL) | O_NONBLOCK);
+
+        relay = thread(&SshJumpHost::run, this);
+    }
+
+    SshJumpHost::~SshJumpHost() {
+        stopping = true;
+        ssh_jump_wake(wake_fds[1]);
+        relay.join();
+
+        for (const auto &tunnel : tunnels) {
+            ssh_channel_close(tunnel->channel);
+            ssh_channel_free(tunnel->channel);
+            ::close(tunnel->fd);
+        }
+
+        tunnels.clear();
+
+        session->close();
+        delete session;
+
+        ::close(wake_fds[0]);
+        ::close(wake_fds[1]);
+    }
+
+    int SshJumpHost::open_tunnel(const string &host, unsigned int port) {
+        int fds[2];
+        if (0 != socketpair(AF_UNIX, SOCK_STREAM, 0, fds)) {
+            throw SshSessionException("Can not set up tunnel to <%s:%d> - %s", host.c_str(), port, strerror(errno));
+        }
+
+        fcntl(fds[0], F_SETFL, fcntl(fds[0], F_GETFL) | O_NONBLOCK);
+        fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+        fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+
+        unique_lock<mutex> lock(session_lock);
+
+        auto *ssh_session = session->get_ssh_session();
+        auto channel = ssh_channel_new(ssh_session);
+
+        if (nullptr == channel) {
+            ::close(fds[0]);
+            ::close(fds[1]);
+            throw SshConnectException("Can not open channel on jump host - " + string(ssh_get_error(ssh_session)));
+        }
+
+        auto tunnel = make_shared<SshTunnel>();
+        tunnel->channel = channel;
+        tunnel->fd = fds[0];
+        tunnel->host = host;
+        tunnel->port = port;
+        tunnel->deadline = chrono::steady_clock::now() + SSH_JUMP_OPEN_TIMEOUT;
+        tunnels.push_back(tunnel);
+
+        ssh_jump_wake(wake_fds[1]);
+
+        // Relay thread takes the lock while opening the channel, waiting releases it
+        tunnel_opened.wait(lock, [&]() {
+            return !tunnel->opening;
+        });
+
+        if (!tunnel->error.empty()) {
+            // Relay thread has closed its side of the socket pair and freed the channel
+            ::close(fds[1]);
+            throw SshConnectException("Jump host can not connect to <" + host + ":" + to_string(port) + "> - "
+                                      + tunnel->error);
+        }
+
+        return fds[1];
+    }
+
+    bool SshJumpHost::is_alive() const {
+        lock_guard<mutex> lock(session_lock);
+        return session->is_alive();
+    }
+
+    bool SshJumpHost::open(SshTunnel &tunnel) {
+        auto *ssh_session = session->get_ssh_session();
+        int rc = SSH_ERROR;
+
+        if (session->is_active()) {
+            // Called again while channel is opening, libssh checks for the answer of the jump host
+            ssh_set_blocking(ssh_session, 0);
+            rc = ssh_channel_open_forward(tunnel.channel, tunnel.host.c_str(), (int) tunnel.port, "127.0.0.1", 22);
+            ssh_set_blocking(ssh_session, 1);
+        }
+
+        if (SSH_AGAIN == rc && chrono::steady_clock::now() < tunnel.deadline) {
+            return true;
+        }
+
+        tunnel.opening = false;
+
+        if (SSH_OK == rc) {
+            tunnel_opened.notify_all();
+            return true;
+        }
+
+        if (SSH_AGAIN == rc) {
+            tunnel.error = "timed out";
+        } else if (!session->is_active()) {
+            tunnel.error = "connection to jump host was lost";
+        } else {
+            tunnel.error = ssh_get_error(ssh_session);
+        }
+
+        if (tunnel.error.empty()) {
+            tunnel.error = "channel could not be opened";
+        }
+
+        tunnel_opened.notify_all();
+
+        return false;
+    }
+
+    bool SshJumpHost::pump(SshTunnel &tunnel, short revents) {
+        char buffer[SSH_JUMP_BUFFER_SIZE];
+
+        // Socket to channel, no more than remote is willing to receive - write would block the relay otherwise
+        if (!tunnel.socket_eof && (revents & (POLLIN | POLLHUP | POLLERR))) {
+            auto window = ssh_channel_window_size(tunnel.channel);
+
+            if (window > 0) {
+                auto n_read = recv(tunnel.fd, buffer, min((size_t) window, sizeof(buffer)), 0);
+
+                if (n_read > 0) {
+                    if (SSH_ERROR == ssh_channel_write(tunnel.channel, buffer, (uint32_t) n_read)) {
+                        return false;
+                    }
+                } else if (0 == n_read || (EAGAIN != errno && EINTR != errno)) {
+                    tunnel.socket_eof = true;
+                    ssh_channel_send_eof(tunnel.channel);
+                }
+            }
+        }
+
+        // Channel to socket, until socket takes no more or there is nothing left to read - data left in libssh
+        // buffers would not wake the relay up again
+        for (;;) {
+            if (!tunnel.pending.empty()) {
+                auto n_written = send(tunnel.fd, tunnel.pending.data(), tunnel.pending.size(), MSG_NOSIGNAL);
+
+                if (n_written < 0 && EAGAIN != errno && EINTR != errno) {
+                    // Session using the socket is gone
+                    return false;
+                }
+
+                if (n_written > 0) {
+                    tunnel.pending.erase(0, n_written);
+                }
+
+                if (!tunnel.pending.empty()) {
+                    break;
+                }
+            }
+
+            if (tunnel.channel_eof) {
+                break;
+            }
+
+            auto n_read = ssh_channel_read_nonblocking(tunnel.channel, buffer, sizeof(buffer), 0);
+
+            if (n_read > 0) {
+                tunnel.pending.assign(buffer, n_read);
+                continue;
+            }
+
+            if (SSH_ERROR == n_read || ssh_channel_is_eof(tunnel.channel) || ssh_channel_is_closed(tunnel.channel)) {
+                tunnel.channel_eof = true;
+                shutdown(tunnel.fd, SHUT_WR);
+            }
+
+            break;
+        }
+
+        return !(tunnel.socket_eof && tunnel.channel_eof && tunnel.pending.empty());
+    }
+
+    void SshJumpHost::run() {
+        vector<pollfd> fds;
+        char wake_buffer[64];
+
+        auto *event = ssh_event_new();
+        ssh_event_add_session(event, session->get_ssh_session());
+
+        while (!stopping) {
+            fds.clear();
+            fds.push_back({wake_fds[0], POLLIN, 0});
+
+            size_t n_tunnels;
+            {
+                lock_guard<mutex> lock(session_lock);
+                // Lost connection would be reported as hung up on every poll, tunnels through it fail on their own
+                auto session_fd = session->is_active() ? ssh_get_fd(session->get_ssh_session()) : -1;
+                fds.push_back({session_fd, POLLIN, 0});
+
+                for (const auto &tunnel : tunnels) {
+                    short events = 0;
+                    if (tunnel->opening) {
+                        // Answer of the jump host arrives over its own connection
+                    } else if (!tunnel->socket_eof && ssh_channel_window_size(tunnel->channel) > 0) {
+                        events |= POLLIN;
+                    }
+                    if (!tunnel->opening && !tunnel->pending.empty()) {
+                        events |= POLLOUT;
+                    }
+
+                    // Socket closed by the other side would be reported as hung up on every poll otherwise
+                    fds.push_back({0 == events ? -1 : tunnel->fd, events, 0});
+                }
+
+                n_tunnels = tunnels.size();
+            }
+
+            poll(fds.data(), fds.size(), SSH_JUMP_POLL_MS);
+
+            while (read(wake_fds[0], wake_buffer, sizeof(wake_buffer)) > 0) {
+            }
+
+            lock_guard<mutex> lock(session_lock);
+
+            // Moves incoming data to channel buffers and answers requests of the jump host, even with no tunnels
+            if (fds[1].revents) {
+                ssh_event_dopoll(event, 0);
+            }
+
+            // Tunnels added while polling are at the end of the list, they were not polled for
+            size_t index = 0;
+            for (auto tunnel = tunnels.begin(); tunnel != tunnels.end(); index++) {
+                auto revents = index < n_tunnels ? fds[index + 2].revents : (short) 0;
+                auto keep = (*tunnel)->opening ? open(**tunnel) : pump(**tunnel, revents);
+
+                if (keep) {
+                    ++tunnel;
+                    continue;
+                }
+
+                ssh_channel_close((*tunnel)->channel);
+                ssh_channel_free((*tunnel)->channel);
+                ::close((*tunnel)->fd);
+                tunnel = tunnels.erase(tunnel);
+            }
+        }
+
+        lock_guard<mutex> lock(session_lock);
+        ssh_event_remove_session(event, session->get_ssh_session());
+        ssh_event_free(event);
+
+        // Nobody is left to open channels of tunnels still waiting for them
+        for (auto tunnel = tunnels.begin(); tunnel != tunnels.end();) {
+            if (!(*tunnel)->opening) {
+                ++tunnel;
+                continue;
+            }
+
+            (*tunnel)->opening = false;
+            (*tunnel)->error = "jump host was closed";
+            ssh_channel_free((*tunnel)->channel);
+            ::close((*tunnel)->fd);
+            tunnel = tunnels.erase(tunnel);
+        }
+
+        tunnel_opened.notify_all();
+    }
+
+    void SshJumpHost::parse(
+            const string &spec,
+            const string &default_user,
+            string &user,
+            string &host,
+            unsigned int &port
+    ) {
+        auto at = spec.find('@');
+        user = string::npos == at ? default_user : spec.substr(0, at);
+        host = string::npos == at ? spec : spec.substr(at + 1);
+        port = 22;
+
+        // IPv6 addresses are given in brackets, so that port can be told apart
+        auto host_end = 0 == host.rfind('[', 0) ? host.find(']') : 0;
+        auto colon = host.find(':', string::npos == host_end ? 0 : host_end);
+
+        if (string::npos != colon) {
+            char *end = nullptr;
+            auto value = strtoul(host.c_str() + colon + 1, &end, 10);
+
+            if (nullptr == end || '\0' != *end || value < 1 || value > 65535) {
+                throw SshSessionException("Invalid jump host <%s> - expected [user@]host[:port]", spec.c_str());
+            }
+
+            port = (unsigned int) value;
+            host = host.substr(0, colon);
+        }
+
+        if (0 == host.rfind('[', 0) && ']' == host.back()) {
+            host = host.substr(1, host.size() - 2);
+        }
+
+        if (host.empty() || user.empty()) {
+            throw SshSessionException("Invalid jump host <%s> - expected [user@]host[:port]", spec.c_str());
+        }
+    }
+}
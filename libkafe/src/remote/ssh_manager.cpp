@@ -17,36 +17,221 @@
  * limitations under the License.
  */
 
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <set>
+#include <thread>
+#include <utility>
 #include "kafe/remote/ssh_manager.hpp"
 
 namespace kafe::remote {
+    // Reconnecting is attempted this many times, waiting twice as long after every failure
+    static const size_t SSH_RECONNECT_ATTEMPTS = 4;
+    static const long SSH_RECONNECT_BACKOFF_MS = 500;
+    static const long SSH_RECONNECT_MAX_BACKOFF_MS = 8000;
+
     SshManager::SshManager(const SshPool *pool, const map<const string, const string> *envvals, const InventoryItem *item)
-            : pool(const_cast<SshPool *>(pool)), envvals(envvals), item(item) {
+            : SshManager(pool, envvals, item, item->remote_id()) {
+    }
+
+    SshManager::SshManager(
+            const SshPool *pool,
+            const map<const string, const string> *envvals,
+            const InventoryItem *item,
+            string pool_key
+    ) : pool(const_cast<SshPool *>(pool)), envvals(envvals), item(item), pool_key(move(pool_key)) {
+        if (item->get_ssh_options().empty()) {
+            return;
+        }
+
+        for (const auto &[key, value] : *envvals) {
+            if (item->get_ssh_options().end() == item->get_ssh_options().find(key)) {
+                item_envvals.emplace(key, value);
+            }
+        }
+
+        for (const auto &[key, value] : item->get_ssh_options()) {
+            item_envvals.emplace(key, value);
+        }
+
+        this->envvals = &item_envvals;
     }
 
+    SshManager::~SshManager() = default;
+
     const SshSession *SshManager::get_or_create_session(LogLevel level) {
-        auto remote_id = item->remote_id();
+        return get_or_create_session(level, SshSession::get_connect_timeout(envvals));
+    }
 
-        if (pool->has_session(remote_id)) {
-            auto *current_session = pool->get_session(remote_id);
+    const SshSession *SshManager::get_or_create_session(LogLevel level, long connect_timeout) {
+        const auto &remote_id = pool_key;
 
-            if (current_session->is_active()) {
-                return current_session;
-            }
+        // Session already leased is kept, leasing again would get a second session while this one is in use
+        if (lease && lease.get()->is_alive()) {
+            return lease.get();
+        }
+
+        if (lease) {
+            pool->remove_session(remote_id, lease.get());
+            lease.release();
+
+            lease = pool->acquire_session(remote_id, [&]() {
+                return connect_with_retry(level, connect_timeout);
+            });
 
+            return lease.get();
+        }
+
+        // Unreachable remotes are only retried when a connection to them was lost, not when connecting first time
+        lease = pool->acquire_session(remote_id, [&]() {
+            return new_session(level, connect_timeout);
+        });
+
+        if (!lease.get()->is_alive()) {
+            pool->remove_session(remote_id, lease.get());
+            lease.release();
+
+            lease = pool->acquire_session(remote_id, [&]() {
+                return connect_with_retry(level, connect_timeout);
+            });
+        }
+
+        return lease.get();
+    }
+
+    const SshSession *SshManager::reconnect(LogLevel level) {
+        const auto &remote_id = pool_key;
+
+        // Someone else may have reconnected already, their session is used then if it is not in use
+        if (lease) {
+            pool->remove_session(remote_id, lease.get());
+            lease.release();
+        } else {
             pool->remove_session(remote_id);
         }
 
-        auto *session = new SshSession(
-                envvals,
-                item->get_user(),
-                item->get_host(),
-                item->get_port(),
-                level
-        );
+        lease = pool->acquire_session(remote_id, [&]() {
+            return connect_with_retry(level, SshSession::get_connect_timeout(envvals));
+        });
+
+        return lease.get();
+    }
+
+    SshSession *SshManager::connect_with_retry(LogLevel level, long connect_timeout) const {
+        auto backoff = chrono::milliseconds(SSH_RECONNECT_BACKOFF_MS);
+
+        for (size_t attempt = 1;; attempt++) {
+            try {
+                return new_session(level, connect_timeout);
+            } catch (SshConnectException &e) {
+                if (attempt >= SSH_RECONNECT_ATTEMPTS) {
+                    throw;
+                }
+            }
+
+            this_thread::sleep_for(backoff);
+            backoff = min(backoff * 2, chrono::milliseconds(SSH_RECONNECT_MAX_BACKOFF_MS));
+        }
+    }
+
+    const SshSession *SshManager::find_session() const {
+        if (lease) {
+            return lease.get();
+        }
+
+        return pool->get_session(pool_key);
+    }
+
+    string SshManager::get_remote_id() const {
+        return item->remote_id();
+    }
+
+    const InventoryItem *SshManager::get_item() const {
+        return item;
+    }
+
+    const map<const string, const string> *SshManager::get_envvals() const {
+        return envvals;
+    }
+
+    SshSession *SshManager::create_session(LogLevel level) const {
+        return new_session(level, SshSession::get_connect_timeout(envvals));
+    }
+
+    SshSession *SshManager::new_session(LogLevel level, long connect_timeout) const {
+        auto jump = envvals->find("KAFE_SSH_JUMP");
+
+        if (jump == envvals->end() || jump->second.empty()) {
+            return new SshSession(envvals, item->get_user(), item->get_host(), item->get_port(), level,
+                                  connect_timeout);
+        }
+
+        string jump_user;
+        string jump_host;
+        unsigned int jump_port;
+        SshJumpHost::parse(jump->second, item->get_user(), jump_user, jump_host, jump_port);
+
+        auto jump_id = jump_user + "@" + jump_host + ":" + to_string(jump_port);
+        auto jump_connection = pool->get_jump_host(jump_id, [&]() {
+            return new SshJumpHost(envvals, jump_user, jump_host, jump_port, level, connect_timeout);
+        });
+
+        auto socket_fd = jump_connection->open_tunnel(item->get_host(), item->get_port());
+
+        return new SshSession(envvals, item->get_user(), item->get_host(), item->get_port(), level,
+                              connect_timeout, socket_fd);
+    }
+
+    map<string, string> SshManager::prewarm(
+            const SshPool *pool,
+            const map<const string, const string> *envvals,
+            const vector<const InventoryItem *> &items,
+            LogLevel level,
+            size_t parallel,
+            long connect_timeout
+    ) {
+        // Same remote may be listed more than once, it must only be connected to once
+        vector<const InventoryItem *> queue;
+        set<string> seen;
+        for (const auto *item : items) {
+            if (seen.insert(item->remote_id()).second) {
+                queue.push_back(item);
+            }
+        }
+
+        map<string, string> failures;
+        mutex failures_lock;
+        atomic<size_t> next(0);
+
+        auto connect = [&]() {
+            for (auto i = next++; i < queue.size(); i = next++) {
+                SshManager manager(pool, envvals, queue[i]);
+
+                try {
+                    manager.get_or_create_session(level, connect_timeout);
+                } catch (exception &e) {
+                    lock_guard<mutex> lock(failures_lock);
+                    failures[manager.get_remote_id()] = e.what();
+                }
+            }
+        };
+
+#if LIBSSH_VERSION_INT < SSH_VERSION_INT(0, 8, 0)
+        // Sessions can not be set up from multiple threads safely
+        parallel = 1;
+#endif
+
+        vector<thread> workers;
+        auto n_workers = min(max(parallel, (size_t) 1), queue.size());
+        for (size_t i = 0; i < n_workers; i++) {
+            workers.emplace_back(connect);
+        }
 
-        pool->add_session(remote_id, session);
+        for (auto &worker : workers) {
+            worker.join();
+        }
 
-        return session;
+        return failures;
     }
-}
\ No newline at end of file
+}
@@ -17,43 +17,316 @@
  * limitations under the License.
  */
 
+#include <cstdlib>
+#include <utility>
 #include "kafe/remote/ssh_pool.hpp"
 
 namespace kafe::remote {
+    // Stays well within default limit of open files of 1024, tunnels through jump hosts take two descriptors each
+    static const size_t SSH_POOL_DEFAULT_MAX_SESSIONS = 512;
+    static const size_t SSH_POOL_SHARDS = 16;
+
+    static long get_env_count(const map<const string, const string> *envvals, const char *name, long default_value) {
+        auto env_value = envvals->find(name);
+        if (env_value == envvals->end() || env_value->second.empty()) {
+            return default_value;
+        }
+
+        char *end = nullptr;
+        auto value = strtol(env_value->second.c_str(), &end, 10);
+
+        if (nullptr == end || '\0' != *end || value < 0) {
+            throw RuntimeException("Environment variable <%s> must be a non-negative integer", name);
+        }
+
+        return value;
+    }
+
+    SshSessionLease::SshSessionLease() = default;
+
+    SshSessionLease::SshSessionLease(SshPool *pool, string remote_id, shared_ptr<const SshSession> session)
+            : pool(pool), remote_id(move(remote_id)), session(move(session)) {
+    }
+
+    SshSessionLease::SshSessionLease(SshSessionLease &&other) noexcept
+            : pool(other.pool), remote_id(move(other.remote_id)), session(move(other.session)) {
+        other.pool = nullptr;
+    }
+
+    SshSessionLease &SshSessionLease::operator=(SshSessionLease &&other) noexcept {
+        if (this != &other) {
+            release();
+            pool = other.pool;
+            remote_id = move(other.remote_id);
+            session = move(other.session);
+            other.pool = nullptr;
+        }
+
+        return *this;
+    }
+
+    SshSessionLease::~SshSessionLease() {
+        release();
+    }
+
+    void SshSessionLease::release() {
+        if (nullptr != pool && session) {
+            pool->release_session(remote_id, session.get());
+        }
+
+        pool = nullptr;
+        session.reset();
+    }
+
+    const SshSession *SshSessionLease::get() const {
+        return session.get();
+    }
+
+    SshSessionLease::operator bool() const {
+        return static_cast<bool>(session);
+    }
+
+    SshPool::SshPool() : SshPool(0, 0) {
+    }
+
+    SshPool::SshPool(size_t max_sessions, long max_idle)
+            : max_sessions(max_sessions), max_idle(chrono::seconds(max_idle)) {
+        for (size_t i = 0; i < SSH_POOL_SHARDS; i++) {
+            shards.push_back(make_unique<Shard>());
+        }
+    }
+
     SshPool::~SshPool() {
-        for (const auto&[key, value] : sessions) {
-            value->close();
-            delete (value);
+        // Sessions still leased are closed too, and freed once released
+        for (auto &shard : shards) {
+            lock_guard<mutex> lock(shard->lock);
+
+            for (const auto &[key, value] : shard->sessions) {
+                value.session->close();
+            }
+
+            n_sessions -= shard->sessions.size();
+            shard->sessions.clear();
+            shard->usage.clear();
+        }
+
+        // Sessions through jump hosts are closed by now
+        lock_guard<mutex> jump_lock(jump_hosts_lock);
+        jump_hosts.clear();
+    }
+
+    size_t SshPool::get_max_sessions(const map<const string, const string> *envvals) {
+        return (size_t) get_env_count(envvals, "KAFE_SSH_POOL_SIZE", SSH_POOL_DEFAULT_MAX_SESSIONS);
+    }
+
+    long SshPool::get_max_idle(const map<const string, const string> *envvals) {
+        return get_env_count(envvals, "KAFE_SSH_POOL_IDLE", 0);
+    }
+
+    size_t SshPool::get_size_limit() const {
+        return max_sessions;
+    }
+
+    SshPool::Shard &SshPool::get_shard(const string &remote_id) const {
+        return *shards[hash<string>{}(remote_id) % shards.size()];
+    }
+
+    void SshPool::touch(Shard &shard, Entry &entry) {
+        entry.last_used = chrono::steady_clock::now();
+        shard.usage.splice(shard.usage.begin(), shard.usage, entry.usage);
+    }
+
+    vector<shared_ptr<const SshSession>> SshPool::evict(Shard &shard, size_t room) {
+        auto now = chrono::steady_clock::now();
+        // Size limit is shared by all shards, only idle sessions of this shard can be closed without taking locks
+        // of the others, so pool stays over the limit until shards with idle sessions are used again
+        auto remaining = n_sessions.load();
+        vector<string> idle;
+
+        // Least recently used first, sessions in use are skipped
+        for (auto current = shard.usage.rbegin(); current != shard.usage.rend(); ++current) {
+            const auto &entry = shard.sessions.find(*current)->second;
+
+            if (0 != entry.users) {
+                continue;
+            }
+
+            auto over_size = 0 != max_sessions && remaining + room > max_sessions;
+            auto over_idle = max_idle.count() > 0 && now - entry.last_used >= max_idle;
+
+            if (!over_size && !over_idle) {
+                // Sessions used more recently than this one are not past idle limit either
+                break;
+            }
+
+            idle.push_back(*current);
+            remaining--;
+        }
+
+        vector<shared_ptr<const SshSession>> evicted;
+        for (const auto &remote_id : idle) {
+            auto candidate = shard.sessions.find(remote_id);
+            evicted.push_back(move(candidate->second.session));
+            shard.usage.erase(candidate->second.usage);
+            shard.sessions.erase(candidate);
         }
 
-        sessions.clear();
+        n_sessions -= evicted.size();
+        evictions += evicted.size();
+
+        return evicted;
     }
 
     bool SshPool::has_session(const string &remote_id) const {
-        return this->sessions.find(remote_id) != this->sessions.end();
+        auto &shard = get_shard(remote_id);
+        lock_guard<mutex> lock(shard.lock);
+        return shard.sessions.find(remote_id) != shard.sessions.end();
     }
 
     SshSession *SshPool::get_session(const string &remote_id) const {
-        if (!has_session(remote_id)) {
+        auto &shard = get_shard(remote_id);
+        lock_guard<mutex> lock(shard.lock);
+        auto candidate = shard.sessions.find(remote_id);
+
+        if (candidate == shard.sessions.end()) {
             return nullptr;
         }
 
-        return const_cast<SshSession *>(this->sessions.find(remote_id)->second);
+        return const_cast<SshSession *>(candidate->second.session.get());
+    }
+
+    SshSessionLease SshPool::acquire_session(const string &remote_id, const function<SshSession *()> &connect) {
+        auto &shard = get_shard(remote_id);
+        unique_lock<mutex> lock(shard.lock);
+
+        shard.connected.wait(lock, [&]() {
+            return shard.connecting.find(remote_id) == shard.connecting.end();
+        });
+
+        auto candidate = shard.sessions.find(remote_id);
+        if (candidate != shard.sessions.end() && 0 == candidate->second.users) {
+            hits++;
+            candidate->second.users++;
+            touch(shard, candidate->second);
+
+            return SshSessionLease(this, remote_id, candidate->second.session);
+        }
+
+        misses++;
+
+        if (candidate != shard.sessions.end()) {
+            // Sessions can only be used by one thread at a time - while pooled one is in use, caller gets a session
+            // of its own, closed once the lease is released
+            lock.unlock();
+
+            return SshSessionLease(nullptr, remote_id, shared_ptr<const SshSession>(connect()));
+        }
+
+        shard.connecting.insert(remote_id);
+        lock.unlock();
+
+        shared_ptr<const SshSession> session;
+        try {
+            session = shared_ptr<const SshSession>(connect());
+        } catch (...) {
+            // Next one waiting, if any, tries connecting itself
+            lock.lock();
+            shard.connecting.erase(remote_id);
+            lock.unlock();
+            shard.connected.notify_all();
+            throw;
+        }
+
+        lock.lock();
+        shard.connecting.erase(remote_id);
+        auto evicted = evict(shard, 1);
+        shard.usage.push_front(remote_id);
+        shard.sessions.emplace(remote_id, Entry{session, 1, chrono::steady_clock::now(), shard.usage.begin()});
+        n_sessions++;
+        lock.unlock();
+        shard.connected.notify_all();
+
+        return SshSessionLease(this, remote_id, session);
     }
 
-    void SshPool::add_session(const string &remote_id, const SshSession *session) {
-        auto entry = pair<const string, const SshSession *>(remote_id, session);
-        this->sessions.insert(entry);
+    void SshPool::release_session(const string &remote_id, const SshSession *session) {
+        auto &shard = get_shard(remote_id);
+        // Declared before the lock, so that sessions are closed after it is released
+        vector<shared_ptr<const SshSession>> evicted;
+
+        lock_guard<mutex> lock(shard.lock);
+        auto candidate = shard.sessions.find(remote_id);
+
+        if (candidate == shard.sessions.end() || candidate->second.session.get() != session) {
+            return;
+        }
+
+        if (candidate->second.users > 0) {
+            candidate->second.users--;
+        }
+
+        touch(shard, candidate->second);
+        evicted = evict(shard, 0);
     }
 
     void SshPool::remove_session(const string &remote_id) {
-        auto candidate = sessions.find(remote_id);
+        auto &shard = get_shard(remote_id);
+        shared_ptr<const SshSession> removed;
+
+        lock_guard<mutex> lock(shard.lock);
+        auto candidate = shard.sessions.find(remote_id);
+
+        if (candidate == shard.sessions.end()) {
+            return;
+        }
+
+        removed = move(candidate->second.session);
+        shard.usage.erase(candidate->second.usage);
+        shard.sessions.erase(candidate);
+        n_sessions--;
+    }
+
+    void SshPool::remove_session(const string &remote_id, const SshSession *session) {
+        auto &shard = get_shard(remote_id);
+        shared_ptr<const SshSession> removed;
+
+        lock_guard<mutex> lock(shard.lock);
+        auto candidate = shard.sessions.find(remote_id);
 
-        if (candidate == sessions.end()) {
+        if (candidate == shard.sessions.end() || candidate->second.session.get() != session) {
             return;
         }
 
-        sessions.erase(remote_id);
-        delete (candidate->second);
+        removed = move(candidate->second.session);
+        shard.usage.erase(candidate->second.usage);
+        shard.sessions.erase(candidate);
+        n_sessions--;
+    }
+
+    SshPoolStats SshPool::get_stats() const {
+        return SshPoolStats{n_sessions, hits, misses, evictions};
+    }
+
+    shared_ptr<SshJumpHost> SshPool::get_jump_host(
+            const string &remote_id,
+            const function<SshJumpHost *()> &connect
+    ) {
+        lock_guard<mutex> lock(jump_hosts_lock);
+        auto candidate = jump_hosts.find(remote_id);
+
+        if (candidate != jump_hosts.end()) {
+            if (candidate->second->is_alive()) {
+                return candidate->second;
+            }
+
+            // Tunnels through lost connection fail, sessions using them reconnect - jump host itself is closed
+            // once everyone still holding it is done with it
+            jump_hosts.erase(candidate);
+        }
+
+        auto jump_host = shared_ptr<SshJumpHost>(connect());
+        jump_hosts.emplace(remote_id, jump_host);
+
+        return jump_host;
     }
-}
\ No newline at end of file
+}
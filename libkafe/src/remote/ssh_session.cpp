@@ -17,12 +17,197 @@
  * limitations under the License.
  */
 
+#include <cstdarg>
+#include <cstdlib>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
 #include "kafe/remote/ssh_session.hpp"
+#include "kafe/remote/ssh_auth.hpp"
+#include "kafe/remote/known_hosts.hpp"
 
 namespace kafe::remote {
+    SshSessionException::SshSessionException(const char *format, ...) : RuntimeException() {
+        va_list args;
+        va_start(args, format);
+        set_message(format, args);
+        va_end(args);
+    }
+
+    static const long SSH_DEFAULT_KEEPALIVE_INTERVAL = 30;
+
+    // Number of unanswered TCP keepalive probes after which connection is considered dead
+    static const int SSH_KEEPALIVE_PROBES = 4;
+
+    SshConnectException::SshConnectException(const string &reason) : SshSessionException("%s", reason.c_str()) {
+    }
+
+    static long get_env_seconds(const map<const string, const string> *envvals, const char *name, long default_value) {
+        auto env_value = envvals->find(name);
+        if (env_value == envvals->end() || env_value->second.empty()) {
+            return default_value;
+        }
+
+        char *end = nullptr;
+        auto value = strtol(env_value->second.c_str(), &end, 10);
+
+        if (nullptr == end || '\0' != *end || value < 0) {
+            throw SshSessionException("Environment variable <%s> must be a non-negative integer", name);
+        }
+
+        return value;
+    }
+
     SshSession::SshSession(const map<const string, const string> *envvals, const string &user, const string &host,
-                           unsigned int port, LogLevel level) {
-        ssh_session session_new = this->session = ssh_new();
+                           unsigned int port, LogLevel level)
+            : SshSession(envvals, user, host, port, level, get_connect_timeout(envvals)) {
+    }
+
+    SshSession::SshSession(
+            const map<const string, const string> *envvals,
+            const string &user,
+            const string &host,
+            unsigned int port,
+            LogLevel level,
+            long connect_timeout
+    ) : SshSession(envvals, user, host, port, level, connect_timeout, -1) {
+    }
+
+    SshSession::SshSession(
+            const map<const string, const string> *envvals,
+            const string &user,
+            const string &host,
+            unsigned int port,
+            LogLevel level,
+            long connect_timeout,
+            int socket_fd
+    ) {
+        session = ssh_new();
+
+        if (nullptr == session) {
+            if (socket_fd >= 0) {
+                ::close(socket_fd);
+            }
+            throw SshSessionException("Failed to allocate SSH session for host <%s:%d>", host.c_str(), port);
+        }
+
+        try {
+            connect(envvals, user, host, port, level, connect_timeout, socket_fd);
+        } catch (...) {
+            // Socket is only closed along with the session once libssh has taken it over when connecting
+            if (socket_fd >= 0 && ssh_get_fd(session) < 0) {
+                ::close(socket_fd);
+            }
+
+            // Destructor is not called when constructor throws
+            ssh_free(session);
+            throw;
+        }
+
+        if (connect_timeout > 0) {
+            // Timeout only applies to connecting - blocking calls made later, e.g. waiting for output of long
+            // running commands, must not time out
+            set_timeout(0);
+        }
+
+        configure_keepalive(get_keepalive_interval(envvals));
+    }
+
+    void SshSession::configure_keepalive(long keepalive_interval) {
+        auto fd = ssh_get_fd(session);
+
+        if (keepalive_interval <= 0 || fd < 0) {
+            return;
+        }
+
+        // Operating system probes idle connections, so connections that silently went away fail instead of hanging
+        int on = 1;
+        int idle = (int) keepalive_interval;
+        int probes = SSH_KEEPALIVE_PROBES;
+
+        setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &on, sizeof(on));
+#if defined(TCP_KEEPIDLE)
+        setsockopt(fd, IPPROTO_TCP, TCP_KEEPIDLE, &idle, sizeof(idle));
+#elif defined(TCP_KEEPALIVE)
+        setsockopt(fd, IPPROTO_TCP, TCP_KEEPALIVE, &idle, sizeof(idle));
+#endif
+#ifdef TCP_KEEPINTVL
+        setsockopt(fd, IPPROTO_TCP, TCP_KEEPINTVL, &idle, sizeof(idle));
+#endif
+#ifdef TCP_KEEPCNT
+        setsockopt(fd, IPPROTO_TCP, TCP_KEEPCNT, &probes, sizeof(probes));
+#endif
+    }
+
+    long SshSession::get_connect_timeout(const map<const string, const string> *envvals) {
+        return get_env_seconds(envvals, "KAFE_SSH_CONNECT_TIMEOUT", 0);
+    }
+
+    long SshSession::get_keepalive_interval(const map<const string, const string> *envvals) {
+        return get_env_seconds(envvals, "KAFE_SSH_KEEPALIVE", SSH_DEFAULT_KEEPALIVE_INTERVAL);
+    }
+
+    long SshSession::get_command_timeout(const map<const string, const string> *envvals) {
+        return get_env_seconds(envvals, "KAFE_SSH_COMMAND_TIMEOUT", 0);
+    }
+
+    static void set_transport_option(
+            ssh_session session,
+            const map<const string, const string> *envvals,
+            const char *name,
+            enum ssh_options_e option
+    ) {
+        auto env_value = envvals->find(name);
+        if (env_value == envvals->end() || env_value->second.empty()) {
+            return;
+        }
+
+        if (ssh_options_set(session, option, env_value->second.c_str()) < 0) {
+            throw SshSessionException("Unsupported value <%s> of <%s> - %s", env_value->second.c_str(), name,
+                                      ssh_get_error(session));
+        }
+    }
+
+    void SshSession::configure_transport(const map<const string, const string> *envvals) {
+        auto compression = envvals->find("KAFE_SSH_COMPRESSION");
+        if (compression != envvals->end() && !compression->second.empty()) {
+            const auto &value = compression->second;
+
+            // Compression level implies compression is enabled
+            if (1 == value.size() && value[0] >= '1' && value[0] <= '9') {
+                int level = value[0] - '0';
+                ssh_options_set(session, SSH_OPTIONS_COMPRESSION, "yes");
+                ssh_options_set(session, SSH_OPTIONS_COMPRESSION_LEVEL, &level);
+            } else if ("yes" == value || "no" == value) {
+                ssh_options_set(session, SSH_OPTIONS_COMPRESSION, value.c_str());
+            } else {
+                throw SshSessionException(
+                        "Unsupported value <%s> of <KAFE_SSH_COMPRESSION> - expected yes, no or level 1 to 9",
+                        value.c_str());
+            }
+        }
+
+        // Same algorithms are offered for both directions
+        set_transport_option(session, envvals, "KAFE_SSH_CIPHERS", SSH_OPTIONS_CIPHERS_C_S);
+        set_transport_option(session, envvals, "KAFE_SSH_CIPHERS", SSH_OPTIONS_CIPHERS_S_C);
+        set_transport_option(session, envvals, "KAFE_SSH_HMAC", SSH_OPTIONS_HMAC_C_S);
+        set_transport_option(session, envvals, "KAFE_SSH_HMAC", SSH_OPTIONS_HMAC_S_C);
+        set_transport_option(session, envvals, "KAFE_SSH_KEX", SSH_OPTIONS_KEY_EXCHANGE);
+        set_transport_option(session, envvals, "KAFE_SSH_HOSTKEYS", SSH_OPTIONS_HOSTKEYS);
+    }
+
+    void SshSession::connect(
+            const map<const string, const string> *envvals,
+            const string &user,
+            const string &host,
+            unsigned int port,
+            LogLevel level,
+            long connect_timeout,
+            int socket_fd
+    ) {
+        ssh_session session_new = this->session;
 
         int verbosity = SSH_LOG_NOLOG;
         if (level == LogLevel::ALL) {
@@ -36,21 +221,24 @@ namespace kafe::remote {
         ssh_options_set(session_new, SSH_OPTIONS_HOST, host.c_str());
         ssh_options_set(session_new, SSH_OPTIONS_PORT, &port);
 
+        configure_transport(envvals);
+
+        if (socket_fd >= 0) {
+            ssh_options_set(session_new, SSH_OPTIONS_FD, &socket_fd);
+        }
+
+        if (connect_timeout > 0) {
+            set_timeout(connect_timeout);
+        }
+
         auto result = ssh_connect(session_new);
 
         if (SSH_OK != result) {
             const auto *error = ssh_get_error(session_new);
-            throw SshSessionException("Remote connection failed. %s", error);
+            throw SshConnectException(string("Remote connection failed. ") + error);
         }
 
-#if LIBSSH_VERSION_INT >= SSH_VERSION_INT(0, 8, 4)
-        auto is_known = ssh_session_is_known_server(session_new);
-        auto is_known_b = SSH_KNOWN_HOSTS_OK == is_known;
-#else
-        auto is_known = ssh_is_server_known(session_new);
-        auto is_known_b = SSH_SERVER_KNOWN_OK == is_known;
-#endif
-        if (!is_known_b) {
+        if (!KnownHostsIndex::verify(session_new, host, port)) {
             throw SshSessionException(
                     "Cowardly refusing to connect to <%s:%d> - remote host key verification failed. "
                     "You are required to verify this host and add it to known hosts independently before "
@@ -72,24 +260,35 @@ namespace kafe::remote {
             user_passphrase = env_user_passphrase->second;
         }
 
+        auto auth_id = user + "@" + host + ":" + to_string(port);
+        auto &auth_cache = SshAuthCache::get_default();
+
+        // Method that worked before is tried without asking the remote for the list of methods first
+        auto choice = auth_cache.get_choice(auth_id);
+        if (SshAuthMethod::UNKNOWN != choice.method) {
+            if (SSH_AUTH_SUCCESS == authenticate(choice, key_passphrase, user_passphrase)) {
+                auth_cache.remember(auth_id, choice);
+                return;
+            }
+
+            auth_cache.forget(auth_id);
+        }
+
         auto req_retr_auth_none = ssh_userauth_none(session_new, nullptr);
 
+        if (SSH_AUTH_SUCCESS == req_retr_auth_none) {
+            return;
+        }
+
         if (SSH_AUTH_ERROR == req_retr_auth_none) {
             throw SshSessionException("Failed to fetch list of methods for host <%s:%d>", host.c_str(), port);
         }
 
         unsigned int methods = ssh_userauth_list(session_new, nullptr);
-        int is_auth;
 
         if (SSH_AUTH_METHOD_UNKNOWN == methods) {
             // Fallback to public key IF no method listed
-            is_auth = ssh_userauth_publickey_auto(
-                    session_new,
-                    nullptr,
-                    key_passphrase.empty() ? nullptr : key_passphrase.c_str()
-            );
-
-            if (SSH_AUTH_SUCCESS == is_auth) {
+            if (SSH_AUTH_SUCCESS == authenticate_publickey(auth_id, key_passphrase)) {
                 return;
             }
 
@@ -97,26 +296,23 @@ namespace kafe::remote {
         }
 
         if (methods & (unsigned int) SSH_AUTH_METHOD_PUBLICKEY) {
-            is_auth = ssh_userauth_publickey_auto(
-                    session_new,
-                    nullptr,
-                    key_passphrase.empty() ? nullptr : key_passphrase.c_str()
-            );
-            if (SSH_AUTH_SUCCESS == is_auth) {
+            if (SSH_AUTH_SUCCESS == authenticate_publickey(auth_id, key_passphrase)) {
                 return;
             }
         }
 
         if (methods & (unsigned int) SSH_AUTH_METHOD_GSSAPI_MIC) {
-            is_auth = ssh_userauth_gssapi(session_new);
-            if (SSH_AUTH_SUCCESS == is_auth) {
+            SshAuthChoice gssapi = {SshAuthMethod::GSSAPI, ""};
+            if (SSH_AUTH_SUCCESS == authenticate(gssapi, key_passphrase, user_passphrase)) {
+                auth_cache.remember(auth_id, gssapi);
                 return;
             }
         }
 
         if ((methods & (unsigned int) SSH_AUTH_METHOD_PASSWORD) && !user_passphrase.empty()) {
-            is_auth = ssh_userauth_password(session_new, nullptr, user_passphrase.c_str());
-            if (SSH_AUTH_SUCCESS == is_auth) {
+            SshAuthChoice password = {SshAuthMethod::PASSWORD, ""};
+            if (SSH_AUTH_SUCCESS == authenticate(password, key_passphrase, user_passphrase)) {
+                auth_cache.remember(auth_id, password);
                 return;
             }
         }
@@ -125,14 +321,114 @@ namespace kafe::remote {
         throw SshSessionException("Authentication failed for host <%s:%d>. %s", host.c_str(), port, error);
     }
 
-    SshSession::~SshSession() {
-        if (is_active()) {
-            ssh_free(this->session);
+    int SshSession::authenticate(
+            const SshAuthChoice &choice,
+            const string &key_passphrase,
+            const string &user_passphrase
+    ) const {
+        switch (choice.method) {
+            case SshAuthMethod::AGENT:
+                return ssh_userauth_agent(session, nullptr);
+            case SshAuthMethod::IDENTITY:
+                return SshAuthCache::get_default().authenticate_with_identity(session, choice.identity,
+                                                                               key_passphrase);
+            case SshAuthMethod::GSSAPI:
+                return ssh_userauth_gssapi(session);
+            case SshAuthMethod::PASSWORD:
+                if (user_passphrase.empty()) {
+                    return SSH_AUTH_DENIED;
+                }
+
+                return ssh_userauth_password(session, nullptr, user_passphrase.c_str());
+            default:
+                return SSH_AUTH_DENIED;
+        }
+    }
+
+    int SshSession::authenticate_publickey(const string &auth_id, const string &key_passphrase) const {
+        auto &auth_cache = SshAuthCache::get_default();
+        auto identities = SshAuthCache::get_identity_files(session);
+        const auto *agent_socket = getenv("SSH_AUTH_SOCK");
+        auto has_agent = nullptr != agent_socket && '\0' != *agent_socket;
+
+        if (!has_agent && identities.empty()) {
+            // Nothing known to try, libssh may still find keys elsewhere
+            return ssh_userauth_publickey_auto(
+                    session,
+                    nullptr,
+                    key_passphrase.empty() ? nullptr : key_passphrase.c_str()
+            );
+        }
+
+        // Same order as libssh would try them in - agent first, then identity files
+        if (has_agent) {
+            SshAuthChoice agent = {SshAuthMethod::AGENT, ""};
+            if (SSH_AUTH_SUCCESS == authenticate(agent, key_passphrase, "")) {
+                auth_cache.remember(auth_id, agent);
+                return SSH_AUTH_SUCCESS;
+            }
         }
+
+        for (const auto &identity : identities) {
+            SshAuthChoice choice = {SshAuthMethod::IDENTITY, identity};
+            auto rc = authenticate(choice, key_passphrase, "");
+
+            if (SSH_AUTH_SUCCESS == rc) {
+                auth_cache.remember(auth_id, choice);
+                return rc;
+            }
+
+            if (SSH_AUTH_ERROR == rc) {
+                return rc;
+            }
+        }
+
+        return SSH_AUTH_DENIED;
+    }
+
+    SshSession::~SshSession() {
+        close();
     }
 
     bool SshSession::is_active() const {
-        return static_cast<bool>(ssh_is_connected(session));
+        return !closed && static_cast<bool>(ssh_is_connected(session));
+    }
+
+    bool SshSession::is_alive() const {
+        if (!is_active()) {
+            return false;
+        }
+
+        auto fd = ssh_get_fd(session);
+        if (fd < 0) {
+            return false;
+        }
+
+        pollfd socket{fd, POLLIN, 0};
+        if (poll(&socket, 1, 0) < 0) {
+            return false;
+        }
+
+        if (socket.revents & (POLLERR | POLLHUP | POLLNVAL)) {
+            return false;
+        }
+
+        if (socket.revents & POLLIN) {
+            // Data waiting is fine, end of stream means remote has closed the connection
+            char next;
+            auto n_read = recv(fd, &next, 1, MSG_PEEK | MSG_DONTWAIT);
+            return 0 != n_read;
+        }
+
+        return true;
+    }
+
+    bool SshSession::send_keepalive() const {
+        return SSH_OK == ssh_send_ignore(session, "");
+    }
+
+    void SshSession::set_timeout(long timeout) const {
+        ssh_options_set(session, SSH_OPTIONS_TIMEOUT, &timeout);
     }
 
     ssh_session SshSession::get_ssh_session() const {
@@ -140,9 +436,15 @@ namespace kafe::remote {
     }
 
     void SshSession::close() const {
+        if (closed) {
+            return;
+        }
+
+        closed = true;
+
         if (ssh_is_connected(session)) {
             ssh_disconnect(session);
         }
         ssh_free(session);
     }
-}
\ No newline at end of file
+}
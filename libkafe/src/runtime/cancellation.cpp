@@ -0,0 +1,53 @@
+/**
+ * This file is part of Kafe.
+ * https://github.com/libkafe/kafe/
+ *
+ * Copyright 2020 Matiss Treinis
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <csignal>
+#include "kafe/runtime/cancellation.hpp"
+
+namespace kafe::runtime {
+    static volatile sig_atomic_t cancellation_requested = 0;
+
+    static void cancellation_interrupt_handler(int signal_number) {
+        if (cancellation_requested) {
+            // Second interrupt - user is not willing to wait for commands to stop
+            ::signal(signal_number, SIG_DFL);
+            ::raise(signal_number);
+            return;
+        }
+
+        cancellation_requested = 1;
+    }
+
+    void Cancellation::install_interrupt_handler() {
+        struct sigaction action{};
+        action.sa_handler = cancellation_interrupt_handler;
+        sigemptyset(&action.sa_mask);
+        action.sa_flags = SA_RESTART;
+
+        sigaction(SIGINT, &action, nullptr);
+    }
+
+    void Cancellation::request() {
+        cancellation_requested = 1;
+    }
+
+    bool Cancellation::is_requested() {
+        return 0 != cancellation_requested;
+    }
+}
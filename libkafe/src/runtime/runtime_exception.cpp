@@ -23,15 +23,19 @@
 
 namespace kafe::runtime {
     RuntimeException::RuntimeException(const char *format, ...) {
-        char buffer[4096];
         va_list args;
         va_start(args, format);
-        vsnprintf(buffer, 4096, format, args);
+        set_message(format, args);
         va_end(args);
+    }
+
+    void RuntimeException::set_message(const char *format, va_list args) {
+        char buffer[4096];
+        vsnprintf(buffer, 4096, format, args);
         this->message = buffer;
     }
 
     const char *RuntimeException::what() const noexcept {
-        return message;
+        return message.c_str();
     }
-}
\ No newline at end of file
+}
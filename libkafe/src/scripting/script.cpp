@@ -17,20 +17,30 @@
  * limitations under the License.
  */
 
+#include <chrono>
 #include <map>
+#include <mutex>
+#include <set>
+#include <thread>
 
 #include "kafe/version.hpp"
 #include "kafe/execution_scope.hpp"
 #include "kafe/scripting/script.hpp"
 #include "kafe/remote/ssh_manager.hpp"
 #include "kafe/remote/ssh_api.hpp"
+#include "kafe/remote/distributor.hpp"
 #include "kafe/io/archive.hpp"
 #include "kafe/io/file_system.hpp"
+#include "kafe/runtime/cancellation.hpp"
 
 using namespace kafe::io;
 
 static map<lua_State *, const ExecutionScope *> state;
 
+// Lua interpreter is not reentrant - only the thread holding this lock may touch any Lua state. Node workers
+// running in parallel release it only while blocked on remote or local I/O.
+static mutex interpreter_lock;
+
 static inline ExecutionScope *get_scope(lua_State *L) {
     auto res = state.find(L);
 
@@ -41,6 +51,66 @@ static inline ExecutionScope *get_scope(lua_State *L) {
     return const_cast<ExecutionScope *>(res->second);
 }
 
+class InterpreterRelease {
+public:
+    InterpreterRelease() {
+        interpreter_lock.unlock();
+    }
+
+    ~InterpreterRelease() {
+        interpreter_lock.lock();
+    }
+};
+
+class InterpreterReacquire {
+public:
+    InterpreterReacquire() {
+        interpreter_lock.lock();
+    }
+
+    ~InterpreterReacquire() {
+        interpreter_lock.unlock();
+    }
+};
+
+template<typename F>
+static inline auto without_interpreter(F callable) {
+    InterpreterRelease release;
+    return callable();
+}
+
+/**
+ * Wrap Lua function at given stack index as output line callback. Callback is invoked with interpreter released, so
+ * it takes the interpreter back for the duration of the Lua call. Errors raised by Lua function stop the command and
+ * are stored in callback_error to be raised once interpreter is owned by the caller again.
+ */
+static OutputLineCallback lua_output_line_callback(lua_State *L, int idx, string *callback_error) {
+    return [L, idx, callback_error](bool is_stderr, string_view line) {
+        InterpreterReacquire reacquire;
+
+        if (!line.empty() && '\n' == line.back()) {
+            line.remove_suffix(1);
+        }
+
+        lua_pushvalue(L, idx);
+        lua_pushlstring(L, line.data(), line.size());
+        lua_pushstring(L, is_stderr ? "stderr" : "stdout");
+
+        if (LUA_OK != lua_pcall(L, 2, 1, 0)) {
+            const auto *message = lua_tostring(L, -1);
+            *callback_error = nullptr == message ? "Output handler failed" : message;
+            lua_pop(L, 1);
+            return false;
+        }
+
+        // Handler returning nothing keeps the command running, only explicit false stops it
+        bool proceed = lua_isnil(L, -1) || lua_toboolean(L, -1);
+        lua_pop(L, 1);
+
+        return proceed;
+    };
+}
+
 namespace kafe::scripting {
     // Lua stdout/stderr
     // TODO: split line by line
@@ -109,6 +179,7 @@ namespace kafe::scripting {
     }
 
     void Script::evaluate() {
+        lock_guard<mutex> lock(interpreter_lock);
         int status = lua_pcall(this->lua_state, 0, LUA_MULTRET, 0);
 
         if (status) {
@@ -119,6 +190,7 @@ namespace kafe::scripting {
     }
 
     void Script::invoke_function_by_ref(const int reference, const vector<string> &extra_args) {
+        lock_guard<mutex> lock(interpreter_lock);
         lua_rawgeti(this->lua_state, LUA_REGISTRYINDEX, reference);
 
         for (const auto &var : extra_args) {
@@ -142,6 +214,134 @@ namespace kafe::scripting {
         return ar;
     }
 
+    static lua_Integer get_opt_integer(lua_State *L, int index, const char *key, lua_Integer default_value) {
+        lua_getfield(L, index, key);
+
+        if (lua_isnil(L, -1)) {
+            lua_pop(L, 1);
+            return default_value;
+        }
+
+        if (!lua_isinteger(L, -1)) {
+            lua_pop(L, 1);
+            return luaL_error(L, "Option <%s> must be an integer", key);
+        }
+
+        auto value = lua_tointeger(L, -1);
+        lua_pop(L, 1);
+
+        return value;
+    }
+
+    static bool get_opt_boolean(lua_State *L, int index, const char *key, bool default_value) {
+        lua_getfield(L, index, key);
+
+        if (lua_isnil(L, -1)) {
+            lua_pop(L, 1);
+            return default_value;
+        }
+
+        if (!lua_isboolean(L, -1)) {
+            lua_pop(L, 1);
+            return luaL_error(L, "Option <%s> must be a boolean", key);
+        }
+
+        auto value = static_cast<bool>(lua_toboolean(L, -1));
+        lua_pop(L, 1);
+
+        return value;
+    }
+
+    static string get_opt_string(lua_State *L, int index, const char *key, const string &default_value) {
+        lua_getfield(L, index, key);
+
+        if (lua_isnil(L, -1)) {
+            lua_pop(L, 1);
+            return default_value;
+        }
+
+        if (lua_type(L, -1) != LUA_TSTRING) {
+            lua_pop(L, 1);
+            luaL_error(L, "Option <%s> must be a string", key);
+            return default_value;
+        }
+
+        auto value = string(lua_tostring(L, -1));
+        lua_pop(L, 1);
+
+        return value;
+    }
+
+    /**
+     * Read second argument of exec functions - print output flag, line handler function or a table of options.
+     * Handler given in options table is left on top of the stack for the duration of the call.
+     */
+    static void get_exec_options(
+            lua_State *L,
+            bool &print_output,
+            OutputLineCallback &line_callback,
+            string *callback_error,
+            OutputCapturePolicy &policy,
+            long &timeout
+    ) {
+        if (lua_isboolean(L, 2)) {
+            print_output = static_cast<bool>(lua_toboolean(L, 2));
+            return;
+        }
+
+        if (lua_isfunction(L, 2)) {
+            print_output = false;
+            line_callback = lua_output_line_callback(L, 2, callback_error);
+            return;
+        }
+
+        if (!lua_istable(L, 2)) {
+            luaL_error(L, "Argument two is expected to be boolean, function or a table of options");
+            return;
+        }
+
+        auto head = get_opt_integer(L, 2, "head", 0);
+        auto tail = get_opt_integer(L, 2, "tail", 0);
+
+        if (head < 0 || tail < 0) {
+            luaL_error(L, "Options <head> and <tail> must be positive integers");
+            return;
+        }
+
+        if (head > 0 && tail > 0) {
+            luaL_error(L, "Options <head> and <tail> can not be used together");
+            return;
+        }
+
+        policy.head_bytes = (size_t) head;
+        policy.tail_lines = (size_t) tail;
+        policy.filter = get_opt_string(L, 2, "filter", "");
+
+        lua_getfield(L, 2, "timeout");
+        auto has_timeout = !lua_isnil(L, -1);
+        lua_pop(L, 1);
+
+        if (has_timeout) {
+            timeout = (long) get_opt_integer(L, 2, "timeout", 0);
+
+            if (timeout < 0) {
+                luaL_error(L, "Option <timeout> must not be negative");
+                return;
+            }
+        }
+
+        lua_getfield(L, 2, "handler");
+        if (lua_isfunction(L, -1)) {
+            print_output = get_opt_boolean(L, 2, "print_output", false);
+            line_callback = lua_output_line_callback(L, lua_gettop(L), callback_error);
+        } else if (lua_isnil(L, -1)) {
+            lua_pop(L, 1);
+            print_output = get_opt_boolean(L, 2, "print_output", print_output);
+        } else {
+            luaL_error(L, "Option <handler> must be a function");
+        }
+    }
+
     int lua_api_level_require(lua_State *L) {
         if (1 != lua_gettop(L) || !lua_isinteger(L, 1)) {
             return luaL_error(L, "Expected one argument - api level as integer");
@@ -225,15 +425,23 @@ namespace kafe::scripting {
       }
 
       bool print_output = true;
+      OutputLineCallback line_callback = nullptr;
+      string callback_error;
+      OutputCapturePolicy policy;
+      // Local commands are not subject to timeout
+      long timeout = -1;
       if (n_args == 2) {
-          if (!lua_isboolean(L, 2)) {
-              return luaL_error(L, "Argument two is expected to be boolean");
-          }
-          print_output = static_cast<bool>(lua_toboolean(L, 2));
+          get_exec_options(L, print_output, line_callback, &callback_error, policy, timeout);
       }
 
       auto command = scope->replace_vars(luaL_checkstring(L, 1));
-      auto result = scope->get_local_api()->local_popen(command, print_output);
+      auto result = without_interpreter([&]() {
+          return scope->get_local_api()->local_popen(command, print_output, line_callback, policy);
+      });
+
+      if (!callback_error.empty()) {
+          return luaL_error(L, "Output handler failed: %s", callback_error.c_str());
+      }
 
       if (scope->is_strict() && result.get_code() != 0) {
           throw ScriptStrictExecutionException();
@@ -269,7 +477,9 @@ namespace kafe::scripting {
       }
 
       auto command = scope->replace_vars(luaL_checkstring(L, 1));
-      auto result = scope->get_local_api()->local_popen(command, true);
+      auto result = without_interpreter([&]() {
+          return scope->get_local_api()->local_popen(command, true);
+      });
 
       if (scope->is_strict() && result.get_code() != 0) {
           throw ScriptStrictExecutionException();
@@ -281,11 +491,51 @@ namespace kafe::scripting {
     }
 
     // TODO: allow kDSN format - <env+role://user@host:port>
+    /**
+     * Get SSH options of inventory item from options table, by name of environment variable they override.
+     */
+    static map<string, string> get_inventory_ssh_options(lua_State *L, int index) {
+        map<string, string> ssh_options;
+
+        lua_getfield(L, index, "compression");
+        if (lua_isboolean(L, -1)) {
+            ssh_options.emplace("KAFE_SSH_COMPRESSION", lua_toboolean(L, -1) ? "yes" : "no");
+        } else if (lua_isinteger(L, -1)) {
+            auto level = lua_tointeger(L, -1);
+            if (level < 1 || level > 9) {
+                luaL_error(L, "Option <compression> must be boolean or compression level from 1 to 9");
+            }
+            ssh_options.emplace("KAFE_SSH_COMPRESSION", to_string(level));
+        } else if (!lua_isnil(L, -1)) {
+            luaL_error(L, "Option <compression> must be boolean or compression level from 1 to 9");
+        }
+        lua_pop(L, 1);
+
+        const pair<const char *, const char *> string_options[] = {
+                {"ciphers",  "KAFE_SSH_CIPHERS"},
+                {"hmac",     "KAFE_SSH_HMAC"},
+                {"kex",      "KAFE_SSH_KEX"},
+                {"hostkeys", "KAFE_SSH_HOSTKEYS"},
+                {"jump",     "KAFE_SSH_JUMP"},
+        };
+
+        for (const auto &[key, name] : string_options) {
+            auto value = get_opt_string(L, index, key, "");
+            if (!value.empty()) {
+                ssh_options.emplace(name, value);
+            }
+        }
+
+        return ssh_options;
+    }
+
     int lua_api_inventory_add(lua_State *L) {
         const auto *scope = get_scope(L);
+        int n_args = lua_gettop(L);
 
-        if (5 != lua_gettop(L)) {
-            return luaL_error(L, "Expected five arguments - username, hostname, port, environment, role");
+        if (5 != n_args && 6 != n_args) {
+            return luaL_error(L, "Expected five or six arguments - username, hostname, port, environment, role "
+                                 "and options");
         }
 
         if (!lua_isstring(L, 1)) {
@@ -308,6 +558,10 @@ namespace kafe::scripting {
             return luaL_error(L, "Argument five must be a string - role");
         }
 
+        if (6 == n_args && !lua_istable(L, 6)) {
+            return luaL_error(L, "Argument six must be a table of options");
+        }
+
         const auto *username = luaL_checkstring(L, 1);
         const auto *hostname = luaL_checkstring(L, 2);
         auto port = luaL_checkinteger(L, 3);
@@ -318,7 +572,12 @@ namespace kafe::scripting {
             return luaL_error(L, "Invalid port value <%s>", port);
         }
 
-        auto *item = new InventoryItem(username, hostname, (unsigned int) port, environment, role);
+        map<string, string> ssh_options;
+        if (6 == n_args) {
+            ssh_options = get_inventory_ssh_options(L, 6);
+        }
+
+        auto *item = new InventoryItem(username, hostname, (unsigned int) port, environment, role, ssh_options);
         auto *inventory = const_cast<Inventory *>(scope->get_inventory());
 
         if (inventory->item_exists(*item)) {
@@ -391,6 +650,232 @@ namespace kafe::scripting {
         return 0;
     }
 
+    static bool on_role_invoke_node(
+            lua_State *L,
+            ExecutionScope *scope,
+            const InventoryItem *item,
+            int function_reference
+    ) {
+        auto *logger = const_cast<ILogEventListener *>(scope->get_context()->get_log_listener());
+        auto remote_id = item->remote_id();
+        logger->emit_info("Entering node <%s>", remote_id.c_str());
+        logger->context_push(remote_id);
+        const auto *envvals = scope->get_context()->get_envvals();
+        auto ssh_manager = SshManager(scope->get_ssh_pool(), envvals, item);
+        auto ssh_api = SshApi(&ssh_manager, logger);
+
+        scope->set_current_remote(&ssh_api);
+        scope->set_strict(false);
+
+        int status;
+        try {
+            lua_rawgeti(L, LUA_REGISTRYINDEX, function_reference);
+            status = lua_pcall(L, 0, 0, 0);
+        } catch (ScriptStrictExecutionException &e) {
+            scope->clear_current_api();
+            logger->context_pop();
+            return false;
+        }
+
+        scope->clear_current_api();
+
+        if (status) {
+            const auto *lua_error = lua_tostring(L, -1);
+            const auto with_vars = scope->replace_vars(lua_error);
+            logger->emit_warning("%s", with_vars.c_str());
+            lua_pop(L, 1);
+            logger->context_pop();
+            return false;
+        }
+
+        logger->context_pop();
+        return true;
+    }
+
+    static map<string, bool> on_role_invoke_parallel(
+            lua_State *L,
+            ExecutionScope *scope,
+            const vector<const InventoryItem *> &queue,
+            int function_reference,
+            size_t parallel,
+            size_t max_failures
+    ) {
+        auto *logger = const_cast<ILogEventListener *>(scope->get_context()->get_log_listener());
+        auto logger_context = logger->get_context();
+
+        map<string, bool> results;
+        size_t next = 0;
+        size_t failures = 0;
+
+        auto worker = [&]() {
+            logger->context_inherit(logger_context);
+            lock_guard<mutex> lock(interpreter_lock);
+
+            while (failures <= max_failures && next < queue.size() && !Cancellation::is_requested()) {
+                const auto *item = queue[next++];
+
+                // Every node runs in its own Lua thread and scope - per node defines, strict mode and remote API
+                auto *node_state = lua_newthread(L);
+                auto node_state_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+                auto node_scope = ExecutionScope(scope);
+                state.insert(pair<lua_State *, const ExecutionScope *>(node_state, &node_scope));
+
+                bool ok;
+                try {
+                    ok = on_role_invoke_node(node_state, &node_scope, item, function_reference);
+                } catch (exception &e) {
+                    logger->emit_error("Node <%s> failed - %s", item->remote_id().c_str(), e.what());
+                    ok = false;
+                }
+
+                state.erase(node_state);
+                luaL_unref(L, LUA_REGISTRYINDEX, node_state_ref);
+
+                results[item->remote_id()] = ok;
+
+                if (!ok) {
+                    failures++;
+                }
+            }
+
+            logger->context_clear();
+        };
+
+        auto worker_count = min(parallel, queue.size());
+        logger->emit_debug("Starting <%zu> node workers", worker_count);
+
+        InterpreterRelease release;
+        vector<thread> workers;
+        for (size_t i = 0; i < worker_count; i++) {
+            workers.emplace_back(worker);
+        }
+
+        for (auto &thread : workers) {
+            thread.join();
+        }
+
+        return results;
+    }
+
+    static map<string, bool> on_role_invoke_batched(
+            lua_State *L,
+            ExecutionScope *scope,
+            const vector<const InventoryItem *> &queue,
+            int function_reference,
+            size_t batch_size,
+            size_t parallel,
+            size_t max_failures
+    ) {
+        auto *logger = const_cast<ILogEventListener *>(scope->get_context()->get_log_listener());
+        auto batch_count = (queue.size() + batch_size - 1) / batch_size;
+
+        map<string, bool> results;
+        size_t failures = 0;
+
+        for (size_t batch = 0; batch < batch_count; batch++) {
+            auto first = queue.begin() + batch * batch_size;
+            auto last = queue.begin() + min((batch + 1) * batch_size, queue.size());
+            auto batch_queue = vector<const InventoryItem *>(first, last);
+
+            auto timer = logger->emit_info_wt(
+                    "Starting batch <%zu> of <%zu> with <%zu> nodes",
+                    batch + 1,
+                    batch_count,
+                    batch_queue.size()
+            );
+
+            auto batch_results = on_role_invoke_parallel(
+                    L,
+                    scope,
+                    batch_queue,
+                    function_reference,
+                    parallel,
+                    max_failures - failures
+            );
+
+            size_t batch_failures = 0;
+            for (const auto &[remote_id, ok] : batch_results) {
+                results[remote_id] = ok;
+
+                if (!ok) {
+                    batch_failures++;
+                }
+            }
+
+            failures += batch_failures;
+
+            if (failures > max_failures) {
+                logger->emit_error(
+                        &timer,
+                        "Batch <%zu> failed on <%zu> nodes - aborting rollout, <%zu> failures exceed limit of <%zu>",
+                        batch + 1,
+                        batch_failures,
+                        failures,
+                        max_failures
+                );
+                break;
+            }
+
+            if (0 == batch_failures) {
+                logger->emit_success(&timer, "Batch <%zu> of <%zu> complete", batch + 1, batch_count);
+            } else {
+                logger->emit_warning(
+                        &timer,
+                        "Batch <%zu> of <%zu> complete with <%zu> failed nodes",
+                        batch + 1,
+                        batch_count,
+                        batch_failures
+                );
+            }
+        }
+
+        return results;
+    }
+
+    static size_t get_opt_batch_size(lua_State *L, int index, size_t node_count) {
+        lua_getfield(L, index, "batch");
+
+        if (lua_isnil(L, -1)) {
+            lua_pop(L, 1);
+            return 0;
+        }
+
+        if (lua_isinteger(L, -1)) {
+            auto batch_size = lua_tointeger(L, -1);
+            lua_pop(L, 1);
+
+            if (batch_size < 1) {
+                return luaL_error(L, "Option <batch> must be a positive integer or a percentage");
+            }
+
+            return (size_t) batch_size;
+        }
+
+        if (lua_type(L, -1) == LUA_TSTRING) {
+            auto batch_s = string(lua_tostring(L, -1));
+            lua_pop(L, 1);
+
+            size_t consumed = 0;
+            long percent = 0;
+            try {
+                percent = stol(batch_s, &consumed);
+            } catch (exception &e) {
+                consumed = 0;
+            }
+
+            if (consumed == 0 || consumed + 1 != batch_s.size() || '%' != batch_s[consumed]
+                || percent < 1 || percent > 100) {
+                return luaL_error(L, "Option <batch> must be a positive integer or a percentage, got <%s>",
+                                  batch_s.c_str());
+            }
+
+            return max((size_t) 1, (node_count * percent + 99) / 100);
+        }
+
+        lua_pop(L, 1);
+        return luaL_error(L, "Option <batch> must be a positive integer or a percentage");
+    }
+
     int lua_api_on_role_invoke(lua_State *L) {
         auto *scope = get_scope(L);
         auto *logger = const_cast<ILogEventListener *>(scope->get_context()->get_log_listener());
@@ -403,7 +888,8 @@ namespace kafe::scripting {
         auto n_args = lua_gettop(L);
         if (2 != n_args && 3 != n_args) {
             return luaL_error(L,
-                              "Expected two or three arguments, environment name and function to execute, and optional skip flag");
+                              "Expected two or three arguments, environment name and function to execute, "
+                              "and optional skip flag or table of options");
         }
 
         if (!lua_isstring(L, 1)) {
@@ -415,17 +901,37 @@ namespace kafe::scripting {
         }
 
         bool skip_empty = true;
+        bool has_options = false;
+        // Zero if not set, batches then run all their nodes at once
+        lua_Integer parallel = 0;
+        lua_Integer max_failures = 0;
 
         if (3 == n_args) {
-            if (!lua_isboolean(L, 3)) {
-                return luaL_error(L, "Argument three must be a boolean");
+            if (lua_isboolean(L, 3)) {
+                skip_empty = static_cast<bool>(lua_toboolean(L, 3));
+            } else if (lua_istable(L, 3)) {
+                has_options = true;
+                skip_empty = get_opt_boolean(L, 3, "skip_empty", skip_empty);
+                parallel = get_opt_integer(L, 3, "parallel", parallel);
+                max_failures = get_opt_integer(L, 3, "max_failures", max_failures);
+
+                lua_getfield(L, 3, "parallel");
+                auto has_parallel = !lua_isnil(L, -1);
+                lua_pop(L, 1);
+
+                if (has_parallel && parallel < 1) {
+                    return luaL_error(L, "Option <parallel> must be a positive integer");
+                }
+            } else {
+                return luaL_error(L, "Argument three must be a boolean or a table of options");
             }
+        }
 
-            skip_empty = static_cast<bool>(lua_toboolean(L, 3));
+        if (max_failures < 0) {
+            return luaL_error(L, "Option <max_failures> must not be negative");
         }
 
         const auto *role = luaL_checkstring(L, 1);
-        auto function_reference = luaL_ref(L, LUA_REGISTRYINDEX);
 
         auto inventory_items = scope->get_inventory()->find_for_scope(
                 scope->get_context()->get_environment(),
@@ -440,51 +946,86 @@ namespace kafe::scripting {
             return luaL_error(L, "Unable to invoke method on role <%s> - has no targets", role);
         }
 
+        // Same remote may be listed more than once, function is only invoked once for it
+        vector<const InventoryItem *> queue;
+        set<string> seen;
+        for (const auto *item : inventory_items) {
+            if (seen.insert(item->remote_id()).second) {
+                queue.push_back(item);
+            }
+        }
+
+        size_t batch_size = has_options ? get_opt_batch_size(L, 3, queue.size()) : 0;
+
+#if LIBSSH_VERSION_INT < SSH_VERSION_INT(0, 8, 0)
+        // Only parallelism asked for explicitly is an error, batches run one node at a time
+        if (parallel > 1) {
+            return luaL_error(L, "Parallel execution requires libkafe built with libssh 0.8 or newer");
+        }
+
+        parallel = 1;
+#else
+        // Batches run concurrently by default - explicit parallel option can only narrow that down
+        if (0 == parallel) {
+            parallel = batch_size > 0 ? (lua_Integer) batch_size : 1;
+        }
+#endif
+
+        // Function is only referenced once all arguments are checked, errors raised before do not leak the reference
+        lua_pushvalue(L, 2);
+        auto function_reference = luaL_ref(L, LUA_REGISTRYINDEX);
+
         logger->emit_info("Entering role <%s>", string(role).c_str());
         logger->context_push(string(role));
 
-        bool failed = false;
-        for (const auto *item : inventory_items) {
-            auto remote_id = item->remote_id();
-            logger->emit_info("Entering node <%s>", remote_id.c_str());
-            logger->context_push(remote_id);
-            const auto *envvals = scope->get_context()->get_envvals();
-            auto ssh_manager = SshManager(scope->get_ssh_pool(), envvals, item);
-            auto ssh_api = SshApi(&ssh_manager, logger);
+        map<string, bool> results;
+        if (batch_size > 0) {
+            results = on_role_invoke_batched(
+                    L, scope, queue, function_reference, batch_size, parallel, max_failures);
+        } else if (parallel > 1) {
+            results = on_role_invoke_parallel(L, scope, queue, function_reference, parallel, max_failures);
+        } else {
+            size_t failures = 0;
+            for (const auto *item : queue) {
+                if (Cancellation::is_requested()) {
+                    break;
+                }
+
+                auto ok = on_role_invoke_node(L, scope, item, function_reference);
+                results[item->remote_id()] = ok;
+
+                if (!ok && ++failures > (size_t) max_failures) {
+                    break;
+                }
+            }
+        }
 
-            scope->set_current_remote(&ssh_api);
-            scope->set_strict(false);
+        logger->context_pop();
+        luaL_unref(L, LUA_REGISTRYINDEX, function_reference);
 
-            int status;
-            try {
-                lua_rawgeti(L, LUA_REGISTRYINDEX, function_reference);
-                status = lua_pcall(L, 0, 0, 0);
-            } catch (ScriptStrictExecutionException &e) {
-                failed = true;
-                scope->clear_current_api();
-                logger->context_pop();
-                break;
+        // Nodes skipped due to cancellation never ran - report them as failed rather than leaving them out
+        bool cancelled = Cancellation::is_requested();
+        if (cancelled) {
+            for (const auto *item : queue) {
+                results.emplace(item->remote_id(), false);
             }
+        }
 
-            scope->clear_current_api();
-
-            if (status) {
-                failed = true;
-                const auto *lua_error = lua_tostring(L, -1);
-                const auto with_vars = scope->replace_vars(lua_error);
-                logger->emit_warning("%s", with_vars.c_str());
-                logger->context_pop();
-                break;
+        size_t failures = 0;
+        lua_createtable(L, 0, results.size());
+        for (const auto &[remote_id, ok] : results) {
+            if (!ok) {
+                failures++;
             }
 
-            logger->context_pop();
+            lua_pushboolean(L, ok);
+            lua_setfield(L, -2, remote_id.c_str());
         }
 
-        logger->context_pop();
+        lua_pushboolean(L, !cancelled && failures <= (size_t) max_failures);
+        lua_insert(L, -2);
 
-        lua_pushboolean(L, !failed);
-
-        return 1;
+        return 2;
     }
 
     int lua_api_invoke_func(lua_State *L) {
@@ -559,17 +1100,28 @@ namespace kafe::scripting {
         }
 
         bool print_output = true;
+        OutputLineCallback line_callback = nullptr;
+        string callback_error;
+        OutputCapturePolicy policy;
+        // Default timeout set by environment applies unless given
+        long timeout = -1;
         if (n_args == 2) {
-            if (!lua_isboolean(L, 2)) {
-                return luaL_error(L, "Argument two is expected to be boolean");
-            }
-            print_output = static_cast<bool>(lua_toboolean(L, 2));
+            get_exec_options(L, print_output, line_callback, &callback_error, policy, timeout);
         }
 
         auto command = scope->replace_vars(luaL_checkstring(L, 1));
         const auto *api = scope->get_current_api();
 
-        auto result = api->execute(command, print_output);
+        auto result = without_interpreter([&]() {
+            if (timeout < 0) {
+                return api->execute(command, print_output, line_callback, policy);
+            }
+            return api->execute(command, print_output, line_callback, policy, timeout);
+        });
+
+        if (!callback_error.empty()) {
+            return luaL_error(L, "Output handler failed: %s", callback_error.c_str());
+        }
 
         if (scope->is_strict() && result.get_code() != 0) {
             throw ScriptStrictExecutionException();
@@ -578,8 +1130,193 @@ namespace kafe::scripting {
         lua_pushstring(L, result.get_stdout().c_str());
         lua_pushstring(L, result.get_stderr().c_str());
         lua_pushinteger(L, result.get_code());
+        lua_pushboolean(L, result.is_timed_out());
+
+        return 4;
+    }
+
+    int lua_api_exec_to_file(lua_State *L) {
+        const auto *scope = get_scope(L);
+        const auto is_local = scope->get_context()->is_local_context();
+
+        if (!is_local && !scope->has_current_api()) {
+            return luaL_error(L, "Can not execute remote command when not in remote scope");
+        }
+
+        int n_args = lua_gettop(L);
 
-        return 3;
+        if (2 != n_args && 3 != n_args) {
+            return luaL_error(L, "Expected two or three arguments");
+        }
+
+        if (!lua_isstring(L, 1)) {
+            return luaL_error(L, "Argument one is expected to be string");
+        }
+
+        if (!lua_isstring(L, 2)) {
+            return luaL_error(L, "Argument two is expected to be string");
+        }
+
+        auto command = scope->replace_vars(luaL_checkstring(L, 1));
+        auto local_file = scope->replace_vars(luaL_checkstring(L, 2));
+        auto local_file_norm = FileSystem::normalize(local_file, scope->get_local_api()->get_chdir());
+
+        // Compress by default when the file name says so
+        auto extension = std_fs::path(local_file_norm).extension().string();
+        bool compress = ".gz" == extension;
+        bool print_output = true;
+
+        if (3 == n_args) {
+            if (!lua_istable(L, 3)) {
+                return luaL_error(L, "Argument three is expected to be a table of options");
+            }
+
+            compress = get_opt_boolean(L, 3, "compress", compress);
+            print_output = get_opt_boolean(L, 3, "print_output", print_output);
+        }
+
+        int code;
+        uint64_t size;
+
+        try {
+            if (is_local) {
+                auto result = without_interpreter([&]() {
+                    return scope->get_local_api()->local_popen_to_file(
+                            command, local_file_norm, compress, print_output);
+                });
+                code = result.get_code();
+                size = result.get_size();
+            } else {
+                const auto *api = scope->get_current_api();
+                auto result = without_interpreter([&]() {
+                    return api->execute_to_file(command, local_file_norm, compress, print_output);
+                });
+                code = result.get_code();
+                size = result.get_size();
+            }
+        } catch (exception &e) {
+            scope->get_context()->get_log_listener()->emit_error("Command output not saved - %s", e.what());
+            code = -1;
+            size = 0;
+        }
+
+        if (scope->is_strict() && code != 0) {
+            throw ScriptStrictExecutionException();
+        }
+
+        lua_pushinteger(L, code);
+        lua_pushinteger(L, (lua_Integer) size);
+
+        return 2;
+    }
+
+    int lua_api_exec_batch(lua_State *L) {
+        const auto *scope = get_scope(L);
+        const auto is_local = scope->get_context()->is_local_context();
+
+        if (!is_local && !scope->has_current_api()) {
+            return luaL_error(L, "Can not execute remote command when not in remote scope");
+        }
+
+        int n_args = lua_gettop(L);
+
+        if (1 != n_args && 2 != n_args) {
+            return luaL_error(L, "Expected one or two arguments");
+        }
+
+        if (!lua_istable(L, 1)) {
+            return luaL_error(L, "Argument one is expected to be a table of commands");
+        }
+
+        vector<string> commands;
+        auto n_commands = (size_t) lua_rawlen(L, 1);
+        for (size_t i = 1; i <= n_commands; i++) {
+            lua_rawgeti(L, 1, (lua_Integer) i);
+
+            if (!lua_isstring(L, -1)) {
+                return luaL_error(L, "Command <%d> is expected to be string", (int) i);
+            }
+
+            commands.push_back(scope->replace_vars(lua_tostring(L, -1)));
+            lua_pop(L, 1);
+        }
+
+        bool stop_on_failure = true;
+        bool print_output = true;
+
+        if (2 == n_args) {
+            if (!lua_istable(L, 2)) {
+                return luaL_error(L, "Argument two is expected to be a table of options");
+            }
+
+            stop_on_failure = get_opt_boolean(L, 2, "stop_on_failure", stop_on_failure);
+            print_output = get_opt_boolean(L, 2, "print_output", print_output);
+        }
+
+        vector<RemoteBatchResult> results;
+
+        try {
+            if (is_local) {
+                // Local commands are cheap to start, they are simply executed one after another
+                auto *local_api = scope->get_local_api();
+                results = without_interpreter([&]() {
+                    vector<RemoteBatchResult> local_results;
+
+                    for (const auto &command: commands) {
+                        auto started = chrono::steady_clock::now();
+                        auto result = local_api->local_popen(command, print_output);
+                        auto duration = chrono::duration_cast<chrono::milliseconds>(
+                                chrono::steady_clock::now() - started).count();
+
+                        string out = result.get_out();
+                        string err;
+                        local_results.emplace_back(out, err, result.get_code(), (uint64_t) duration);
+
+                        if (stop_on_failure && 0 != result.get_code()) {
+                            break;
+                        }
+                    }
+
+                    return local_results;
+                });
+            } else {
+                const auto *api = scope->get_current_api();
+                results = without_interpreter([&]() {
+                    return api->execute_batch(commands, stop_on_failure, print_output);
+                });
+            }
+        } catch (exception &e) {
+            scope->get_context()->get_log_listener()->emit_error("Batch not executed - %s", e.what());
+        }
+
+        bool ok = results.size() == commands.size();
+        for (const auto &result: results) {
+            ok = ok && 0 == result.get_code();
+        }
+
+        if (scope->is_strict() && !ok) {
+            throw ScriptStrictExecutionException();
+        }
+
+        lua_pushboolean(L, ok);
+        lua_newtable(L);
+
+        for (size_t i = 0; i < results.size(); i++) {
+            const auto &result = results[i];
+
+            lua_newtable(L);
+            lua_pushinteger(L, result.get_code());
+            lua_setfield(L, -2, "code");
+            lua_pushstring(L, result.get_stdout().c_str());
+            lua_setfield(L, -2, "stdout");
+            lua_pushstring(L, result.get_stderr().c_str());
+            lua_setfield(L, -2, "stderr");
+            lua_pushinteger(L, (lua_Integer) result.get_duration_ms());
+            lua_setfield(L, -2, "duration_ms");
+            lua_rawseti(L, -2, (lua_Integer) i + 1);
+        }
+
+        return 2;
     }
 
     int lua_api_remote_shell(lua_State *L) {
@@ -606,7 +1343,9 @@ namespace kafe::scripting {
         auto command = scope->replace_vars(luaL_checkstring(L, 1));
         const auto *api = scope->get_current_api();
 
-        auto result = api->execute(command, true);
+        auto result = without_interpreter([&]() {
+            return api->execute(command, true);
+        });
 
         if (scope->is_strict() && result.get_code() != 0) {
             throw ScriptStrictExecutionException();
@@ -640,7 +1379,9 @@ namespace kafe::scripting {
                 directory_norm.c_str()
         );
 
-        auto path = Archive::tmp_archive_from_directory(directory_norm, logger);
+        auto path = without_interpreter([&]() {
+            return Archive::tmp_archive_from_directory(directory_norm, logger);
+        });
 
         scope->get_context()->get_log_listener()->emit_success(
                 &timer,
@@ -681,7 +1422,9 @@ namespace kafe::scripting {
                 archive_norm.c_str()
         );
 
-        Archive::archive_from_directory(archive_norm, directory_norm, logger);
+        without_interpreter([&]() {
+            Archive::archive_from_directory(archive_norm, directory_norm, logger);
+        });
 
         scope->get_context()->get_log_listener()->emit_success(
                 &timer,
@@ -692,6 +1435,81 @@ namespace kafe::scripting {
         return 0;
     }
 
+    /**
+     * Read transfer options table at given index, named by its argument position in errors, on top of defaults from
+     * environment.
+     */
+    static TransferOptions get_transfer_options(lua_State *L, int index, const char *position) {
+        TransferOptions options;
+
+        try {
+            options = TransferOptions::from_env(get_scope(L)->get_context()->get_envvals());
+        } catch (exception &e) {
+            luaL_error(L, "%s", e.what());
+            return options;
+        }
+
+        if (lua_isnoneornil(L, index)) {
+            return options;
+        }
+
+        if (!lua_istable(L, index)) {
+            luaL_error(L, "Argument %s is expected to be a table of options", position);
+            return options;
+        }
+
+        lua_getfield(L, index, "engine");
+        auto has_engine = !lua_isnil(L, -1);
+        lua_pop(L, 1);
+
+        auto engine = get_opt_string(L, index, "engine", TRANSFER_SCP == options.engine ? "scp" : "sftp");
+        if ("scp" == engine) {
+            options.engine = TRANSFER_SCP;
+        } else if ("sftp" == engine) {
+            options.engine = TRANSFER_SFTP;
+        } else {
+            luaL_error(L, "Option <engine> must be either scp or sftp");
+            return options;
+        }
+
+        auto chunk_size = get_opt_integer(L, index, "chunk_size", (lua_Integer) options.chunk_size);
+        auto requests = get_opt_integer(L, index, "requests", (lua_Integer) options.max_requests);
+        auto streams = get_opt_integer(L, index, "streams", (lua_Integer) options.streams);
+
+        if (chunk_size < 1 || requests < 1 || streams < 1) {
+            luaL_error(L, "Options <chunk_size>, <requests> and <streams> must be positive integers");
+            return options;
+        }
+
+        options.chunk_size = (size_t) chunk_size;
+        options.max_requests = (size_t) requests;
+        options.streams = (size_t) streams;
+        options.verify = get_opt_boolean(L, index, "verify", options.verify);
+        options.delta_base = get_opt_string(L, index, "base", options.delta_base);
+        options.use_cache = get_opt_boolean(L, index, "cache", options.use_cache);
+        options.skip_identical = get_opt_boolean(
+                L, index, "skip_identical", options.skip_identical || options.use_cache);
+
+        auto block_size = get_opt_integer(L, index, "block_size", (lua_Integer) options.block_size);
+        if (block_size < 1) {
+            luaL_error(L, "Option <block_size> must be a positive integer");
+            return options;
+        }
+        options.block_size = (size_t) block_size;
+
+        // Delta and parallel uploads are only done over SFTP, they are not turned into a full upload over SCP
+        if (!options.delta_base.empty() || options.streams > 1) {
+            if (has_engine && TRANSFER_SCP == options.engine) {
+                luaL_error(L, "Options <base> and <streams> require engine sftp");
+                return options;
+            }
+
+            options.engine = TRANSFER_SFTP;
+        }
+
+        return options;
+    }
+
     int lua_api_upload_file(lua_State *L) {
         const auto *scope = get_scope(L);
 
@@ -701,8 +1519,8 @@ namespace kafe::scripting {
 
         int n_args = lua_gettop(L);
 
-        if (2 != n_args) {
-            return luaL_error(L, "Expected two arguments");
+        if (2 != n_args && 3 != n_args) {
+            return luaL_error(L, "Expected two or three arguments");
         }
 
         if (!lua_isstring(L, 1)) {
@@ -716,6 +1534,8 @@ namespace kafe::scripting {
         auto local_file = scope->replace_vars(luaL_checkstring(L, 1));
         auto remote_file = scope->replace_vars(luaL_checkstring(L, 2));
 
+        auto options = get_transfer_options(L, 3, "three");
+
         auto local_file_norm = FileSystem::normalize(local_file, scope->get_local_api()->get_chdir());
 
         const auto *api = scope->get_current_api();
@@ -727,7 +1547,9 @@ namespace kafe::scripting {
         );
 
         try {
-            api->scp_upload_file(local_file_norm, remote_file);
+            without_interpreter([&]() {
+                api->upload_file(local_file_norm, remote_file, options);
+            });
             lua_pushboolean(L, true);
 
             scope->get_context()->get_log_listener()->emit_success(
@@ -761,8 +1583,8 @@ namespace kafe::scripting {
 
         int n_args = lua_gettop(L);
 
-        if (2 != n_args) {
-            return luaL_error(L, "Expected two arguments");
+        if (2 != n_args && 3 != n_args) {
+            return luaL_error(L, "Expected two or three arguments");
         }
 
         if (!lua_isstring(L, 1)) {
@@ -776,6 +1598,8 @@ namespace kafe::scripting {
         auto local_file = scope->replace_vars(luaL_checkstring(L, 1));
         auto remote_file = scope->replace_vars(luaL_checkstring(L, 2));
 
+        auto options = get_transfer_options(L, 3, "three");
+
         auto local_file_norm = FileSystem::normalize(local_file, scope->get_local_api()->get_chdir());
 
         const auto *api = scope->get_current_api();
@@ -787,7 +1611,9 @@ namespace kafe::scripting {
         );
 
         try {
-            api->scp_download_file(local_file_norm, remote_file);
+            without_interpreter([&]() {
+                api->download_file(local_file_norm, remote_file, options);
+            });
             lua_pushboolean(L, true);
 
             scope->get_context()->get_log_listener()->emit_success(
@@ -810,6 +1636,223 @@ namespace kafe::scripting {
         return 1;
     }
 
+    int lua_api_prewarm(lua_State *L) {
+        auto *scope = get_scope(L);
+        auto *logger = const_cast<ILogEventListener *>(scope->get_context()->get_log_listener());
+
+        if (scope->has_current_api()) {
+            return luaL_error(L, "Can not pre-warm connections when already scoped by kafe.on(...)");
+        }
+
+        auto n_args = lua_gettop(L);
+        if (1 != n_args && 2 != n_args) {
+            return luaL_error(L, "Expected one or two arguments - role and options");
+        }
+
+        if (!lua_isstring(L, 1)) {
+            return luaL_error(L, "Argument one must be a string role name");
+        }
+
+        if (2 == n_args && !lua_istable(L, 2)) {
+            return luaL_error(L, "Argument two must be a table of options");
+        }
+
+        long connect_timeout;
+        try {
+            connect_timeout = SshSession::get_connect_timeout(scope->get_context()->get_envvals());
+        } catch (exception &e) {
+            return luaL_error(L, "%s", e.what());
+        }
+
+        lua_Integer parallel = 32;
+        if (2 == n_args) {
+            parallel = get_opt_integer(L, 2, "parallel", parallel);
+            connect_timeout = (long) get_opt_integer(L, 2, "timeout", connect_timeout);
+        }
+
+        if (parallel < 1) {
+            return luaL_error(L, "Option <parallel> must be a positive integer");
+        }
+
+        if (connect_timeout < 0) {
+            return luaL_error(L, "Option <timeout> must not be negative");
+        }
+
+        const auto *role = luaL_checkstring(L, 1);
+        auto inventory_items = scope->get_inventory()->find_for_scope(
+                scope->get_context()->get_environment(),
+                role
+        );
+        // Same remote may be listed more than once, it is only connected to once
+        vector<const InventoryItem *> items;
+        set<string> seen;
+        for (const auto *item : inventory_items) {
+            if (seen.insert(item->remote_id()).second) {
+                items.push_back(item);
+            }
+        }
+
+        logger->context_push(string(role));
+
+        // Connections past pool size would close the ones made first right away, so they are not made at all
+        auto max_sessions = scope->get_ssh_pool()->get_size_limit();
+        if (0 != max_sessions && items.size() > max_sessions) {
+            logger->emit_warning("Role has <%zu> servers, only the first <%zu> are connected to in advance - raise "
+                                 "KAFE_SSH_POOL_SIZE to keep connections to all", items.size(), max_sessions);
+            items.resize(max_sessions);
+        }
+
+        auto timer = logger->emit_info_wt("Connecting to <%zu> servers", items.size());
+
+        auto failures = without_interpreter([&]() {
+            return SshManager::prewarm(
+                    scope->get_ssh_pool(),
+                    scope->get_context()->get_envvals(),
+                    items,
+                    logger->get_level(),
+                    (size_t) parallel,
+                    connect_timeout
+            );
+        });
+
+        lua_createtable(L, 0, items.size());
+        for (const auto *item : items) {
+            auto failure = failures.find(item->remote_id());
+            auto ok = failure == failures.end();
+
+            if (!ok) {
+                logger->emit_warning("Server <%s> is unreachable - %s", item->remote_id().c_str(),
+                                     failure->second.c_str());
+            }
+
+            lua_pushboolean(L, ok);
+            lua_setfield(L, -2, item->remote_id().c_str());
+        }
+
+        if (failures.empty()) {
+            logger->emit_success(&timer, "Connected to all servers");
+        } else {
+            logger->emit_warning(&timer, "Failed to connect to <%zu> servers", failures.size());
+        }
+
+        logger->context_pop();
+
+        if (!failures.empty() && scope->is_strict()) {
+            throw ScriptStrictExecutionException();
+        }
+
+        lua_pushboolean(L, failures.empty());
+        lua_insert(L, -2);
+
+        return 2;
+    }
+
+    int lua_api_distribute(lua_State *L) {
+        auto *scope = get_scope(L);
+        auto *logger = const_cast<ILogEventListener *>(scope->get_context()->get_log_listener());
+
+        if (scope->has_current_api()) {
+            return luaL_error(L, "Can not distribute files when already scoped by kafe.on(...)");
+        }
+
+        auto n_args = lua_gettop(L);
+        if (3 != n_args && 4 != n_args) {
+            return luaL_error(L, "Expected three or four arguments - role, local file, remote file and options");
+        }
+
+        if (!lua_isstring(L, 1)) {
+            return luaL_error(L, "Argument one must be a string role name");
+        }
+
+        if (!lua_isstring(L, 2)) {
+            return luaL_error(L, "Argument two is expected to be string");
+        }
+
+        if (!lua_isstring(L, 3)) {
+            return luaL_error(L, "Argument three is expected to be string");
+        }
+
+        auto options = get_transfer_options(L, 4, "four");
+        lua_Integer fanout = 2;
+        lua_Integer parallel = 32;
+        string mode = "tree";
+        if (4 == n_args) {
+            fanout = get_opt_integer(L, 4, "fanout", fanout);
+            parallel = get_opt_integer(L, 4, "parallel", parallel);
+            mode = get_opt_string(L, 4, "mode", mode);
+        }
+
+        if (fanout < 1) {
+            return luaL_error(L, "Option <fanout> must be a positive integer");
+        }
+
+        if (parallel < 1) {
+            return luaL_error(L, "Option <parallel> must be a positive integer");
+        }
+
+        if ("tree" != mode && "multicast" != mode) {
+            return luaL_error(L, "Option <mode> must be either tree or multicast");
+        }
+
+        const auto *role = luaL_checkstring(L, 1);
+        auto local_file = scope->replace_vars(luaL_checkstring(L, 2));
+        auto remote_file = scope->replace_vars(luaL_checkstring(L, 3));
+        auto local_file_norm = FileSystem::normalize(local_file, scope->get_local_api()->get_chdir());
+
+        if (!FileSystem::is_file_or_symlink(local_file_norm)) {
+            return luaL_error(L, "File <%s> is not file", local_file_norm.c_str());
+        }
+
+        auto inventory_items = scope->get_inventory()->find_for_scope(
+                scope->get_context()->get_environment(),
+                role
+        );
+        auto nodes = vector<const InventoryItem *>(inventory_items.begin(), inventory_items.end());
+
+        logger->context_push(string(role));
+
+        map<string, bool> results;
+        try {
+            results = without_interpreter([&]() {
+                Distributor distributor(
+                        scope->get_ssh_pool(),
+                        scope->get_context()->get_envvals(),
+                        logger,
+                        options,
+                        (size_t) fanout,
+                        (size_t) parallel
+                );
+                if ("multicast" == mode) {
+                    return distributor.multicast(nodes, local_file_norm, remote_file);
+                }
+
+                return distributor.distribute(nodes, local_file_norm, remote_file);
+            });
+        } catch (exception &e) {
+            logger->context_pop();
+            return luaL_error(L, "Distribution failed - %s", e.what());
+        }
+
+        logger->context_pop();
+
+        bool ok = true;
+        lua_createtable(L, 0, results.size());
+        for (const auto &[remote_id, node_ok] : results) {
+            ok = ok && node_ok;
+            lua_pushboolean(L, node_ok);
+            lua_setfield(L, -2, remote_id.c_str());
+        }
+
+        if (!ok && scope->is_strict()) {
+            throw ScriptStrictExecutionException();
+        }
+
+        lua_pushboolean(L, ok);
+        lua_insert(L, -2);
+
+        return 2;
+    }
+
     int lua_api_upload_str(lua_State *L) {
         const auto *scope = get_scope(L);
 
@@ -819,8 +1862,8 @@ namespace kafe::scripting {
 
         int n_args = lua_gettop(L);
 
-        if (2 != n_args) {
-            return luaL_error(L, "Expected two arguments");
+        if (2 != n_args && 3 != n_args) {
+            return luaL_error(L, "Expected two or three arguments");
         }
 
         if (!lua_isstring(L, 1)) {
@@ -833,6 +1876,7 @@ namespace kafe::scripting {
 
         auto content = scope->replace_vars(luaL_checkstring(L, 1));
         auto remote_file = scope->replace_vars(luaL_checkstring(L, 2));
+        auto options = get_transfer_options(L, 3, "three");
 
         const auto *api = scope->get_current_api();
 
@@ -842,7 +1886,9 @@ namespace kafe::scripting {
         );
 
         try {
-            api->scp_upload_file_from_string(content, remote_file);
+            without_interpreter([&]() {
+                api->upload_string(content, remote_file, options);
+            });
             lua_pushboolean(L, true);
 
             scope->get_context()->get_log_listener()->emit_success(
@@ -890,7 +1936,9 @@ namespace kafe::scripting {
         );
 
         try {
-            auto string = api->scp_download_file_as_string(remote_file);
+            auto string = without_interpreter([&]() {
+                return api->scp_download_file_as_string(remote_file);
+            });
             lua_pushstring(L, string.c_str());
 
             scope->get_context()->get_log_listener()->emit_success(
@@ -992,6 +2040,8 @@ namespace kafe::scripting {
             {"invoke",          lua_api_invoke_func},
             {"within",          lua_api_remote_within},
             {"exec",            lua_api_remote_exec},
+            {"exec_to_file",    lua_api_exec_to_file},
+            {"exec_batch",      lua_api_exec_batch},
             {"shell",           lua_api_remote_shell},
             {"archive_dir_tmp", lua_api_archive_dir_tmp},
             {"archive_dir",     lua_api_archive_dir},
@@ -999,6 +2049,8 @@ namespace kafe::scripting {
             {"download_file",   lua_api_download_file},
             {"upload_str",      lua_api_upload_str},
             {"download_str",    lua_api_download_str},
+            {"distribute",      lua_api_distribute},
+            {"prewarm",         lua_api_prewarm},
             {"define",          lua_api_define},
             {"strfvars",        lua_api_strfvars},
             {"strfenv",         lua_api_strfenv},